@@ -45,28 +45,34 @@
 
 #include "Player.hpp"
 
+int RetroWavePlayer::term_fd = STDIN_FILENO;
+
 void RetroWavePlayer::term_attr_disable_buffering() {
 	struct termios oldt, newt;
-	tcgetattr(STDIN_FILENO, &oldt);
+	tcgetattr(term_fd, &oldt);
 	newt = oldt;
 	newt.c_lflag &= ~( ICANON | ECHO );
-	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	tcsetattr(term_fd, TCSANOW, &newt);
 }
 
 void RetroWavePlayer::term_attr_save() {
-	tcgetattr(STDIN_FILENO, &term_state);
+	tcgetattr(term_fd, &term_state);
 }
 
 void RetroWavePlayer::term_attr_load() {
-	tcsetattr(STDIN_FILENO, TCSANOW, static_cast<const termios *>(&term_state));
+	tcsetattr(term_fd, TCSANOW, static_cast<const termios *>(&term_state));
 }
 
 int RetroWavePlayer::term_read_char() {
 #ifndef EMSCRIPTEN
 	uint8_t buf;
-	set_nonblocking(STDIN_FILENO);
-	ssize_t rc = read(STDIN_FILENO, &buf, 1);
-	set_nonblocking(STDIN_FILENO, false);
+
+	if (term_fd < 0)
+		return -1;
+
+	set_nonblocking(term_fd);
+	ssize_t rc = read(term_fd, &buf, 1);
+	set_nonblocking(term_fd, false);
 
 	if (rc == 1)
 		return buf;
@@ -86,6 +92,11 @@ void RetroWavePlayer::term_move_0_0() {
 }
 
 void RetroWavePlayer::controls_parse_key_commands() {
+	if (exit_signal) {
+		puts("Exiting...");
+		do_exit(1);
+	}
+
 	int c = term_read_char();
 
 	switch (c) {
@@ -122,6 +133,10 @@ void RetroWavePlayer::single_frame_hook() {
 		return;
 
 	flush_chips();
+
+	if (wire_cache.active())
+		wire_resync();
+
 	osd_show();
 	puts("== Single frame mode ==");
 
@@ -142,7 +157,7 @@ void RetroWavePlayer::single_frame_hook() {
 				single_step = false;
 				done = true;
 				term_clear();
-				clock_gettime(RETROWAVE_PLAYER_TIME_REF, &sleep_end);
+				timing_rebase(played_samples);
 				break;
 			case SINGLE_FRAME:
 //				puts("== Next frame ==");
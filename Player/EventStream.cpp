@@ -0,0 +1,286 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+size_t RetroWavePlayer::vgm_command_length(const uint8_t *p, size_t remain) {
+	size_t len;
+	uint8_t cmd = p[0];
+
+	if (cmd == 0x67) {
+		if (remain < 7)
+			return 0;
+		len = 7 + (p[3] | (p[4] << 8) | (p[5] << 16) | ((uint32_t)p[6] << 24));
+	} else if (cmd >= 0x30 && cmd <= 0x3f) {
+		len = 2;
+	} else if (cmd >= 0x40 && cmd <= 0x4e) {
+		len = 3;
+	} else if (cmd == 0x4f || cmd == 0x50) {
+		len = 2;
+	} else if (cmd >= 0x51 && cmd <= 0x5f) {
+		len = 3;
+	} else if (cmd == 0x61) {
+		len = 3;
+	} else if (cmd == 0x62 || cmd == 0x63 || cmd == 0x66) {
+		len = 1;
+	} else if (cmd == 0x68) {
+		len = 12;
+	} else if (cmd >= 0x70 && cmd <= 0x8f) {
+		len = 1;
+	} else if (cmd >= 0x90 && cmd <= 0x92) {
+		len = 5;
+	} else if (cmd == 0x93) {
+		len = 11;
+	} else if (cmd == 0x94) {
+		len = 2;
+	} else if (cmd == 0x95) {
+		len = 5;
+	} else if (cmd >= 0xa0 && cmd <= 0xbf) {
+		len = 3;
+	} else if (cmd >= 0xc0 && cmd <= 0xdf) {
+		len = 4;
+	} else if (cmd >= 0xe0) {
+		len = 5;
+	} else {
+		return 0;
+	}
+
+	return len <= remain ? len : 0;
+}
+
+bool RetroWavePlayer::vgm_is_wait(uint8_t cmd) {
+	return cmd == 0x61 || cmd == 0x62 || cmd == 0x63 || (cmd & 0xf0) == 0x70;
+}
+
+uint32_t RetroWavePlayer::vgm_wait_samples(const uint8_t *p) {
+	switch (p[0]) {
+		case 0x61: return p[1] | (p[2] << 8);
+		case 0x62: return 735;
+		case 0x63: return 882;
+		default:   return (p[0] & 0xf) + 1;
+	}
+}
+
+static inline bool event_supported(uint8_t cmd) {
+	switch (cmd) {
+		case 0x5a: case 0xaa: case 0x5e: case 0x5f:
+		case 0xbd: case 0x50: case 0x51: case 0x30:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void RetroWavePlayer::compile_track() {
+	compiled.clear();
+
+	const uint8_t *data = file_buf.data();
+	size_t pos = data_offset_abs, end = file_buf.size();
+
+	// Same frame and ordinal counting as the lookahead plan, so moved writes land where it put them
+	uint32_t frame_idx = 0, opl3_ordinal = 0;
+	CompiledTrack::Frame frame = {0, 0, 0, 0};
+
+	bool disabled[256] = {false};
+
+	for (auto cmd : disabled_vgm_commands)
+		disabled[cmd] = true;
+
+	// A 2 byte command per event is the common case
+	compiled.events.reserve((end - pos) / 3);
+
+	auto add_event = [&](uint8_t cmd, uint8_t reg, uint8_t val) {
+		compiled.events.push_back({cmd, reg, val});
+		frame.count++;
+	};
+
+	while (pos < end) {
+		uint8_t cmd = data[pos];
+		size_t len = vgm_command_length(data + pos, end - pos);
+
+		if (!len || cmd == 0x66)
+			break;
+
+		if (vgm_is_wait(cmd)) {
+			auto it = lookahead_inject.find(frame_idx);
+
+			if (it != lookahead_inject.end()) {
+				for (auto &w : it->second) {
+					if (!disabled[w.cmd]) {
+						add_event(w.cmd, w.reg, w.val);
+						frame.bytes += 2;
+					}
+				}
+			}
+
+			frame.wait = vgm_wait_samples(data + pos);
+			compiled.frames.push_back(frame);
+
+			frame = {(uint32_t)compiled.events.size(), 0, 0, 0};
+			frame_idx++;
+			opl3_ordinal = 0;
+		} else {
+			bool skip = false;
+
+			if (cmd == 0x5a || cmd == 0x5e || cmd == 0x5f) {
+				if (!lookahead_skip.empty())
+					skip = lookahead_skip.count(((uint64_t)frame_idx << 32) | opl3_ordinal);
+
+				opl3_ordinal++;
+			}
+
+			if (!skip && !disabled[cmd] && cmd != 0x67) {
+				frame.bytes += len - 1;
+
+				if (event_supported(cmd)) {
+					if (len == 2)
+						add_event(cmd, 0, data[pos + 1]);
+					else
+						add_event(cmd, data[pos + 1], data[pos + 2]);
+				}
+			}
+		}
+
+		pos += len;
+	}
+
+	frame.wait = CompiledTrack::no_wait;
+	compiled.frames.push_back(frame);
+	compiled.events.shrink_to_fit();
+}
+
+bool RetroWavePlayer::queue_event(const CompiledTrack::Event &ev) {
+	switch (ev.cmd) {
+		case 0x5a:
+		case 0x5e:
+			retrowave_opl3_queue_port0(wctx, ev.reg, ev.val);
+			break;
+		case 0xaa:
+		case 0x5f:
+			retrowave_opl3_queue_port1(wctx, ev.reg, ev.val);
+			break;
+		case 0xbd:
+			retrowave_miniblaster_queue(wctx, ev.reg, ev.val);
+			break;
+		case 0x51:
+			retrowave_mastergear_queue_ym2413(wctx, ev.reg, ev.val);
+			break;
+		case 0x50:
+			sn76489_queue(0, ev.val);
+			return false;
+		case 0x30:
+			sn76489_queue(1, ev.val);
+			return false;
+	}
+
+	return true;
+}
+
+int RetroWavePlayer::play_compiled() {
+	// Looked up once per chip, the hot loop only indexes
+	std::vector<uint8_t> *regs[256] = {};
+	std::unordered_set<uint16_t> *refreshed[256] = {};
+
+	const auto *events = compiled.events.data();
+
+	for (auto &frame : compiled.frames) {
+		queued_bytes += frame.bytes;
+
+		for (auto ev = events + frame.first, ev_end = ev + frame.count; ev != ev_end; ev++) {
+			if (queue_event(*ev)) {
+				if (!regs[ev->cmd]) {
+					regs[ev->cmd] = &reg_map[ev->cmd];
+					refreshed[ev->cmd] = &reg_map_refreshed_list[ev->cmd];
+				}
+
+				auto &v = *regs[ev->cmd];
+
+				if (v.size() < ev->reg + 1U)
+					v.resize((ev->reg + 1 + 15) & ~15); // Same rounding as regmap_insert()
+
+				v[ev->reg] = ev->val;
+				refreshed[ev->cmd]->insert(ev->reg);
+			}
+
+			if (single_step)
+				single_frame_hook();
+		}
+
+		if (frame.wait == CompiledTrack::no_wait)
+			break;
+
+		int rc = flush_and_sleep(frame.wait);
+
+		if (rc != TinyVGM_OK)
+			return rc;
+	}
+
+	return TinyVGM_OK;
+}
+
+void RetroWavePlayer::frame_cpu_begin() {
+	// Nothing to compare with before the first flush
+	if (!frame_cpu_stats || (!frame_cpu_mark.tv_sec && !frame_cpu_mark.tv_nsec))
+		return;
+
+	timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	double cpu = timespec_diff_nsec(now, frame_cpu_mark);
+
+	sched_stats.frame_cpu_sum_nsec += cpu;
+	sched_stats.frame_cpu_count++;
+
+	if (cpu > sched_stats.frame_cpu_max_nsec)
+		sched_stats.frame_cpu_max_nsec = cpu;
+}
+
+void RetroWavePlayer::frame_cpu_end() {
+	if (frame_cpu_stats)
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &frame_cpu_mark);
+
+	if (pipeline_active())
+		clock_gettime(CLOCK_MONOTONIC, &pipe_produce_mark);
+}
@@ -0,0 +1,240 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+// Registers as the chips see them: both OPL2 commands land on OPL3 port 0, the second OPL2 on port 1
+enum {
+	Gapless_OPL3_Port0 = 0,
+	Gapless_OPL3_Port1,
+	Gapless_YM2413,
+	Gapless_Chips
+};
+
+static int gapless_chip(uint8_t cmd) {
+	switch (cmd) {
+		case 0x5a:
+		case 0x5e:
+			return Gapless_OPL3_Port0;
+		case 0xaa:
+		case 0x5f:
+			return Gapless_OPL3_Port1;
+		case 0x51:
+			return Gapless_YM2413;
+		default:
+			return -1;
+	}
+}
+
+static bool gapless_reg_valid(int chip, size_t reg) {
+	switch (chip) {
+		case Gapless_OPL3_Port0:
+			return reg >= 0x01 && reg <= 0xf5 && !(reg >= 0x02 && reg <= 0x04);	// Timers
+		case Gapless_OPL3_Port1:
+			return reg >= 0x01 && reg <= 0xf5;
+		default:
+			return reg <= 0x38;
+	}
+}
+
+// Key-on registers go last, so notes start with the right instrument
+static bool gapless_reg_is_key(int chip, size_t reg) {
+	if (chip == Gapless_YM2413)
+		return (reg >= 0x20 && reg <= 0x28) || reg == 0x0e;
+
+	return (reg >= 0xb0 && reg <= 0xb8) || reg == 0xbd;
+}
+
+void RetroWavePlayer::gapless_capture() {
+	gapless_regs.assign(Gapless_Chips, std::vector<int16_t>(256, 0));
+	gapless_chips = chips_used;
+
+	// Unwritten registers are still at their reset value
+	for (auto &it : reg_map) {
+		int chip = gapless_chip(it.first);
+
+		if (chip < 0)
+			continue;
+
+		for (size_t reg=0; reg<it.second.size(); reg++) {
+			if (it.second[reg])
+				gapless_regs[chip][reg] = it.second[reg];
+		}
+	}
+
+	// Muting at the end of the track rewrites these behind the register map's back
+	for (int chip : {Gapless_OPL3_Port0, Gapless_OPL3_Port1}) {
+		for (size_t reg=0x40; reg<=0x55; reg++)
+			gapless_regs[chip][reg] = -1;
+
+		for (size_t reg=0xb0; reg<=0xb8; reg++)
+			gapless_regs[chip][reg] = -1;
+	}
+
+	gapless_regs[Gapless_OPL3_Port0][0xbd] = -1;
+	gapless_regs[Gapless_YM2413][0x0e] = -1;
+
+	for (size_t reg=0x20; reg<=0x38; reg++)
+		gapless_regs[Gapless_YM2413][reg] = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &gapless_end);
+}
+
+bool RetroWavePlayer::gapless_begin() {
+	gapless_active = false;
+
+	// Different chips, a stream that can't be scanned ahead, or a skip: start from a clean reset
+	if (!gapless_armed || chips_used != gapless_chips || track_stream.active() || !(chips_used & (Chip_OPL3 | Chip_YM2413)))
+		return false;
+
+	gapless_armed = false;
+
+	// Registers the track sets before its first wait, the rest have to be back at their reset value
+	std::vector<std::vector<bool>> init(Gapless_Chips, std::vector<bool>(256, false));
+	const uint8_t *data = file_buf.data();
+	size_t pos = data_offset_abs, end = file_buf.size();
+
+	while (pos < end) {
+		uint8_t cmd = data[pos];
+		size_t len = vgm_command_length(data + pos, end - pos);
+
+		if (!len || cmd == 0x66 || vgm_is_wait(cmd))
+			break;
+
+		int chip = gapless_chip(cmd);
+
+		if (chip >= 0 && len == 3 && !disabled_vgm_commands.count(cmd))
+			init[chip][data[pos + 1]] = true;
+
+		pos += len;
+	}
+
+	gapless_diff_writes = 0;
+	gapless_dropped_writes = 0;
+
+	// Port 1 first, it has the OPL3 mode bit
+	static const int order[] = {Gapless_OPL3_Port1, Gapless_OPL3_Port0, Gapless_YM2413};
+
+	for (bool key_regs : {false, true}) {
+		for (int chip : order) {
+			if (!(chips_used & (chip == Gapless_YM2413 ? Chip_YM2413 : Chip_OPL3)))
+				continue;
+
+			auto &regs = gapless_regs[chip];
+
+			for (size_t reg=0; reg<regs.size(); reg++) {
+				if (!gapless_reg_valid(chip, reg) || gapless_reg_is_key(chip, reg) != key_regs || init[chip][reg] || regs[reg] == 0)
+					continue;
+
+				switch (chip) {
+					case Gapless_OPL3_Port0:
+						retrowave_opl3_queue_port0(wctx, reg, 0);
+						break;
+					case Gapless_OPL3_Port1:
+						retrowave_opl3_queue_port1(wctx, reg, 0);
+						break;
+					default:
+						retrowave_mastergear_queue_ym2413(wctx, reg, 0);
+						break;
+				}
+
+				regs[reg] = 0;
+				gapless_diff_writes++;
+			}
+		}
+	}
+
+	gapless_active = true;
+	gapless_transitions++;
+
+	return true;
+}
+
+void RetroWavePlayer::gapless_filter() {
+	if (!gapless_active || compiled.frames.empty())
+		return;
+
+	// Writes before the first wait that would set a register to what it already holds
+	auto &frame = compiled.frames[0];
+	auto *events = compiled.events.data() + frame.first;
+	uint32_t kept = 0;
+
+	for (uint32_t i=0; i<frame.count; i++) {
+		auto &ev = events[i];
+		int chip = gapless_chip(ev.cmd);
+
+		// The chip holds it already, the register map has to as well, or a link recovery would replay it as 0
+		if (chip >= 0 && gapless_regs[chip][ev.reg] == ev.val) {
+			if (!disabled_vgm_commands.count(ev.cmd))
+				regmap_insert(ev.cmd, ev.reg, ev.val);
+
+			gapless_dropped_writes++;
+			continue;
+		}
+
+		if (chip >= 0)
+			gapless_regs[chip][ev.reg] = ev.val;
+
+		events[kept++] = ev;
+	}
+
+	frame.count = kept;
+}
+
+void RetroWavePlayer::gapless_ready() {
+	if (!gapless_active)
+		return;
+
+	gapless_active = false;
+
+	if (timing_strategy != Timing_Virtual)
+		return;
+
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	printf("info: gapless: %zu registers cleared instead of a reset, %zu redundant writes dropped, ready %.1lf ms after the last track\n",
+	       gapless_diff_writes, gapless_dropped_writes, (double)timespec_diff_nsec(now, gapless_end) / 1000000);
+}
@@ -0,0 +1,297 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+// Only OPL3 writes get moved, other chips are far from filling the link
+static inline bool lookahead_movable_cmd(uint8_t cmd) {
+	return cmd == 0x5a || cmd == 0x5e || cmd == 0x5f;
+}
+
+// Channel whose sound a register shapes, -1 for registers that affect the whole chip
+static int opl3_reg_channel(uint8_t reg) {
+	static const int8_t slot_channel[0x20] = {
+		0, 1, 2, 0, 1, 2, -1, -1,
+		3, 4, 5, 3, 4, 5, -1, -1,
+		6, 7, 8, 6, 7, 8, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1,
+	};
+
+	if ((reg >= 0x20 && reg <= 0x95) || (reg >= 0xe0 && reg <= 0xf5))
+		return slot_channel[reg & 0x1f];
+
+	if ((reg >= 0xa0 && reg <= 0xa8) || (reg >= 0xc0 && reg <= 0xc8))
+		return reg & 0xf;
+
+	return -1;
+}
+
+// Time for an envelope to release from full level to silence, by release rate (YMF262 datasheet, without key scaling)
+static const double opl3_release_msecs[16] = {
+	0, 39280, 19640, 9820, 4910, 2455, 1227, 614,
+	307, 153.5, 76.7, 38.4, 19.2, 9.6, 4.8, 2.4,
+};
+
+void RetroWavePlayer::lookahead_plan() {
+	lookahead_inject.clear();
+	lookahead_skip.clear();
+	lookahead_frame = lookahead_ordinal = 0;
+
+	if (!lookahead)
+		return;
+
+	if (track_stream.active()) {
+		puts("info: lookahead: needs the whole track, not available when streaming");
+		return;
+	}
+
+	// A write is 6 command bytes, taken over many so the framing of one frame doesn't count
+	double nsec_per_write = ttw_nsec_per_byte ? (double)ttw_estimate(6000) / 1000 : 6 * null_nsec_per_byte;
+
+	if (nsec_per_write <= 0) {
+		puts("info: lookahead: link cost unknown, nothing to smooth");
+		return;
+	}
+
+	struct Write {
+		uint8_t cmd, reg, val;
+		uint32_t ordinal;
+	};
+
+	struct Frame {
+		uint64_t start;
+		uint32_t samples;
+		std::vector<Write> writes;
+		size_t load;
+		uint32_t quiet;		// Channels (port * 9 + ch) that stay silent until the next frame
+	};
+
+	std::vector<Frame> frames(1);
+
+	const uint8_t *data = file_buf.data();
+	size_t pos = data_offset_abs, end = file_buf.size();
+	bool rhythm_used = false;
+
+	while (pos < end) {
+		uint8_t cmd = data[pos];
+		size_t len = vgm_command_length(data + pos, end - pos);
+
+		if (!len || cmd == 0x66)
+			break;
+
+		auto &frame = frames.back();
+
+		if (vgm_is_wait(cmd)) {
+			frame.samples = vgm_wait_samples(data + pos);
+
+			uint64_t next_start = frame.start + frame.samples;
+			frames.push_back({});
+			frames.back().start = next_start;
+		} else if (lookahead_movable_cmd(cmd)) {
+			frame.writes.push_back({cmd, data[pos + 1], data[pos + 2], (uint32_t)frame.writes.size()});
+
+			if (cmd != 0x5f && data[pos + 1] == 0xbd && (data[pos + 2] & 0x20))
+				rhythm_used = true;
+		}
+
+		pos += len;
+	}
+
+	// A channel is quiet in a frame if it's keyed off, and its operators have had time to release to silence
+	uint8_t release_rate[2][0x20] = {};
+	bool key_on[18] = {false};
+	uint64_t silent_from[18] = {0};
+
+	// The slowest of the channel's operators, from full level. A rate of 0 never releases
+	auto release_end = [&](int c, uint64_t from) {
+		uint64_t ret = from;
+
+		for (uint8_t slot=0; slot<0x16; slot++) {
+			if (opl3_reg_channel(0x80 + slot) != c % 9)
+				continue;
+
+			uint8_t rr = release_rate[c / 9][slot];
+
+			if (!rr)
+				return UINT64_MAX;
+
+			ret = std::max<uint64_t>(ret, from + opl3_release_msecs[rr] * sample_rate / 1000 + 1);
+		}
+
+		return ret;
+	};
+
+	for (auto &frame : frames) {
+		frame.load = frame.writes.size();
+
+		for (auto &w : frame.writes) {
+			int port = w.cmd == 0x5f;
+
+			if (w.reg >= 0x80 && w.reg <= 0x95 && opl3_reg_channel(w.reg) >= 0) {
+				int c = port * 9 + opl3_reg_channel(w.reg);
+
+				release_rate[port][w.reg & 0x1f] = w.val & 0xf;
+
+				// A new rate in the middle of a release goes on from a level no higher than full
+				if (!key_on[c] && silent_from[c] > frame.start)
+					silent_from[c] = release_end(c, frame.start);
+			} else if (w.reg >= 0xb0 && w.reg <= 0xb8) {
+				int c = port * 9 + (w.reg - 0xb0);
+				bool on = w.val & 0x20;
+
+				if (key_on[c] && !on)
+					silent_from[c] = release_end(c, frame.start);
+
+				key_on[c] = on;
+			}
+		}
+
+		frame.quiet = 0;
+
+		for (int c=0; c<18; c++) {
+			if (!key_on[c] && frame.start >= silent_from[c])
+				frame.quiet |= 1U << c;
+		}
+
+		// Percussion keys through 0xBD instead, so never touch its channels
+		if (rhythm_used)
+			frame.quiet &= ~(0x7U << 6);
+	}
+
+	const uint64_t window = 2 * sample_rate;
+	int32_t last_write_frame[2][256];
+	size_t over_budget = 0, moved_total = 0;
+
+	std::fill(&last_write_frame[0][0], &last_write_frame[0][0] + 2 * 256, -1);
+
+	for (size_t j=0; j<frames.size(); j++) {
+		auto &frame = frames[j];
+		size_t capacity = frame.samples * 1e9 / sample_rate / nsec_per_write;
+		size_t moved = 0, first_target = j;
+
+		if (frame.samples && frame.load > capacity)
+			over_budget++;
+
+		for (auto &w : frame.writes) {
+			int port = w.cmd == 0x5f;
+			int ch = opl3_reg_channel(w.reg);
+
+			if (frame.samples && frame.load > capacity && ch >= 0) {
+				// 4-op pairs share operators, so both halves have to be quiet
+				uint32_t mask = 1U << (port * 9 + ch);
+
+				if (ch < 6)
+					mask |= 1U << (port * 9 + (ch + 3) % 6);
+
+				ssize_t target = -1;
+
+				for (ssize_t k=(ssize_t)j-1; k>last_write_frame[port][w.reg]; k--) {
+					if (frames[k].start + window < frame.start || (frames[k].quiet & mask) != mask)
+						break;
+
+					size_t k_capacity = frames[k].samples * 1e9 / sample_rate / nsec_per_write;
+
+					if (frames[k].load < k_capacity) {
+						target = k;
+						break;
+					}
+				}
+
+				if (target >= 0) {
+					frames[target].load++;
+					frame.load--;
+					moved++;
+					first_target = std::min<size_t>(first_target, target);
+
+					lookahead_inject[target].push_back({w.cmd, w.reg, w.val});
+					lookahead_skip.insert(((uint64_t)j << 32) | w.ordinal);
+					last_write_frame[port][w.reg] = target;
+					continue;
+				}
+			}
+
+			last_write_frame[port][w.reg] = j;
+		}
+
+		if (moved) {
+			moved_total += moved;
+
+			double secs = (double)frame.start / sample_rate;
+			printf("info: lookahead: %02u:%06.3lf frame %zu: %zu writes over a budget of %zu, moved %zu into frames %zu-%zu\n",
+			       (unsigned)(secs / 60), fmod(secs, 60), j, frame.writes.size(), capacity, moved, first_target, j - 1);
+		}
+	}
+
+	printf("info: lookahead: %zu frames over budget, %zu writes moved\n", over_budget, moved_total);
+}
+
+bool RetroWavePlayer::lookahead_skip_write() {
+	uint64_t key = ((uint64_t)lookahead_frame << 32) | lookahead_ordinal++;
+	return lookahead_skip.count(key);
+}
+
+void RetroWavePlayer::lookahead_frame_end() {
+	auto it = lookahead_inject.find(lookahead_frame);
+
+	if (it != lookahead_inject.end()) {
+		for (auto &w : it->second) {
+			if (disabled_vgm_commands.count(w.cmd))
+				continue;
+
+			uint8_t buf[2] = {w.reg, w.val};
+
+			queued_bytes += 2;
+
+			switch (w.cmd) {
+				case 0x5a: callback_opl2(this, w.cmd, buf, 2); break;
+				case 0x5e: callback_opl3_port0(this, w.cmd, buf, 2); break;
+				case 0x5f: callback_opl3_port1(this, w.cmd, buf, 2); break;
+			}
+		}
+	}
+
+	lookahead_frame++;
+	lookahead_ordinal = 0;
+}
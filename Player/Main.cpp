@@ -0,0 +1,444 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+#include <string.h>
+
+#ifdef EMSCRIPTEN
+#include <emscripten.h>
+#endif
+
+
+RetroWavePlayer player;
+
+void int_handler(int signal) {
+	// While playing, the next frame picks it up and exits the normal way, chips reset and all
+	if (player.exit_polled && !player.exit_signal) {
+		player.exit_signal = signal;
+		return;
+	}
+
+	// Nothing is there to pick it up, or it already didn't: async-signal-safe calls only from here
+	player.governor_restore();
+	player.term_attr_load();
+	_exit(1);
+}
+
+// The serial backend aborts when the link is gone for good, the chips are out of reach by then
+void abort_handler(int signal) {
+	player.governor_restore();
+	player.term_attr_load();
+
+	// abort() still terminates once this returns
+}
+
+void ShowHelpExtra() {
+	puts("");
+
+	puts(" Keyboard commands:\n"
+	     "     q: Quit\n"
+	     "     s: Single frame\n"
+	     "     Space( ): Pause/Resume\n"
+	     "     Slash(/): Hold to Fast forward\n"
+	     "     Comma(,): Previous\n"
+	     "     Dot(.): Next\n");
+#if defined (__CYGWIN__)
+	puts("");
+	puts(" Windows specific notes:\n"
+	     "  1. Windows doesn't have a monotonic self-increasing clock/timer that is unaffected by real world time changes.\n"
+	     "     This may make the playback unstable. And the playback will be destroyed if a NTP time update happens in background.\n"
+	     "  2. OSD refresh rate is set to 1 second and regmap display is disabled by default because of the laggy conhost.exe terminal.\n"
+	     "     If you want to see the register map visualization properly, try using MinTTY as your terminal. Or use another OS.\n"
+	     "  3. To specify serial port, write COMx in device path. e.g. -d COM1");
+#endif
+}
+
+int main(int argc, char **argv) {
+	signal(SIGINT, int_handler);
+	signal(SIGTERM, int_handler);
+	signal(SIGHUP, int_handler);
+	signal(SIGABRT, abort_handler);
+
+	cxxopts::Options options("Retrowave_Player", "Retrowave_Player - Player for the Retrowave series.");
+
+	std::string device_type, device_path, spi_cs_gpio, test_type, disabled_vgm_cmds, timing_strategy, ttw_mode, overrun_policy, null_cost, realtime, governor;
+	int compile_only;
+	uint32_t tty_reconnect_timeout, flush_quantum_usecs;
+	int realtime_cpu, pm_qos_usecs;
+	size_t stream_kib, track_cache_mib;
+
+	const char *home = getenv("HOME");
+	std::string spi_speeds_default = std::string(home ? home : ".") + "/.retrowave_spi_speeds";
+	const char *xdg_cache = getenv("XDG_CACHE_HOME");
+	std::string cache_default = (xdg_cache && *xdg_cache ? std::string(xdg_cache) : std::string(home ? home : ".") + "/.cache") + "/retrowave";
+	std::vector<std::string> positional_args;
+
+#if defined (__CYGWIN__)
+	const size_t osd_default_refresh_interval = 1000000000;
+	const int osd_default_show_reg = 0;
+#elif (defined (__APPLE__) && defined (__MACH__))
+	const size_t osd_default_refresh_interval = 1000 * 1000 * 100;
+	const int osd_default_show_reg = 1;
+#else
+	const size_t osd_default_refresh_interval = 1000 * 1000 * 10;
+	const int osd_default_show_reg = 1;
+#endif
+
+	options.add_options("Main")
+		("h,help", "Show this help")
+
+		("t", "Device type (spi/tty/null)", cxxopts::value<std::string>(device_type)->default_value("tty"))
+		("d", "Device path", cxxopts::value<std::string>(device_path)->default_value("/dev/ttyACM0"))
+#ifdef __linux__
+		("spi-speeds", "File with calibrated SPI speeds, written by -T spi_calibrate", cxxopts::value<std::string>(player.spi_speeds_path)->default_value(spi_speeds_default))
+		("g", "GPIO chip,pin for SPI chip select, or `native' to let the SPI controller drive it", cxxopts::value<std::string>(spi_cs_gpio)->default_value("0,6"))
+#endif
+#ifndef EMSCRIPTEN
+		("c", "Time in ms to keep trying to reconnect a lost tty device, 0 to disable", cxxopts::value<uint32_t>(tty_reconnect_timeout)->default_value("5000"))
+#endif
+		("w", "Timing strategy (sleep/spin"
+#ifdef __linux__
+		      "/timerfd"
+#endif
+		      "/virtual), spin burns CPU time for tighter wakeups, virtual runs as fast as possible with -t null", cxxopts::value<std::string>(timing_strategy)->default_value("sleep"))
+		("l", "Time-to-wire compensation: `auto' to measure the link, a fixed cost in ns per byte on the wire, or 0 to disable", cxxopts::value<std::string>(ttw_mode)->default_value("auto"))
+		("q", "Minimum time in us between flushes, shorter waits are batched. 0 to flush on every wait", cxxopts::value<uint32_t>(flush_quantum_usecs)->default_value("0"))
+		("e", "Encode each frame for the wire before sleeping on its deadline (1/0)", cxxopts::value<int>(player.encode_ahead)->default_value("1"))
+		("lookahead", "Move OPL3 writes of silent channels out of frames the link can't carry in time (1/0)", cxxopts::value<int>(player.lookahead)->default_value("0"))
+		("overrun", "What to do with frames whose deadline has passed: burst (send each), merge (send together) or rebase (drop the lost time)", cxxopts::value<std::string>(overrun_policy)->default_value("burst"))
+		("null-cost", "Simulated link cost of the null device as ns_per_byte,ns_per_transfer", cxxopts::value<std::string>(null_cost)->default_value("0,0"))
+		("realtime", "Run on a realtime scheduler as `fifo,priority' or `rr,priority', with memory locked and prefaulted. Don't combine with `-w spin' on a single core", cxxopts::value<std::string>(realtime)->default_value(""))
+		("cpu", "CPU to pin the player to, -1 to let it move", cxxopts::value<int>(realtime_cpu)->default_value("-1"))
+		("pm-qos", "CPU wakeup latency in us to hold during playback through /dev/cpu_dma_latency, -1 to disable", cxxopts::value<int>(pm_qos_usecs)->default_value("0"))
+		("governor", "cpufreq governor to switch the CPU from --cpu (or all of them) to, e.g. `performance'. Restored on exit", cxxopts::value<std::string>(governor)->default_value(""))
+		("stream", "Stream tracks through a ring buffer of this many KiB instead of loading them whole, 0 to disable. `-' plays from stdin", cxxopts::value<size_t>(stream_kib)->default_value("0"))
+		("pipeline", "Parse and encode on one thread and send on another, running up to this many ms ahead of the chips. 0 to do both on one thread", cxxopts::value<int>(player.pipeline_lead_msecs)->default_value("0"))
+		("track-cache", "MiB of loaded tracks to keep around, so going back and forth doesn't read them again. 0 to disable, along with prefetching", cxxopts::value<size_t>(track_cache_mib)->default_value("256"))
+		("prefetch", "Tracks ahead in the playlist to load in the background while one plays", cxxopts::value<size_t>(player.prefetch_tracks)->default_value("2"))
+		("gapless", "Go from one track to the next by keying off and rewriting only the registers that differ, instead of a chip reset, when both use the same chips (1/0)", cxxopts::value<int>(player.gapless)->default_value("0"))
+		("preparse", "Compile each track into an event stream before playing it, instead of parsing it during playback (1/0)", cxxopts::value<int>(player.preparse)->default_value("1"))
+		("cache", "Directory of pre-encoded tracks, played instead of the VGM files when they match", cxxopts::value<std::string>(player.cache_dir)->default_value(cache_default))
+		("compile", "Encode the files (and VGM files in the directories) given into the cache with all CPUs, then exit (1/0)", cxxopts::value<int>(compile_only)->default_value("0"))
+		("D", "Comma separated list of disabled processing of certain VGM commands in hex", cxxopts::value<std::string>(disabled_vgm_cmds)->default_value(""))
+		("i", "OSD refresh interval in ns, 0 to disable", cxxopts::value<size_t>(player.osd_ratelimit_thresh)->default_value(std::to_string(osd_default_refresh_interval)))
+		("m", "Show metadata in OSD (1/0)", cxxopts::value<int>(player.osd_show_meta)->default_value(std::to_string(1)))
+		("r", "Show chip regs in OSD (1/0)", cxxopts::value<int>(player.osd_show_regs)->default_value(std::to_string(osd_default_show_reg)))
+		("T", "Test to run (\"help\" for a list)",  cxxopts::value<std::string>(test_type)->default_value(""))
+
+		;
+
+	options.add_options("positional")
+		("positional", "Positional parameters: The files to play", cxxopts::value<std::vector<std::string>>(positional_args))
+		;
+
+	options.parse_positional("positional");
+	options.positional_help("[FILES...]").show_positional_help();
+
+
+	try {
+		auto cmd = options.parse(argc, argv);
+
+		if (cmd.count("help") || (test_type.empty() && positional_args.empty())) {
+			std::cout << options.help({"Main"});
+			ShowHelpExtra();
+			return 0;
+		}
+
+	} catch (std::exception &e) {
+		std::cout << "Error: " << e.what() << "\n";
+		std::cout << options.help({"Main"});
+		ShowHelpExtra();
+		return 1;
+	}
+
+	if (!player.timing_set_strategy(timing_strategy)) {
+		printf("error: unknown timing strategy `%s'.\n", timing_strategy.c_str());
+		exit(2);
+	}
+
+	player.stream_buffer_size = stream_kib * 1024;
+	player.track_cache.set_budget(track_cache_mib * 1048576);
+	player.frame_cpu_stats = player.timing_strategy == RetroWavePlayer::Timing_Virtual;
+
+	// Keys have to come from the terminal when the track comes through stdin
+	if (std::find(positional_args.begin(), positional_args.end(), "-") != positional_args.end())
+		player.term_fd = open("/dev/tty", O_RDONLY);
+
+	player.flush_quantum_samples = (uint64_t)flush_quantum_usecs * RetroWavePlayer::sample_rate / 1000000;
+
+	if (!player.overrun_set_policy(overrun_policy)) {
+		printf("error: unknown overrun policy `%s'.\n", overrun_policy.c_str());
+		exit(2);
+	}
+
+	if (!player.ttw_setup(device_type, ttw_mode)) {
+		printf("error: bad time-to-wire setting `%s'.\n", ttw_mode.c_str());
+		exit(2);
+	}
+
+	if (player.timing_strategy == RetroWavePlayer::Timing_Virtual && device_type != "null") {
+		puts("error: the virtual timing strategy only works with the null device.");
+		exit(2);
+	}
+
+	auto costs = RetroWavePlayer::string_split(null_cost, ',');
+
+	if (costs.size() != 2) {
+		puts("error: bad null device cost. Please use the `ns_per_byte,ns_per_transfer' format.");
+		exit(2);
+	}
+
+	player.null_nsec_per_byte = strtod(costs[0].c_str(), nullptr);
+	player.null_nsec_per_transfer = strtoull(costs[1].c_str(), nullptr, 10);
+	player.device_name = device_type;
+
+	// Encoding needs the board speeds of the device, but not the device itself
+	if (compile_only) {
+		retrowave_init(&player.rtctx);
+
+		if (device_type == "spi")
+			player.spi_speeds_load();
+
+		player.parse_disabled_vgm_commands(disabled_vgm_cmds);
+		player.wire_compile_library(positional_args);
+		retrowave_deinit(&player.rtctx);
+		return 0;
+	}
+
+	if (device_type == "spi") {
+#ifdef __linux__
+		auto scgs = RetroWavePlayer::string_split(spi_cs_gpio, ',');
+		int scg[2] = {0};
+		auto cs_mode = RetroWave_LinuxSPI_CS_Auto;
+
+		if (spi_cs_gpio == "native") {
+			cs_mode = RetroWave_LinuxSPI_CS_Native;
+			scgs = {"-1", "-1"};
+		}
+
+		if (scgs.size() != 2) {
+			puts("error: bad GPIO specification. Please use the `gpiochip,line' format.");
+			exit(2);
+		}
+
+		scg[0] = strtol(scgs[0].c_str(), nullptr, 10);
+		scg[1] = strtol(scgs[1].c_str(), nullptr, 10);
+
+		if (cs_mode == RetroWave_LinuxSPI_CS_Native)
+			printf("SPI CS: native\n");
+		else
+			printf("SPI CS: chip=%d, line=%d\n", scg[0], scg[1]);
+
+		if (retrowave_init_linux_spi_cs(&player.rtctx, device_path.c_str(), cs_mode, scg[0], scg[1])) {
+			exit(2);
+		}
+
+		player.spi_speeds_load();
+#else
+		puts("error: SPI is not supported on your platform.");
+		exit(2);
+#endif
+	} else if (device_type == "tty") {
+#if defined (__CYGWIN__)
+		if (device_path.find("COM") == 0) {
+			char *comnum_str = const_cast<char *>(device_path.c_str() + 3);
+			long comnum = strtol(comnum_str, nullptr, 10);
+
+			device_path = "/dev/ttyS";
+			device_path += std::to_string(comnum - 1);
+		}
+#endif
+
+#ifndef EMSCRIPTEN
+		if (retrowave_init_posix_serialport(&player.rtctx, device_path.c_str())) {
+			exit(2);
+		}
+
+		retrowave_posix_serialport_set_recover_timeout(&player.rtctx, tty_reconnect_timeout);
+
+		// write() returns long before the bytes are out, so the link rate comes from the odd write waited out
+		if (player.ttw_auto)
+			retrowave_posix_serialport_set_drain_interval(&player.rtctx, 16);
+#else
+		if (retrowave_init_web_serialport(&player.rtctx)) {
+			exit(2);
+		}
+#endif
+	} else if (device_type == "null") {
+		retrowave_init(&player.rtctx);
+		player.rtctx.user_data = &player;
+		player.rtctx.callback_io = RetroWavePlayer::callback_null_io;
+
+		// Nobody is watching a simulated run, and the OSD would cost more than the playback
+		if (player.timing_strategy == RetroWavePlayer::Timing_Virtual)
+			player.osd_ratelimit_thresh = 0;
+	} else {
+		puts("Unsupported device type. Please read the help.");
+		exit(2);
+	}
+
+	int prio = -5;
+
+	// Windows sucks, again
+#if defined (__CYGWIN__)
+	prio = -20;
+#endif
+
+	int rc = setpriority(PRIO_PROCESS, 0, prio);
+
+	if (rc < 0) {
+		puts("Failed to change process priority. You may experience lags.");
+	}
+
+	if (!realtime.empty() && !player.realtime_setup(realtime, realtime_cpu)) {
+		printf("error: bad realtime setting `%s'.\n", realtime.c_str());
+		exit(2);
+	}
+
+	// The SPI backend holds its own request, which only needs changing from the default
+	if (device_type == "spi") {
+#ifdef __linux__
+		if (pm_qos_usecs)
+			retrowave_linux_spi_set_pm_qos(&player.rtctx, pm_qos_usecs);
+#endif
+	} else if (player.timing_strategy != RetroWavePlayer::Timing_Virtual) {
+		player.pm_qos_hold(pm_qos_usecs);
+	}
+
+	if (!governor.empty())
+		player.governor_set(governor, realtime_cpu);
+
+	player.parse_disabled_vgm_commands(disabled_vgm_cmds);
+	player.init();
+
+	usleep(100 * 1000);
+
+	if (test_type.empty()) {
+		player.pipeline_start();
+		player.play(positional_args);
+		puts("Done playing!");
+	} else {
+		const std::unordered_map<std::string, std::function<void()>> tests = {
+			{"spi_calibrate", [&](){
+				printf("SPI Clock Calibration\n");
+				printf("Raises the SPI clock of each board until MCP23S17 register readback fails.\n");
+				puts("");
+
+				if (device_type != "spi") {
+					puts("error: this test needs an SPI device.");
+					return;
+				}
+
+				player.spi_calibrate();
+			}
+			},
+			{"opl3_sine", [&](){
+				printf("OPL3 Sine Wave Test\n");
+				printf("From https://www.vogons.org/viewtopic.php?t=55181\n");
+				puts("");
+
+				const std::vector<std::pair<uint8_t, uint8_t>> data = {
+					{0x20, 0x03},
+					{0x23, 0x01},
+					{0x40, 0x2f},
+					{0x43, 0x00},
+					{0x61, 0x10},
+					{0x63, 0x10},
+					{0x80, 0x00},
+					{0x83, 0x00},
+					{0xa0, 0x44},
+					{0xb0, 0x12},
+					{0xc0, 0xfe},
+					{0xb0, 0x32}
+				};
+
+				for (auto &it : data) {
+					printf("Write reg: 0x%02x 0x%02x\n", it.first, it.second);
+					retrowave_opl3_emit_port0(&player.rtctx, it.first, it.second);
+				}
+
+				printf("Sleeping 1 sec...\n");
+				sleep(1);
+
+				const uint8_t last_reg[2] = {0x60, 0xf0};
+
+				printf("Write reg: 0x%02x 0x%02x\n", last_reg[0], last_reg[1]);
+				retrowave_opl3_emit_port0(&player.rtctx, last_reg[0], last_reg[1]);
+
+				printf(
+					"If you hear sine wave you have a real OPL3 or very accurate clone,\n"
+					"otherwise you have OPL clone.\n"
+					"Press Ctrl-C to close program.\n"
+				);
+
+#ifndef EMSCRIPTEN
+				sleep(500);
+#else
+				emscripten_sleep(50000);
+#endif
+			}
+			},
+		};
+
+		auto it = tests.find(test_type);
+
+		if (it == tests.end()) {
+			printf("Available tests:\n");
+
+			for (auto &it2 : tests) {
+				std::cout << it2.first << "\n";
+			}
+		} else {
+			std::cout << "Running test: " << it->first << "\n";
+			it->second();
+		}
+	}
+
+
+	player.do_exit(0);
+
+	return 0;
+}
+
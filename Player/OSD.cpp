@@ -319,13 +319,46 @@ void RetroWavePlayer::osd_show() {
 		samples_color = "\033[01;31m";
 	}
 
+	// The I/O thread's counters, as of its last item when it runs on its own
+	IOSnapshot io;
+
+	if (pipeline_active())
+		pipeline_snapshot(io);
+	else
+		io_snapshot_take(io);
+
 	if (s - last_secs >= 1) {
 		bytes_per_sec = queued_bytes;
 		queued_bytes = 0;
 		last_secs = s;
+
+		auto &io_stats = io.io_stats;
+		uint64_t transfers = io_stats.transfers - io_stats_last.transfers;
+
+		io_syscalls_per_sec = io_stats.syscalls - io_stats_last.syscalls;
+		io_usecs_per_transfer = transfers ? (double)(io_stats.busy_nsec - io_stats_last.busy_nsec) / transfers / 1000 : 0;
+		io_stats_last = io_stats;
 	}
 
 	printf("Bandwidth: %06.4lf KiB/s\033[K\n\033[2K", (double)bytes_per_sec / 1000);
+	printf("I/O: %.0lf syscalls/s, %.1lf us/transfer\033[K\n\033[2K", io_syscalls_per_sec, io_usecs_per_transfer);
+
+	if (io.link_recoveries)
+		printf("Link recoveries: %zu\033[K\n\033[2K", io.link_recoveries);
+
+	double timing_avg, timing_jitter, timing_max;
+	timing_stats_get(io.timing_stats, timing_avg, timing_jitter, timing_max);
+	printf("Time to wire: %.0lf ns/byte (%s), %.1lf us last frame\033[K\n\033[2K", ttw_nsec_per_byte.load(), ttw_auto ? "measured" : "fixed", (double)ttw_last_nsec / 1000);
+	printf("Deadline misses: %zu, %.3lf ms max late, %zu merged, %zu rebased (%s)\033[K\n\033[2K", io.deadline_misses, io.late_max_nsec / 1000000, io.merged_frames, io.rebases, overrun_policy_name(overrun_policy));
+	if (flush_quantum_samples)
+		printf("Flush quantum: %" PRIu32 " samples, writes up to %.1lf us early, %.1lf us avg\033[K\n\033[2K", flush_quantum_samples,
+		       sched_stats.early_max_nsec / 1000, sched_stats.batched_frames ? sched_stats.early_sum_nsec / sched_stats.batched_frames / 1000 : 0);
+	printf("Wake to wire: %.1lf us avg, %.1lf us max%s\033[K\n\033[2K", io.flushes ? io.wake_to_wire_sum_nsec / io.flushes / 1000 : 0,
+	       io.wake_to_wire_max_nsec / 1000, encode_ahead ? ", encoded ahead" : "");
+	printf("Timing: %s, late %.1lf us avg, %.1lf us max, %.1lf us jitter\033[K\n\033[2K", timing_strategy_name(timing_strategy), timing_avg, timing_max, timing_jitter);
+	if (pipeline_active())
+		pipeline_report(true);
+	track_cache_report(true);
 
 	printf("\n");
 
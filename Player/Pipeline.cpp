@@ -0,0 +1,380 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#include <pthread.h>
+
+#ifndef EMSCRIPTEN
+#include <sched.h>
+#endif
+
+static const size_t pipe_ring_size = 1024;	// Power of 2
+
+static double monotonic_diff_nsec(const timespec &a, const timespec &b) {
+	return (double)(a.tv_sec - b.tv_sec) * 1000000000 + (a.tv_nsec - b.tv_nsec);
+}
+
+void RetroWavePlayer::pipeline_start() {
+	if (!pipeline_lead_msecs || pipeline_active())
+		return;
+
+	pipe_ring.resize(pipe_ring_size);
+	pipe_head = 0;
+	pipe_tail = 0;
+	pipe_stop = false;
+	pipe_recovered = false;
+	pipe_stats.pushes = 0;
+
+	// Same encoder as the platform would run, its output is caught and carried over to the I/O thread
+	uint32_t format = rtctx.callback_io_raw ? WireCache::Format_SerialPacked : WireCache::Format_Segments;
+
+	for (auto &it : pipe_ring) {
+		it.wire.format = format;
+		it.wire.data.reserve(4096);
+	}
+
+	pipe_merge.format = format;
+
+	retrowave_init(&pipe_encoder);
+	memcpy(pipe_encoder.board_transfer_speed, rtctx.board_transfer_speed, sizeof(rtctx.board_transfer_speed));
+	pipe_encoder.chip_state = rtctx.chip_state;
+	pipe_encoder.callback_io = callback_capture_io;
+	pipe_encoder.callback_io_segments = callback_capture_segments;
+
+	if (rtctx.callback_io_raw)
+		pipe_encoder.callback_io_raw = callback_capture_raw;
+
+	wctx = &pipe_encoder;
+	pipeline_claim();
+
+	// Made before this thread leaves the realtime scheduler, so only the I/O thread keeps it
+	pipe_thread = std::thread([this](){
+		pipeline_consumer();
+	});
+
+	// Off the pinned CPU too, or the I/O thread would have to give it up for every frame parsed
+#ifndef EMSCRIPTEN
+	if (sched_getscheduler(0) != SCHED_OTHER) {
+		realtime_demote_thread();
+		puts("info: pipeline: parsing on the normal scheduler on any CPU, sending on the realtime one");
+	}
+#endif
+
+	printf("info: pipeline: %zu frames, up to %d ms ahead of the chips\n", pipe_ring.size(), pipeline_lead_msecs);
+}
+
+void RetroWavePlayer::pipeline_stop() {
+	if (!pipeline_active())
+		return;
+
+	pipeline_discard();
+	pipe_stop = true;
+	pipeline_wake();
+
+	if (pipe_thread.joinable())
+		pipe_thread.join();
+
+	// Back to a single thread, the chip state the encoder tracked is what muting needs
+	rtctx.chip_state = pipe_encoder.chip_state;
+	wctx = &rtctx;
+	retrowave_deinit(&pipe_encoder);
+}
+
+void RetroWavePlayer::pipeline_claim() {
+	size_t tail = pipe_tail.load(std::memory_order_relaxed);
+	uint64_t lead_samples = (uint64_t)pipeline_lead_msecs * sample_rate / 1000;
+	uint64_t samples = tail ? pipe_ring[(tail - 1) & (pipe_ring.size() - 1)].samples : 0;
+	bool stalled = false;
+
+	// Wait for a free slot, and don't run further ahead of the chips than asked
+	for (size_t spins = 0; ; spins++) {
+		bool full = tail - pipe_head.load(std::memory_order_acquire) >= pipe_ring.size();
+		int64_t ahead = (int64_t)(samples - pipe_sent_samples.load(std::memory_order_relaxed));
+
+		if (!full && (ahead <= (int64_t)lead_samples || pipe_head.load(std::memory_order_acquire) == tail))
+			break;
+
+		stalled = true;
+
+		if (spins < 64)
+			std::this_thread::yield();
+		else
+			usleep(100);
+	}
+
+	if (stalled)
+		pipe_stats.stalls++;
+
+	auto &item = pipe_ring[tail & (pipe_ring.size() - 1)];
+
+	item.wire.data.clear();
+	item.wire.segments.clear();
+	item.wire.frame_data_start = 0;
+	item.wire.cmd_bytes = 0;
+
+	pipe_encoder.user_data = &item.wire;
+}
+
+void RetroWavePlayer::pipeline_push(PipelineItem::Type type, uint64_t samples, uint32_t settle_usecs) {
+	// The link came back, so the chips need everything again
+	if (pipe_recovered.exchange(false)) {
+		if (wire_cache.active())
+			wire_resync();
+
+		regmap_replay();
+	}
+
+	if (wire_pending())
+		wire_send_pending();
+
+	retrowave_flush(wctx);
+
+	size_t tail = pipe_tail.load(std::memory_order_relaxed);
+	auto &item = pipe_ring[tail & (pipe_ring.size() - 1)];
+
+	if (type == PipelineItem::Immediate && item.wire.data.empty() && !settle_usecs)
+		return;
+
+	item.type = type;
+	item.samples = samples;
+	item.settle_usecs = settle_usecs;
+	item.generation = pipe_generation.load(std::memory_order_relaxed);
+	clock_gettime(CLOCK_MONOTONIC, &item.pushed);
+
+	pipe_tail.store(tail + 1, std::memory_order_release);
+	pipeline_wake();
+
+	// How long this thread took to make the frame, and how many were waiting to go out
+	if (type == PipelineItem::Frame) {
+		double produce = monotonic_diff_nsec(item.pushed, pipe_produce_mark);
+		size_t occupancy = tail + 1 - pipe_head.load(std::memory_order_acquire);
+
+		pipe_stats.pushes++;
+		pipe_stats.produce_sum_nsec += produce;
+		pipe_stats.occupancy_sum += occupancy;
+
+		if (produce > pipe_stats.produce_max_nsec)
+			pipe_stats.produce_max_nsec = produce;
+
+		if (occupancy > pipe_stats.occupancy_max)
+			pipe_stats.occupancy_max = occupancy;
+
+		frame_cpu_begin();
+	}
+
+	pipeline_claim();
+	frame_cpu_end();
+}
+
+void RetroWavePlayer::pipeline_drain() {
+	size_t tail = pipe_tail.load(std::memory_order_relaxed);
+
+	for (size_t spins = 0; pipe_head.load(std::memory_order_acquire) != tail; spins++) {
+		if (spins < 64)
+			std::this_thread::yield();
+		else
+			usleep(100);
+	}
+}
+
+void RetroWavePlayer::pipeline_wake() {
+	// Taking the lock makes sure the I/O thread is either waiting already or yet to check the ring
+	{
+		std::lock_guard<std::mutex> lk(pipe_mutex);
+	}
+
+	pipe_cond.notify_one();
+}
+
+void RetroWavePlayer::pipeline_publish() {
+	// Skipped if the OSD is reading the last copy, the next item brings a newer one
+	std::unique_lock<std::mutex> lk(pipe_snapshot_mutex, std::try_to_lock);
+
+	if (lk.owns_lock())
+		io_snapshot_take(pipe_snapshot);
+}
+
+void RetroWavePlayer::pipeline_snapshot(IOSnapshot &out) {
+	std::lock_guard<std::mutex> lk(pipe_snapshot_mutex);
+	out = pipe_snapshot;
+}
+
+void RetroWavePlayer::pipeline_discard() {
+	pipe_generation.fetch_add(1, std::memory_order_release);
+}
+
+void RetroWavePlayer::pipeline_consumer() {
+	// Signals are for the parsing thread, which owns the terminal and exits
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+	size_t head = pipe_head.load(std::memory_order_relaxed);
+
+	while (!pipe_stop.load(std::memory_order_relaxed)) {
+		// Yielding wouldn't let the parsing thread run on this CPU, it's on a lower scheduling class
+		if (head == pipe_tail.load(std::memory_order_acquire)) {
+			std::unique_lock<std::mutex> lk(pipe_mutex);
+
+			pipe_cond.wait(lk, [&](){
+				return pipe_stop.load(std::memory_order_relaxed) || head != pipe_tail.load(std::memory_order_acquire);
+			});
+
+			continue;
+		}
+
+		auto &item = pipe_ring[head & (pipe_ring.size() - 1)];
+
+		if (item.generation == pipe_generation.load(std::memory_order_acquire))
+			pipeline_run(item);
+
+		pipeline_publish();
+
+		pipe_head.store(++head, std::memory_order_release);
+	}
+}
+
+void RetroWavePlayer::pipeline_run(PipelineItem &item) {
+	switch (item.type) {
+		case PipelineItem::Frame: {
+			size_t next = pipe_head.load(std::memory_order_relaxed) + 1;
+			uint64_t next_samples = 0;
+
+			// Only a frame that's already here can be merged into
+			if (next != pipe_tail.load(std::memory_order_acquire)) {
+				auto &next_item = pipe_ring[next & (pipe_ring.size() - 1)];
+
+				if (next_item.type == PipelineItem::Frame && next_item.generation == item.generation)
+					next_samples = next_item.samples;
+			}
+
+			// Overdue frames that get merged are held back and go out with the next one
+			if (frame_overrun(item.samples, next_samples)) {
+				auto &m = pipe_merge;
+
+				for (auto &seg : item.wire.segments)
+					m.segments.push_back({(uint32_t)(seg.offset + m.data.size()), seg.len, seg.transfer_speed});
+
+				m.data.insert(m.data.end(), item.wire.data.begin(), item.wire.data.end());
+				m.cmd_bytes += item.wire.cmd_bytes;
+				break;
+			}
+
+			const WireCapture *wire = &item.wire;
+
+			if (!pipe_merge.data.empty()) {
+				auto &m = pipe_merge;
+
+				for (auto &seg : item.wire.segments)
+					m.segments.push_back({(uint32_t)(seg.offset + m.data.size()), seg.len, seg.transfer_speed});
+
+				m.data.insert(m.data.end(), item.wire.data.begin(), item.wire.data.end());
+				m.cmd_bytes += item.wire.cmd_bytes;
+				wire = &m;
+			}
+
+			frame_flush_at(item.samples, wire->cmd_bytes, wire);
+
+			pipe_merge.data.clear();
+			pipe_merge.segments.clear();
+			pipe_merge.cmd_bytes = 0;
+
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			uint64_t queued = monotonic_diff_nsec(now, item.pushed);
+
+			pipe_stats.sent++;
+			pipe_stats.queued_sum_nsec += queued;
+
+			if (queued > pipe_stats.queued_max_nsec)
+				pipe_stats.queued_max_nsec = queued;
+			break;
+		}
+		case PipelineItem::Wait:
+			timing_sleep_until(timing_deadline(item.samples));
+			pipeline_write(item.wire);
+			break;
+		case PipelineItem::Rebase:
+			timing_set_epoch(item.samples);
+			pipeline_write(item.wire);
+			break;
+		default:
+			pipeline_write(item.wire);
+
+			if (item.settle_usecs)
+				usleep(item.settle_usecs);
+			return;
+	}
+
+	pipe_sent_samples.store(item.samples, std::memory_order_relaxed);
+}
+
+void RetroWavePlayer::pipeline_write(const WireCapture &wire) {
+	if (wire.data.empty())
+		return;
+
+	if (wire.format == WireCache::Format_SerialPacked)
+		retrowave_flush_raw(&rtctx, wire.data.data(), wire.data.size());
+	else
+		retrowave_flush_segments(&rtctx, wire.data.data(), wire.segments.data(), wire.segments.size());
+}
+
+void RetroWavePlayer::pipeline_report(bool osd) {
+	auto &st = pipe_stats;
+	uint64_t sent = st.sent;
+
+	double occupancy = st.pushes ? st.occupancy_sum / st.pushes : 0;
+	double produce = st.pushes ? st.produce_sum_nsec / st.pushes / 1000 : 0;
+	double queued = sent ? (double)st.queued_sum_nsec / sent / 1000000 : 0;
+
+	if (osd)
+		printf("Pipeline: %.1lf of %zu frames queued avg, %zu max, %zu stalls; produce %.1lf us avg, %.1lf us max; queued %.2lf ms avg, %.2lf ms max\033[K\n\033[2K",
+		       occupancy, pipe_ring.size(), st.occupancy_max, st.stalls, produce, st.produce_max_nsec / 1000, queued, (double)st.queued_max_nsec / 1000000);
+	else
+		printf("info: pipeline: %.1lf of %zu frames queued avg, %zu max, %zu stalls; produce %.1lf us avg, %.1lf us max; queued %.2lf ms avg, %.2lf ms max\n",
+		       occupancy, pipe_ring.size(), st.occupancy_max, st.stalls, produce, st.produce_max_nsec / 1000, queued, (double)st.queued_max_nsec / 1000000);
+}
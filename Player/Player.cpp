@@ -51,8 +51,6 @@
 #endif
 
 
-RetroWavePlayer player;
-
 std::tuple<size_t, size_t, size_t> RetroWavePlayer::sec2hms(size_t _secs) {
 	size_t mins = _secs / 60;
 	size_t secs = _secs % 60;
@@ -62,7 +60,7 @@ std::tuple<size_t, size_t, size_t> RetroWavePlayer::sec2hms(size_t _secs) {
 	return {hrs, mins, secs};
 }
 
-static std::vector<std::string> string_split(const std::string &s, char delim) {
+std::vector<std::string> RetroWavePlayer::string_split(const std::string &s, char delim) {
 	std::vector<std::string> result;
 	std::stringstream ss (s);
 	std::string item;
@@ -89,6 +87,7 @@ void RetroWavePlayer::init() {
 	init_retrowave();
 	init_tinyvgm();
 	init_term();
+	timing_calibrate();
 }
 
 void RetroWavePlayer::init_term() {
@@ -97,15 +96,27 @@ void RetroWavePlayer::init_term() {
 }
 
 void RetroWavePlayer::init_retrowave() {
+	rtctx.recover_user_data = this;
+	rtctx.callback_recover = callback_recover;
+
 	retrowave_io_init(&rtctx);
 	reset_chips();
-	usleep(200 * 1000);
 }
 
 static int tvc_callback_command(void *userp, unsigned int cmd, const void *buf, uint32_t cmd_val_len)
 {
 	auto t = (RetroWavePlayer *)userp;
 
+	if (t->lookahead) {
+		if (cmd == 0x61 || cmd == 0x62 || cmd == 0x63 || (cmd & 0xf0) == 0x70) {
+			t->lookahead_frame_end();
+		} else if (cmd == 0x5a || cmd == 0x5e || cmd == 0x5f) {
+			// Already sent in an earlier frame
+			if (t->lookahead_skip_write())
+				return TinyVGM_OK;
+		}
+	}
+
 	switch (cmd)
 	{
 		case 0x61: return RetroWavePlayer::callback_sleep     (userp, cmd, buf, cmd_val_len);
@@ -156,7 +167,13 @@ static int tvc_callback_header(void *userp, TinyVGMHeaderField field, uint32_t v
 	switch (field)
 	{
 		case TinyVGM_HeaderField_Total_Samples: return RetroWavePlayer::callback_header_total_samples (userp, value);
-		case TinyVGM_HeaderField_SN76489_Clock: return RetroWavePlayer::callback_header_sn76489       (userp, value);
+		case TinyVGM_HeaderField_SN76489_Clock:
+			RetroWavePlayer::callback_header_clock(userp, field, value);
+			return RetroWavePlayer::callback_header_sn76489(userp, value);
+		case TinyVGM_HeaderField_YM2413_Clock:
+		case TinyVGM_HeaderField_YM3812_Clock:
+		case TinyVGM_HeaderField_YMF262_Clock:
+			return RetroWavePlayer::callback_header_clock(userp, field, value);
 		case TinyVGM_HeaderField_GD3_Offset:
 			t->gd3_offset_abs = value + tinyvgm_headerfield_offset(field);
 			break;
@@ -197,6 +214,16 @@ int32_t tvc_callback_read(void *userp, uint8_t *buf, uint32_t len)
 {
 	auto t = (RetroWavePlayer *)userp;
 
+	if (t->track_stream.active())
+	{
+		int32_t rc = t->track_stream.read(t->file_pos, buf, len);
+
+		if (rc > 0)
+			t->file_pos += rc;
+
+		return rc;
+	}
+
 	if (t->file_pos >= t->file_buf.size())
 	{
 		return 0;
@@ -206,6 +233,8 @@ int32_t tvc_callback_read(void *userp, uint8_t *buf, uint32_t len)
 	{
 		len = t->file_buf.size() - t->file_pos;
 	}
+
+	// TinyVGM wants its own copy, so this is the only one made on the way from the file
 	memcpy (buf, t->file_buf.data() + t->file_pos, len);
 	t->file_pos+=len;
 	return len;
@@ -254,97 +283,61 @@ bool RetroWavePlayer::load_file(const std::string &path) {
 	data_offset_abs = 0;
 	file_pos = 0;
 
-	int fd = open(path.c_str(), O_RDONLY);
-
-	if (fd < 0) {
-		printf("error: failed to open file `%s': %s\n", path.c_str(), strerror(errno));
-		return false;
-	}
-
-	const size_t io_size = 4096;
+	track_stream.close();
 
-	size_t read_len = 0;
+	// The last track may stay in the cache, where it doesn't need to be pinned
+	if (realtime_memlock)
+		file_buf.lock(false);
 
-	while (1) {
-		file_buf.resize(read_len + io_size);
+	file_buf.clear();
 
-		ssize_t rc = read(fd, file_buf.data() + read_len, io_size);
+	// There's no way back in a pipe, so it can only be streamed
+	if (stream_buffer_size || path == "-")
+		return track_stream.open(path, stream_buffer_size ? stream_buffer_size : 1024 * 1024, 64 * 1024);
 
-		if (rc > 0) {
-			read_len += rc;
-		} else if (rc == 0) {
-			file_buf.resize(read_len);
-			break;
-		} else {
-			printf("error: failed to read file `%s': %s\n", path.c_str(), strerror(errno));
-			close(fd);
-			return false;
-		}
-	}
-
-	static const uint8_t vgm_header[] = "Vgm ";
-
-	bool ret = false;
-	bool gz_tried = false;
-	z_stream zlib_strm = {0};
-	size_t zlib_decompressed_size = 0;
-	std::vector<uint8_t> zlib_decompress_buf;
-
-retry_verify_file:
-	if (file_buf.size() > 32) {
-		if (memcmp(file_buf.data(), vgm_header, 4) != 0) { // VGM header not found, try gunzip
-			if (gz_tried) {
-				printf("info: 2nd try failed\n");
-				goto done;
-			}
-
-			printf("info: VGM header not found, try gunzip\n");
+	if (track_cache.enabled())
+		return track_cache.get(path, file_buf);
 
-			inflateInit2(&zlib_strm, 15|32);
-			gz_tried = true;
+	return file_buf.load(path);
+}
 
-			zlib_strm.next_in = file_buf.data();
-			zlib_strm.avail_in = file_buf.size();
+void RetroWavePlayer::prefetch_around(const std::vector<std::string> &file_list, size_t idx) {
+	if (!track_cache.enabled() || stream_buffer_size)
+		return;
 
-			while (1) {
-				zlib_decompress_buf.resize(zlib_decompressed_size + io_size);
+	std::vector<std::string> paths;
 
-				zlib_strm.next_out = zlib_decompress_buf.data() + zlib_decompressed_size;
-				zlib_strm.avail_out = io_size;
+	// Next is the likeliest, then going back once
+	for (size_t n=1; n<=prefetch_tracks && idx + n < file_list.size(); n++)
+		paths.push_back(file_list[idx + n]);
 
-				int zlib_rc = inflate(&zlib_strm, Z_NO_FLUSH);
+	if (idx && prefetch_tracks)
+		paths.push_back(file_list[idx - 1]);
 
-				if (zlib_rc >= 0) {
-					auto out_size = io_size - zlib_strm.avail_out;
-//					printf("info: zlib decompressed %lu bytes\n", out_size);
-					zlib_decompressed_size += out_size;
+	paths.erase(std::remove(paths.begin(), paths.end(), "-"), paths.end());
+	track_cache.prefetch(paths);
+}
 
-					if (zlib_rc == Z_STREAM_END) {
-						inflateEnd(&zlib_strm);
-//						printf("info: zlib decompress done, total %zu bytes\n", zlib_decompressed_size);
-						zlib_decompress_buf.resize(zlib_decompressed_size);
-						std::swap(file_buf, zlib_decompress_buf);
-						goto retry_verify_file;
-					}
-				} else {
-					inflateEnd(&zlib_strm);
-					printf("zlib error %d in file `%s'!\n", zlib_rc, path.c_str());
-					break;
-				}
-			}
-		} else { // Header found
-			ret = true;
-		}
-	} else {
-		printf("error: file too small!\n");
-	}
+void RetroWavePlayer::track_cache_report(bool osd) {
+	if (!track_cache.enabled())
+		return;
 
-done:
-	close(fd);
-	return ret;
+	auto st = track_cache.stats();
+	size_t lookups = st.hits + st.misses;
+
+	if (osd)
+		printf("Track cache: %zu/%zu hits, %zu prefetched, %zu tracks in %.1lf of %.0lf MiB, loads %.1lf ms avg, %.1lf ms max\033[K\n\033[2K",
+		       st.hits, lookups, st.prefetched, st.entries, (double)st.bytes / 1048576, (double)st.budget / 1048576,
+		       st.loads ? st.load_sum_nsec / st.loads / 1000000 : 0, st.load_max_nsec / 1000000);
+	else
+		printf("info: track cache: %zu/%zu hits, %zu prefetched, %zu tracks in %.1lf of %.0lf MiB, loads %.1lf ms avg, %.1lf ms max\n",
+		       st.hits, lookups, st.prefetched, st.entries, (double)st.bytes / 1048576, (double)st.budget / 1048576,
+		       st.loads ? st.load_sum_nsec / st.loads / 1000000 : 0, st.load_max_nsec / 1000000);
 }
 
 void RetroWavePlayer::play(const std::vector<std::string> &file_list) {
+	exit_polled = 1;
+
 	for (size_t i=0; i < file_list.size(); ) {
 		auto &cur_file = file_list[i];
 
@@ -363,24 +356,91 @@ void RetroWavePlayer::play(const std::vector<std::string> &file_list) {
 
 		printf("Now playing (%zu/%zu): %s\n", current_track, total_tracks, current_file);
 
+		timespec load_start;
+		clock_gettime(RETROWAVE_PLAYER_TIME_REF, &load_start);
+
 		if (!load_file(cur_file)) {
 			i++;
 			continue;
 		}
 
+		prefetch_around(file_list, i);
+
+		realtime_prefault();
+
+		chips_used = 0;
+		sn76489_dual = false;
+
 		if (tinyvgm_parse_header (&tvc) != TinyVGM_OK) {
+			track_stream.close();
 			i++;
 			continue;
 		}
 
-		if (gd3_offset_abs) {
+		if (timing_strategy == Timing_Virtual) {
+			timespec load_end;
+			clock_gettime(RETROWAVE_PLAYER_TIME_REF, &load_end);
+			printf("info: track ready after %.1f ms\n", (double)timespec_diff_nsec(load_end, load_start) / 1000000);
+		}
+
+		// A cached track was planned when it was encoded
+		bool from_cache = preparse && !track_stream.active() && wire_cache_open();
+
+		if (!from_cache)
+			lookahead_plan();
+
+		// Only the chips this track uses need a clean state, the rest were muted when the last track ended
+		if (!gapless_begin())
+			reset_chips(chips_used);
+
+		// GD3 sits after the commands, which a stream only gets to at the end
+		if (gd3_offset_abs && !track_stream.active()) {
 			if (tinyvgm_parse_metadata(&tvc, gd3_offset_abs) != TinyVGM_OK) {
 				// ignore errors
 			}
 		}
 
 		callback_header_done(this);
-		tinyvgm_parse_commands(&tvc, data_offset_abs);
+
+		// A stream never has the whole track at hand, so it's parsed as it plays
+		if (preparse && !track_stream.active()) {
+			if (from_cache) {
+				gapless_ready();
+				frame_cpu_end();
+				play_wire();
+			} else {
+				compile_track();
+				gapless_filter();
+
+				if (timing_strategy == Timing_Virtual)
+					printf("info: compiled %zu events in %zu frames\n", compiled.events.size(), compiled.frames.size());
+
+				// The first sample is due once the track is ready, not while it was being compiled
+				timing_rebase(played_samples);
+				gapless_ready();
+				frame_cpu_end();
+				play_compiled();
+			}
+		} else {
+			gapless_ready();
+			frame_cpu_end();
+			tinyvgm_parse_commands(&tvc, data_offset_abs);
+		}
+
+		// Writes are sent ahead of each wait, so the last wait of the track is still pending
+		if (pipeline_active()) {
+			if (key_command == NONE)
+				pipeline_push(PipelineItem::Wait, played_samples);
+
+			pipeline_drain();
+		} else if (key_command == NONE) {
+			timing_sleep_until(timing_deadline(played_samples));
+		}
+
+		if (timing_strategy == Timing_Virtual) {
+			sched_report();
+			track_cache_report(false);
+		}
 
 		switch (key_command)
 		{
@@ -400,12 +460,19 @@ void RetroWavePlayer::play(const std::vector<std::string> &file_list) {
 				break;
 		}
 
+		// A track that played to its end hands its register state over, instead of a reset
+		gapless_armed = gapless && key_command == NONE && !track_stream.active();
+
 		key_command = NONE;
 
 		playback_reset();
 
-		usleep(50 * 1000);
+		// Only now, a track from the wire cache has its register maps caught up by the reset
+		if (gapless_armed)
+			gapless_capture();
 	}
+
+	exit_polled = 0;
 }
 
 void RetroWavePlayer::playback_reset() {
@@ -418,239 +485,28 @@ void RetroWavePlayer::playback_reset() {
 	last_secs = 0;
 
 	metadata = Metadata(); // reset all pointers back to NULL
-	reset_chips();
-	usleep(200 * 1000);
+	track_stream.close();
+	timing_stats = {};
+	sched_stats = {};
+	frame_cpu_mark = {};
+	pipe_stats.pushes = pipe_stats.stalls = pipe_stats.occupancy_max = 0;
+	pipe_stats.occupancy_sum = pipe_stats.produce_sum_nsec = pipe_stats.produce_max_nsec = 0;
+	pipe_stats.queued_sum_nsec = pipe_stats.queued_max_nsec = pipe_stats.sent = 0;
+	memset(transfer_size_hist, 0, sizeof(transfer_size_hist));
+	mute_chips();
+
+	// Muting catches the register maps up from these
+	wire_cache.clear();
+	compiled.clear();
 }
 
 void RetroWavePlayer::do_exit(int rc) {
+	pipeline_stop();
 	reset_chips();
+	governor_restore();
 	term_attr_load();
 #ifdef EMSCRIPTEN
 	retrowave_deinit_web_serialport(&rtctx);
 #endif 
 	exit(rc);
 }
-
-void int_handler(int signal) {
-	player.do_exit(1);
-	exit(1);
-}
-
-void ShowHelpExtra() {
-	puts("");
-
-	puts(" Keyboard commands:\n"
-	     "     q: Quit\n"
-	     "     s: Single frame\n"
-	     "     Space( ): Pause/Resume\n"
-	     "     Slash(/): Hold to Fast forward\n"
-	     "     Comma(,): Previous\n"
-	     "     Dot(.): Next\n");
-#if defined (__CYGWIN__)
-	puts("");
-	puts(" Windows specific notes:\n"
-	     "  1. Windows doesn't have a monotonic self-increasing clock/timer that is unaffected by real world time changes.\n"
-	     "     This may make the playback unstable. And the playback will be destroyed if a NTP time update happens in background.\n"
-	     "  2. OSD refresh rate is set to 1 second and regmap display is disabled by default because of the laggy conhost.exe terminal.\n"
-	     "     If you want to see the register map visualization properly, try using MinTTY as your terminal. Or use another OS.\n"
-	     "  3. To specify serial port, write COMx in device path. e.g. -d COM1");
-#endif
-}
-
-int main(int argc, char **argv) {
-	signal(SIGINT, int_handler);
-
-	cxxopts::Options options("Retrowave_Player", "Retrowave_Player - Player for the Retrowave series.");
-
-	std::string device_type, device_path, spi_cs_gpio, test_type, disabled_vgm_cmds;
-	std::vector<std::string> positional_args;
-
-#if defined (__CYGWIN__)
-	const size_t osd_default_refresh_interval = 1000000000;
-	const int osd_default_show_reg = 0;
-#elif (defined (__APPLE__) && defined (__MACH__))
-	const size_t osd_default_refresh_interval = 1000 * 1000 * 100;
-	const int osd_default_show_reg = 1;
-#else
-	const size_t osd_default_refresh_interval = 1000 * 1000 * 10;
-	const int osd_default_show_reg = 1;
-#endif
-
-	options.add_options("Main")
-		("h,help", "Show this help")
-
-		("t", "Device type (spi/tty)", cxxopts::value<std::string>(device_type)->default_value("tty"))
-		("d", "Device path", cxxopts::value<std::string>(device_path)->default_value("/dev/ttyACM0"))
-#ifdef __linux__
-		("g", "GPIO chip,pin for SPI chip select", cxxopts::value<std::string>(spi_cs_gpio)->default_value("0,6"))
-#endif
-		("D", "Comma separated list of disabled processing of certain VGM commands in hex", cxxopts::value<std::string>(disabled_vgm_cmds)->default_value(""))
-		("i", "OSD refresh interval in ns, 0 to disable", cxxopts::value<size_t>(player.osd_ratelimit_thresh)->default_value(std::to_string(osd_default_refresh_interval)))
-		("m", "Show metadata in OSD (1/0)", cxxopts::value<int>(player.osd_show_meta)->default_value(std::to_string(1)))
-		("r", "Show chip regs in OSD (1/0)", cxxopts::value<int>(player.osd_show_regs)->default_value(std::to_string(osd_default_show_reg)))
-		("T", "Test to run (\"help\" for a list)",  cxxopts::value<std::string>(test_type)->default_value(""))
-
-		;
-
-	options.add_options("positional")
-		("positional", "Positional parameters: The files to play", cxxopts::value<std::vector<std::string>>(positional_args))
-		;
-
-	options.parse_positional("positional");
-	options.positional_help("[FILES...]").show_positional_help();
-
-
-	try {
-		auto cmd = options.parse(argc, argv);
-
-		if (cmd.count("help") || (test_type.empty() && positional_args.empty())) {
-			std::cout << options.help({"Main"});
-			ShowHelpExtra();
-			return 0;
-		}
-
-	} catch (std::exception &e) {
-		std::cout << "Error: " << e.what() << "\n";
-		std::cout << options.help({"Main"});
-		ShowHelpExtra();
-		return 1;
-	}
-
-	if (device_type == "spi") {
-#ifdef __linux__
-		auto scgs = string_split(spi_cs_gpio, ',');
-		int scg[2] = {0};
-
-		if (scgs.size() != 2) {
-			puts("error: bad GPIO specification. Please use the `gpiochip,line' format.");
-			exit(2);
-		}
-
-		scg[0] = strtol(scgs[0].c_str(), nullptr, 10);
-		scg[1] = strtol(scgs[1].c_str(), nullptr, 10);
-
-		printf("SPI CS: chip=%d, line=%d\n", scg[0], scg[1]);
-
-		if (retrowave_init_linux_spi(&player.rtctx, device_path.c_str(), scg[0], scg[1])) {
-			exit(2);
-		}
-#else
-		puts("error: SPI is not supported on your platform.");
-		exit(2);
-#endif
-	} else if (device_type == "tty") {
-#if defined (__CYGWIN__)
-		if (device_path.find("COM") == 0) {
-			char *comnum_str = const_cast<char *>(device_path.c_str() + 3);
-			long comnum = strtol(comnum_str, nullptr, 10);
-
-			device_path = "/dev/ttyS";
-			device_path += std::to_string(comnum - 1);
-		}
-#endif
-
-#ifndef EMSCRIPTEN
-		if (retrowave_init_posix_serialport(&player.rtctx, device_path.c_str())) {
-			exit(2);
-		}
-#else
-		if (retrowave_init_web_serialport(&player.rtctx)) {
-			exit(2);
-		}
-#endif
-	} else {
-		puts("Unsupported device type. Please read the help.");
-		exit(2);
-	}
-
-	int prio = -5;
-
-	// Windows sucks, again
-#if defined (__CYGWIN__)
-	prio = -20;
-#endif
-
-	int rc = setpriority(PRIO_PROCESS, 0, prio);
-
-	if (rc < 0) {
-		puts("Failed to change process priority. You may experience lags.");
-	}
-
-	player.parse_disabled_vgm_commands(disabled_vgm_cmds);
-	player.init();
-
-	usleep(100 * 1000);
-
-	if (test_type.empty()) {
-		player.play(positional_args);
-		puts("Done playing!");
-	} else {
-		const std::unordered_map<std::string, std::function<void()>> tests = {
-			{"opl3_sine", [&](){
-				printf("OPL3 Sine Wave Test\n");
-				printf("From https://www.vogons.org/viewtopic.php?t=55181\n");
-				puts("");
-
-				const std::vector<std::pair<uint8_t, uint8_t>> data = {
-					{0x20, 0x03},
-					{0x23, 0x01},
-					{0x40, 0x2f},
-					{0x43, 0x00},
-					{0x61, 0x10},
-					{0x63, 0x10},
-					{0x80, 0x00},
-					{0x83, 0x00},
-					{0xa0, 0x44},
-					{0xb0, 0x12},
-					{0xc0, 0xfe},
-					{0xb0, 0x32}
-				};
-
-				for (auto &it : data) {
-					printf("Write reg: 0x%02x 0x%02x\n", it.first, it.second);
-					retrowave_opl3_emit_port0(&player.rtctx, it.first, it.second);
-				}
-
-				printf("Sleeping 1 sec...\n");
-				sleep(1);
-
-				const uint8_t last_reg[2] = {0x60, 0xf0};
-
-				printf("Write reg: 0x%02x 0x%02x\n", last_reg[0], last_reg[1]);
-				retrowave_opl3_emit_port0(&player.rtctx, last_reg[0], last_reg[1]);
-
-				printf(
-					"If you hear sine wave you have a real OPL3 or very accurate clone,\n"
-					"otherwise you have OPL clone.\n"
-					"Press Ctrl-C to close program.\n"
-				);
-
-#ifndef EMSCRIPTEN
-				sleep(500);
-#else
-				emscripten_sleep(50000);
-#endif
-			}
-			},
-		};
-
-		auto it = tests.find(test_type);
-
-		if (it == tests.end()) {
-			printf("Available tests:\n");
-
-			for (auto &it2 : tests) {
-				std::cout << it2.first << "\n";
-			}
-		} else {
-			std::cout << "Running test: " << it->first << "\n";
-			it->second();
-		}
-	}
-
-
-	player.do_exit(0);
-
-	return 0;
-}
-
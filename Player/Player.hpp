@@ -47,9 +47,16 @@
 
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <system_error>
 #include <locale>
 #include <codecvt>
+#include <algorithm>
+#include <vector>
+#include <list>
+#include <memory>
 
 #include <cassert>
 #include <cstdio>
@@ -59,6 +66,7 @@
 #include <cstring>
 #include <csignal>
 #include <cinttypes>
+#include <cerrno>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -80,6 +88,7 @@
 #include <RetroWaveLib/Board/OPL3.h>
 #include <RetroWaveLib/Board/MiniBlaster.h>
 #include <RetroWaveLib/Board/MasterGear.h>
+#include <RetroWaveLib/Protocol/Serial.h>
 
 #include <TinyVGM.h>
 
@@ -105,8 +114,278 @@ typedef struct {
 	uint8_t att[4];
 	uint16_t freq[3];
 
+	bool latch_bumped;	// The chip got the last tone latch with bit 0 set, so its period wasn't 0
+
 } SN76489Registers;
 
+// A whole track in memory: a plain VGM is mapped from the file, a VGZ is inflated once into its own buffer.
+// Copies share the memory, which goes away with the last one.
+class TrackData {
+public:
+	bool load(const std::string &path, bool quiet = false);
+	void clear();
+	void willneed() const;
+	bool lock(bool on) const;
+
+	const uint8_t *data() const {
+		return buf;
+	}
+
+	size_t size() const {
+		return len;
+	}
+
+	const uint8_t &operator[](size_t i) const {
+		return buf[i];
+	}
+
+private:
+	struct Storage {
+		void *map = nullptr;
+		size_t map_len = 0;
+		uint8_t *inflated = nullptr;
+
+		~Storage();
+	};
+
+	bool inflate_gz(const uint8_t *src, size_t src_len, const std::string &path, bool quiet);
+
+	std::shared_ptr<Storage> storage;
+
+	const uint8_t *buf = nullptr;
+	size_t len = 0;
+};
+
+// Tracks loaded ahead by a background thread, and the last played ones, kept up to a memory budget
+class TrackCache {
+public:
+	struct Stats {
+		size_t hits, misses, prefetched, entries;
+		size_t bytes, budget;
+		double load_sum_nsec, load_max_nsec;	// Of all loads, in front or in the background
+		size_t loads;
+	};
+
+	TrackCache() = default;
+	TrackCache(const TrackCache &) = delete;
+	TrackCache &operator=(const TrackCache &) = delete;
+	~TrackCache();
+
+	void set_budget(size_t bytes) {
+		budget = bytes;
+	}
+
+	bool enabled() const {
+		return budget;
+	}
+
+	// Waits for the track if it's being loaded right now, loads it here if nobody did yet
+	bool get(const std::string &path, TrackData &out);
+
+	// Replaces what's left to load with these, first ones first
+	void prefetch(const std::vector<std::string> &paths);
+
+	Stats stats();
+
+private:
+	struct Entry {
+		std::string path;
+		TrackData data;
+	};
+
+	void loader();
+	bool load(const std::string &path, bool quiet);
+	void insert(const std::string &path, const TrackData &data);
+
+	size_t budget = 0;
+	std::list<Entry> lru;	// Most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<std::string> queue;
+	std::string loading;
+	bool stop = false;
+
+	Stats st{};
+};
+
+// A track's commands compiled ahead of playback into flat arrays, so playing it is a walk instead of a parse
+struct CompiledTrack {
+	static const uint32_t no_wait = UINT32_MAX;
+
+	struct Event {
+		uint8_t cmd;		// VGM command, which picks the chip and port
+		uint8_t reg, val;	// Only val for SN76489
+	};
+
+	struct Frame {
+		uint32_t first, count;	// Events written before the wait
+		uint32_t bytes;		// Command bytes, for the OSD
+		uint32_t wait;		// Samples, no_wait for the writes after the last wait
+	};
+
+	std::vector<Event> events;
+	std::vector<Frame> frames;
+
+	void clear() {
+		events.clear();
+		frames.clear();
+	}
+};
+
+// Wire image cache file: a header, then frames, segments, events and the wire bytes, each 8 byte aligned
+struct WireCacheHeader {
+	char magic[8];			// "RWWIRE\0\0"
+	uint32_t version, format;
+	uint64_t content_hash;		// Of the (inflated) VGM
+	uint64_t config_hash;		// Of everything else that changes the bytes
+	uint32_t frame_count, segment_count, event_count, reserved;
+	uint64_t frames_offset, segments_offset, events_offset, data_offset, data_size;
+};
+
+struct WireCacheFrame {
+	uint64_t deadline;		// Samples from the start of the track, the last frame has no wait after it
+	uint32_t data_offset, data_len;	// Wire bytes
+	uint32_t first_segment, segment_count;	// Only for WireCache::Format_Segments, offsets are from the frame's data
+	uint32_t first_event, event_count;
+	uint32_t cmd_bytes;		// MCP23S17 bytes, before any packing
+	uint32_t bytes;			// VGM command bytes, for the OSD
+};
+
+// Encoded bytes caught on their way to the platform, see RetroWavePlayer::callback_capture_io()
+struct WireCapture {
+	uint32_t format;		// WireCache::Format
+	std::vector<uint8_t> data;
+	std::vector<RetroWaveSegment> segments;
+	uint32_t frame_data_start;	// Segment offsets are from here
+	uint32_t cmd_bytes;		// MCP23S17 bytes before packing
+};
+
+class WireCache {
+public:
+	enum Format {
+		Format_Segments = 0,	// MCP23S17 transfers, handed to the platform like a flush
+		Format_SerialPacked	// Already packed for the serial protocol
+	};
+
+	static const uint32_t version = 1;
+
+	WireCache() = default;
+	WireCache(const WireCache &) = delete;
+	WireCache &operator=(const WireCache &) = delete;
+	~WireCache();
+
+	bool load(const std::string &path, uint64_t content_hash, uint64_t config_hash);
+	void clear();
+
+	static bool save(const std::string &path, const WireCacheHeader &header, const std::vector<WireCacheFrame> &frames,
+			 const std::vector<RetroWaveSegment> &segments, const std::vector<CompiledTrack::Event> &events, const std::vector<uint8_t> &data);
+
+	bool active() const {
+		return hdr;
+	}
+
+	const WireCacheHeader &header() const {
+		return *hdr;
+	}
+
+	const WireCacheFrame *frames() const {
+		return (const WireCacheFrame *)(base() + hdr->frames_offset);
+	}
+
+	const RetroWaveSegment *segments() const {
+		return (const RetroWaveSegment *)(base() + hdr->segments_offset);
+	}
+
+	const CompiledTrack::Event *events() const {
+		return (const CompiledTrack::Event *)(base() + hdr->events_offset);
+	}
+
+	const uint8_t *data() const {
+		return base() + hdr->data_offset;
+	}
+
+private:
+	const uint8_t *base() const {
+		return (const uint8_t *)map;
+	}
+
+	void *map = nullptr;
+	size_t map_len = 0;
+	const WireCacheHeader *hdr = nullptr;
+};
+
+// A track read (and inflated if it's a VGZ) by a background thread into a bounded ring, for pipes and huge files
+class TrackStream {
+public:
+	TrackStream() = default;
+	TrackStream(const TrackStream &) = delete;
+	TrackStream &operator=(const TrackStream &) = delete;
+	~TrackStream();
+
+	bool open(const std::string &path, size_t buffer_size, size_t retain_size);
+	void close();
+
+	// Blocks until data at pos arrives. 0 at the end, -1 if pos already left the retained window
+	int32_t read(uint64_t pos, uint8_t *buf, uint32_t len);
+
+	bool active() const {
+		return thread.joinable();
+	}
+
+	uint64_t bytes_read() const {
+		return head;
+	}
+
+private:
+	void reader();
+	bool push(const uint8_t *data, size_t len);
+	void copy_out(uint64_t pos, uint8_t *buf, uint32_t len);
+
+	// Everything older than the retained window behind the consumer can be overwritten
+	uint64_t keep_from() const {
+		return consumed > retain ? consumed - retain : 0;
+	}
+
+	int fd = -1;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	std::vector<uint8_t> ring;
+	size_t retain = 0;
+	uint64_t head = 0;		// Bytes produced so far
+	uint64_t consumed = 0;		// Furthest position the consumer asked for
+	bool eof = false, stop = false;
+
+	// What the consumer saw the last time it took the lock, only touched by the consumer
+	uint64_t seen_head = 0, seen_keep_from = 0;
+};
+
+// Where the player takes the time from and how it waits for it. Without one it's the host's clock
+class TimingClock {
+public:
+	virtual ~TimingClock() = default;
+
+	virtual void now(timespec &ts) = 0;
+	virtual void sleep_until(const timespec &deadline) = 0;
+
+	// Time taken by work rather than waiting, e.g. a transfer over a modelled link
+	virtual void spend(uint64_t nsec) = 0;
+};
+
+// Time that only moves when the player sleeps or spends it, so playback runs at full CPU speed
+class VirtualClock : public TimingClock {
+public:
+	timespec time{};
+
+	void now(timespec &ts) override;
+	void sleep_until(const timespec &deadline) override;
+	void spend(uint64_t nsec) override;
+};
+
 class RetroWavePlayer {
 public:
 	enum {
@@ -121,14 +400,88 @@ public:
 		FAST_FORWARD = 0x20
 	};
 
+	enum TimingStrategy {
+		Timing_Sleep = 0,
+		Timing_Spin,
+		Timing_TimerFD,
+		Timing_Virtual
+	};
+
+	enum OverrunPolicy {
+		Overrun_Burst = 0,
+		Overrun_Merge,
+		Overrun_Rebase
+	};
+
+	enum ChipMask {
+		Chip_OPL3 = 0x1,
+		Chip_YM2413 = 0x2,
+		Chip_SN76489 = 0x4,
+		Chip_All = 0x7
+	};
+
 	// File I/O
-	std::vector<uint8_t> file_buf;
+	TrackData file_buf;
+	TrackCache track_cache;
+	size_t prefetch_tracks = 2;	// Ahead in the playlist, plus the one before
+	TrackStream track_stream;
+	CompiledTrack compiled;
+	int preparse = 1;
+
+	size_t stream_buffer_size = 0;	// 0 to load whole tracks
 	uint32_t file_pos;
 
+	// Wire image cache
+	std::string cache_dir;
+	std::string device_name;
+	WireCache wire_cache;
+	size_t wire_sent_frames = 0, wire_queued_frames = 0;	// The ones in between are sent by the next flush
+	size_t wire_resynced_events = 0;	// Already in the register maps and wire_chip_state
+	RetroWaveChipState wire_chip_state;	// What the chips hold after those events
+
+	// Pipeline: this thread parses and encodes into wctx, the I/O thread sends on rtctx
+	struct PipelineItem {
+		enum Type {
+			Frame = 0,	// Send at the deadline
+			Immediate,	// Send now, then give the chips settle_usecs
+			Rebase,		// Restart the clock at samples
+			Wait		// Only wait for the deadline, the end of a track
+		} type;
+
+		uint32_t generation;	// Items from before a discard are dropped
+		uint64_t samples;	// Deadline
+		uint32_t settle_usecs;
+		timespec pushed;
+		WireCapture wire;
+	};
+
+	int pipeline_lead_msecs = 0;	// 0 to parse and send on one thread
+	RetroWaveContext *wctx = &rtctx;	// Where writes are queued
+	RetroWaveContext pipe_encoder;
+	std::vector<PipelineItem> pipe_ring;
+	std::atomic<size_t> pipe_head{0}, pipe_tail{0};
+	std::atomic<uint32_t> pipe_generation{0};
+	std::atomic<uint64_t> pipe_sent_samples{0};	// Deadline of the last item the I/O thread finished
+	std::atomic<bool> pipe_stop{false}, pipe_recovered{false};
+	std::thread pipe_thread;
+	std::mutex pipe_mutex;
+	std::condition_variable pipe_cond;	// The I/O thread sleeps on it while the ring is empty
+	timespec pipe_produce_mark{};
+	WireCapture pipe_merge;
+
+	struct {
+		size_t pushes, stalls;
+		double occupancy_sum, produce_sum_nsec, produce_max_nsec;
+		size_t occupancy_max;
+		std::atomic<uint64_t> queued_sum_nsec, queued_max_nsec, sent;
+	} pipe_stats{};
+
 	// Controls
 	struct termios term_state;
 	PlaybackCommand key_command;
 	bool single_step = false;
+	volatile sig_atomic_t exit_polled = 0;	// Playing, so the frames pick up exit_signal
+	volatile sig_atomic_t exit_signal = 0;	// Left by the SIGINT/SIGTERM/SIGHUP handler
 
 	// RegMap
 	std::map<int, std::unordered_set<uint16_t>> reg_map_refreshed_list;
@@ -149,7 +502,11 @@ public:
 	size_t played_samples = 0, last_slept_samples = 0, last_last_slept_samples = 0, total_samples = 0;
 	size_t queued_bytes = 0, last_secs = 0, bytes_per_sec = 0;
 	uint64_t last_slept_usecs = 0;
+	size_t link_recoveries = 0;
+	RetroWaveIOStats io_stats_last{};
+	double io_syscalls_per_sec = 0, io_usecs_per_transfer = 0;
 	bool sn76489_dual = false;
+	uint8_t chips_used = 0;
 
 	// Metadata
 	struct Metadata {
@@ -159,6 +516,63 @@ public:
 
 	timespec sleep_end;
 
+	// Timing
+	TimingStrategy timing_strategy = Timing_Sleep;
+	int64_t timing_spin_margin_nsec = 100 * 1000;
+	int timing_fd = -1;
+	timespec timing_epoch{};
+	TimingClock *timing_clock = nullptr;
+	VirtualClock timing_virtual;
+	uint64_t timing_epoch_samples = 0;
+
+	OverrunPolicy overrun_policy = Overrun_Burst;
+
+	struct {
+		size_t deadline_misses, merged_frames, rebases, flushes, batched_frames;
+		double late_max_nsec, early_sum_nsec, early_max_nsec, land_err_sum_nsec, land_err_max_nsec;
+		double wake_to_wire_sum_nsec, wake_to_wire_max_nsec;
+		double frame_cpu_sum_nsec, frame_cpu_max_nsec;
+		size_t frame_cpu_count;
+	} sched_stats{};
+
+	// CPU time spent between flushes, measured when running on the virtual clock
+	bool frame_cpu_stats = false;
+	timespec frame_cpu_mark{};
+
+	int encode_ahead = 1;
+
+	// Null device
+	double null_nsec_per_byte = 0;
+	uint64_t null_nsec_per_transfer = 0;
+	size_t transfer_size_hist[12]{};
+
+	uint32_t flush_quantum_samples = 0, quantum_pending_samples = 0;
+	uint64_t quantum_batch_samples = 0;
+
+	bool ttw_auto = true;
+	bool ttw_serial_packed = false;	// The link carries frames packed by the serial protocol
+	std::atomic<double> ttw_nsec_per_byte{0};	// Per byte on the wire, learned on the I/O thread
+	std::atomic<uint64_t> ttw_last_nsec{0};
+	RetroWaveIOStats ttw_stats_last{};
+
+	struct TimingStats {
+		size_t wakeups;
+		double late_sum, late_sqsum, late_max;
+	} timing_stats{};
+
+	// What the OSD shows of the counters the I/O thread keeps. In pipeline mode it hands over a copy after
+	// each item, as 64-bit counters read while being written can tear on 32-bit CPUs
+	struct IOSnapshot {
+		RetroWaveIOStats io_stats;
+		TimingStats timing_stats;
+		size_t link_recoveries;
+		size_t deadline_misses, merged_frames, rebases, flushes;
+		double late_max_nsec, wake_to_wire_sum_nsec, wake_to_wire_max_nsec;
+	};
+
+	std::mutex pipe_snapshot_mutex;
+	IOSnapshot pipe_snapshot{};
+
 	TinyVGMContext tvc;
 	uint32_t gd3_offset_abs;
 	uint32_t data_offset_abs;
@@ -166,9 +580,44 @@ public:
 
 	std::unordered_set<uint8_t> disabled_vgm_commands;
 
+	// Realtime
+	bool realtime_memlock = false;
+	static int term_fd;	// Keyboard, /dev/tty when the track comes from stdin
+	int pm_qos_fd = -1;
+	// Restored from signal handlers too, so nothing in here needs allocating or freeing
+	struct GovernorSaved {
+		int fd;		// Its scaling_governor, kept open
+		char name[32];	// Governor to restore
+		size_t name_len;
+	};
+
+	static constexpr int governor_saved_max = 256;
+	GovernorSaved governor_saved[governor_saved_max];
+	volatile sig_atomic_t governor_saved_count = 0;
+
+	// Gapless
+	int gapless = 0;
+	bool gapless_armed = false;	// The last track played to its end, its register state carries over
+	bool gapless_active = false;	// This track started from that state instead of a reset
+	uint8_t gapless_chips = 0;
+	std::vector<std::vector<int16_t>> gapless_regs;	// By chip port, -1 when unknown
+	size_t gapless_transitions = 0, gapless_diff_writes = 0, gapless_dropped_writes = 0;
+	timespec gapless_end{};
+
+	// Lookahead
+	struct LookaheadWrite {
+		uint8_t cmd, reg, val;
+	};
+
+	int lookahead = 0;
+	std::unordered_map<uint32_t, std::vector<LookaheadWrite>> lookahead_inject;	// Frame -> writes moved there
+	std::unordered_set<uint64_t> lookahead_skip;					// Frame << 32 | OPL3 write ordinal
+	uint32_t lookahead_frame = 0, lookahead_ordinal = 0;
+
 
 public:
 	static std::tuple<size_t, size_t, size_t> sec2hms(size_t _secs);
+	static std::vector<std::string> string_split(const std::string &s, char delim);
 	static void set_nonblocking(int fd_, bool __nonblocking = true);
 
 	// Main
@@ -182,10 +631,77 @@ public:
 
 	// File I/O
 	bool load_file(const std::string& path);
+	void prefetch_around(const std::vector<std::string> &file_list, size_t idx);
+	void track_cache_report(bool osd);
 
 	// RegMap
 	void regmap_insert(int idx, uint8_t reg, uint8_t val);
 	void regmap_sn76489_insert(uint8_t chip_idx, uint8_t data);
+	void regmap_replay();
+
+	// Realtime
+	bool realtime_setup(const std::string &spec, int cpu);
+	void realtime_prefault();
+	static void realtime_demote_thread();
+	void pm_qos_hold(int32_t latency_usecs);
+	void governor_set(const std::string &name, int cpu);
+	void governor_restore();
+
+	// Event stream
+	static size_t vgm_command_length(const uint8_t *p, size_t remain);
+	static bool vgm_is_wait(uint8_t cmd);
+	static uint32_t vgm_wait_samples(const uint8_t *p);
+	void compile_track();
+	// Queues one event on rtctx, false for SN76489 which keeps its own register map
+	bool queue_event(const CompiledTrack::Event &ev);
+	int play_compiled();
+	void frame_cpu_begin();
+	void frame_cpu_end();
+
+	// Wire image cache
+	static uint64_t wire_hash(const void *data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL);
+	uint64_t wire_config_hash(uint32_t format);
+	std::string wire_cache_path(uint64_t content_hash, uint64_t config_hash);
+	bool wire_cache_open();
+	bool wire_compile_file(const std::string &path, uint32_t format);
+	void wire_compile_library(const std::vector<std::string> &paths);
+	int play_wire();
+	bool wire_pending() const {
+		return wire_queued_frames > wire_sent_frames;
+	}
+	uint32_t wire_pending_cmd_bytes() const;
+	void wire_send_pending();
+	void wire_resync();
+
+	// Pipeline
+	bool pipeline_active() const {
+		return wctx != &rtctx;
+	}
+
+	void pipeline_start();
+	void pipeline_stop();
+	void pipeline_push(PipelineItem::Type type, uint64_t samples, uint32_t settle_usecs = 0);
+	void pipeline_claim();
+	void pipeline_drain();
+	void pipeline_wake();
+	void pipeline_publish();
+	void pipeline_snapshot(IOSnapshot &out);
+	void pipeline_discard();
+	void pipeline_consumer();
+	void pipeline_run(PipelineItem &item);
+	void pipeline_write(const WireCapture &wire);
+	void pipeline_report(bool osd);
+
+	// Gapless
+	void gapless_capture();
+	bool gapless_begin();
+	void gapless_filter();
+	void gapless_ready();
+
+	// Lookahead
+	void lookahead_plan();
+	bool lookahead_skip_write();
+	void lookahead_frame_end();
 
 	// OSD
 	static void term_clear();
@@ -201,6 +717,32 @@ public:
 	// Metadata
 	static void char16_to_string(std::string& str, int16_t *c16, uint32_t memsize);
 
+	// Timing
+	static const char *overrun_policy_name(OverrunPolicy policy);
+	bool overrun_set_policy(const std::string &name);
+	static const char *timing_strategy_name(TimingStrategy strategy);
+	bool timing_set_strategy(const std::string &name);
+	void timing_use_clock(TimingClock *clock);
+	void timing_now(timespec &ts);
+	static timespec samples_to_timespec(uint64_t samples);
+	void timing_rebase(uint64_t samples);
+	void timing_set_epoch(uint64_t samples);
+	bool frame_overrun(uint64_t due_samples, uint64_t next_samples);	// next_samples is 0 when unknown
+	void frame_flush_at(uint64_t due_samples, uint32_t cmd_bytes, const WireCapture *wire = nullptr);
+	timespec timing_deadline(uint64_t samples);
+	void timing_sleep_basic(const timespec &deadline);
+	void timing_sleep_strategy(TimingStrategy strategy, const timespec &deadline);
+	void timing_sleep_nsec(uint64_t nsec);
+	void timing_sleep_until(const timespec &deadline);
+	std::vector<int64_t> timing_measure(TimingStrategy strategy, size_t rounds, uint64_t interval_nsec);
+	void timing_calibrate();
+	static void timing_stats_get(const TimingStats &st, double &avg_usecs, double &jitter_usecs, double &max_usecs);
+	void io_snapshot_take(IOSnapshot &out);
+	void sched_report();
+	bool ttw_setup(const std::string &device_type, const std::string &mode);
+	uint64_t ttw_estimate(uint32_t cmd_bytes);
+	void ttw_update();
+
 	// Controls
 	static void term_attr_disable_buffering();
 	void term_attr_save();
@@ -211,12 +753,24 @@ public:
 
 
 	// SoundDriver
+	std::string spi_speeds_path;
+
+	void spi_speeds_load();
+	void spi_calibrate();
+
 	void mute_chips();
-	void reset_chips();
+	void reset_chips(uint8_t chips = Chip_All);
 	void flush_chips();
 
+	static void callback_recover(void *userp);
+	static void callback_null_io(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len);
+	static void callback_capture_io(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len);
+	static void callback_capture_segments(void *userp, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count);
+	static void callback_capture_raw(void *userp, const uint8_t *data, uint32_t len);
+
 	static int callback_header_total_samples(void *userp, uint32_t value);
 	static int callback_header_sn76489(void *userp, uint32_t value);
+	static int callback_header_clock(void *userp, TinyVGMHeaderField field, uint32_t value);
 	static int callback_header_done(void *userp);
 
 	static int callback_saa1099(void *userp, uint8_t value, const void *buf, uint32_t len);
@@ -233,10 +787,12 @@ public:
 	static int callback_sleep_63(void *userp, uint8_t value, const void *buf, uint32_t len);
 	static int callback_sleep_7n(void *userp, uint8_t value, const void *buf, uint32_t len);
 
-	void sn76489_zero_freq_workaround(uint8_t idx);
+	void sn76489_queue(uint8_t idx, uint8_t val);
 
 	static timespec nsec_to_timespec(uint64_t nsec);
 	static void timespec_add(timespec &addee, const timespec &adder);
+	static void timespec_sub(timespec &subtrahend, const timespec &subtractor);
+	static int64_t timespec_diff_nsec(const timespec &a, const timespec &b);
 	static int timespec_cmp(const timespec &a, const timespec &b);
 
 	int flush_and_sleep(uint32_t sleep_samples);
@@ -0,0 +1,313 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#include <sys/mman.h>
+
+#ifndef EMSCRIPTEN
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <dirent.h>
+#endif
+
+bool RetroWavePlayer::realtime_setup(const std::string &spec, int cpu) {
+#ifdef EMSCRIPTEN
+	puts("info: realtime: not supported on this platform");
+	return true;
+#else
+	auto sep = spec.find(',');
+	std::string policy_name = spec.substr(0, sep);
+	int priority = sep == std::string::npos ? 50 : strtol(spec.c_str() + sep + 1, nullptr, 10);
+	int policy;
+
+	if (policy_name == "fifo") {
+		policy = SCHED_FIFO;
+	} else if (policy_name == "rr") {
+		policy = SCHED_RR;
+	} else {
+		return false;
+	}
+
+	int prio_min = sched_get_priority_min(policy), prio_max = sched_get_priority_max(policy);
+
+	if (priority < prio_min || priority > prio_max) {
+		printf("error: realtime priority must be in %d-%d.\n", prio_min, prio_max);
+		return false;
+	}
+
+	// Each step falls back on its own, so whatever could be had is still used
+	sched_param param = {};
+	param.sched_priority = priority;
+
+	if (sched_setscheduler(0, policy, &param))
+		printf("info: realtime: can't use SCHED_%s: %s, staying on the normal scheduler\n", policy == SCHED_FIFO ? "FIFO" : "RR", strerror(errno));
+	else
+		printf("info: realtime: SCHED_%s priority %d\n", policy == SCHED_FIFO ? "FIFO" : "RR", priority);
+
+	if (cpu >= 0) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		if (sched_setaffinity(0, sizeof(set), &set))
+			printf("info: realtime: can't pin to CPU %d: %s\n", cpu, strerror(errno));
+		else
+			printf("info: realtime: pinned to CPU %d\n", cpu);
+#else
+		puts("info: realtime: CPU pinning is not supported on this platform");
+#endif
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		printf("info: realtime: can't lock memory: %s, page faults may still cause lags\n", strerror(errno));
+	} else {
+		realtime_memlock = true;
+		puts("info: realtime: memory locked");
+	}
+
+#ifdef __linux__
+	// Normal tasks get 50 us of slack on every sleep by default
+	if (prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0))
+		printf("info: realtime: can't set timer slack: %s\n", strerror(errno));
+	else
+		puts("info: realtime: timer slack 1 ns");
+#endif
+
+	realtime_prefault();
+
+	return true;
+#endif
+}
+
+void RetroWavePlayer::realtime_prefault() {
+	if (!realtime_memlock)
+		return;
+
+	const long page_size = sysconf(_SC_PAGESIZE);
+
+	// Stack pages the sound driver may reach, so the first deep call doesn't fault
+	volatile uint8_t stack[256 * 1024];
+
+	for (size_t i=0; i<sizeof(stack); i+=page_size)
+		stack[i] = 0;
+
+	// Tracks are left out of the lock while they're cached, this one is about to play
+	if (!file_buf.lock(true))
+		printf("info: realtime: can't lock the track in memory: %s\n", strerror(errno));
+
+	// The command buffer is filled from the front, so its tail may never have been touched
+	if (rtctx.cmd_buffer) {
+		for (size_t i=rtctx.cmd_buffer_used; i<rtctx.cmd_buffer_size; i+=page_size)
+			rtctx.cmd_buffer[i] = 0;
+	}
+}
+
+void RetroWavePlayer::realtime_demote_thread() {
+#ifndef EMSCRIPTEN
+	// Threads inherit the realtime policy and the pinned CPU, background work must not compete with playback for them
+	sched_param param = {};
+
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	for (int i=0; i<CPU_SETSIZE; i++)
+		CPU_SET(i, &set);
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#endif
+}
+
+void RetroWavePlayer::pm_qos_hold(int32_t latency_usecs) {
+#ifdef __linux__
+	if (pm_qos_fd >= 0) {
+		close(pm_qos_fd);
+		pm_qos_fd = -1;
+	}
+
+	if (latency_usecs < 0)
+		return;
+
+	int fd = open("/dev/cpu_dma_latency", O_WRONLY);
+
+	if (fd < 0) {
+		printf("info: pm qos: can't open /dev/cpu_dma_latency: %s, CPU idle states may add latency\n", strerror(errno));
+		return;
+	}
+
+	// The request lasts as long as the file stays open
+	if (write(fd, &latency_usecs, sizeof(latency_usecs)) != sizeof(latency_usecs)) {
+		printf("info: pm qos: can't request a %" PRId32 " us CPU latency: %s\n", latency_usecs, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	pm_qos_fd = fd;
+	printf("info: pm qos: CPU latency capped at %" PRId32 " us\n", latency_usecs);
+#endif
+}
+
+static bool read_line(const std::string &path, std::string &line) {
+	FILE *f = fopen(path.c_str(), "r");
+
+	if (!f)
+		return false;
+
+	char buf[64];
+	bool ret = fgets(buf, sizeof(buf), f);
+
+	fclose(f);
+
+	if (ret) {
+		line = buf;
+
+		while (!line.empty() && line.back() == '\n')
+			line.pop_back();
+	}
+
+	return ret;
+}
+
+void RetroWavePlayer::governor_set(const std::string &name, int cpu) {
+#ifdef __linux__
+	std::vector<int> cpus;
+
+	if (cpu >= 0) {
+		cpus.push_back(cpu);
+	} else {
+		// Not pinned, so any CPU could be running the player
+		DIR *dir = opendir("/sys/devices/system/cpu");
+
+		if (dir) {
+			while (auto ent = readdir(dir)) {
+				int n;
+				char c;
+
+				if (sscanf(ent->d_name, "cpu%d%c", &n, &c) == 1)
+					cpus.push_back(n);
+			}
+
+			closedir(dir);
+		}
+
+		std::sort(cpus.begin(), cpus.end());
+	}
+
+	for (int n : cpus) {
+		std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(n) + "/cpufreq/scaling_governor";
+		std::string old;
+
+		if (!read_line(path, old)) {
+			printf("info: governor: CPU %d has no cpufreq governor\n", n);
+			continue;
+		}
+
+		if (old == name)
+			continue;
+
+		if (governor_saved_count == governor_saved_max) {
+			printf("info: governor: CPU %d and up left alone, only %d can be restored\n", n, governor_saved_max);
+			break;
+		}
+
+		auto &saved = governor_saved[governor_saved_count];
+
+		if (old.size() > sizeof(saved.name)) {
+			printf("info: governor: CPU %d left alone, its governor %s is too long to restore\n", n, old.c_str());
+			continue;
+		}
+
+		int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+
+		if (fd < 0 || write(fd, name.c_str(), name.size()) != (ssize_t)name.size()) {
+			printf("info: governor: can't switch CPU %d from %s to %s: %s\n", n, old.c_str(), name.c_str(), strerror(errno));
+
+			if (fd >= 0)
+				close(fd);
+
+			continue;
+		}
+
+		saved.fd = fd;
+		memcpy(saved.name, old.data(), old.size());
+		saved.name_len = old.size();
+
+		// Counted only once it's complete, a signal before that just leaves this CPU switched
+		governor_saved_count = governor_saved_count + 1;
+
+		printf("info: governor: CPU %d switched from %s to %s\n", n, old.c_str(), name.c_str());
+	}
+#else
+	puts("info: governor: not supported on this platform");
+#endif
+}
+
+// Async-signal-safe, as the signal handlers call it: only write() to the fds governor_set() left open
+void RetroWavePlayer::governor_restore() {
+	static const char failed[] = "info: governor: can't restore a cpufreq governor\n";
+
+	int count = governor_saved_count;
+	governor_saved_count = 0;
+
+	for (int i=0; i<count; i++) {
+		auto &it = governor_saved[i];
+
+		if (lseek(it.fd, 0, SEEK_SET) < 0 || write(it.fd, it.name, it.name_len) != (ssize_t)it.name_len) {
+			ssize_t rc = write(STDOUT_FILENO, failed, sizeof(failed) - 1);
+			(void)rc;
+		}
+
+		close(it.fd);
+	}
+}
@@ -86,3 +86,107 @@ void RetroWavePlayer::regmap_sn76489_insert(uint8_t chip_idx, uint8_t data) {
 	}
 
 }
+
+void RetroWavePlayer::regmap_replay() {
+	auto opl3_replay = [this](int idx, bool port1, bool key_regs) {
+		auto it = reg_map.find(idx);
+		if (it == reg_map.end())
+			return;
+
+		auto &v = it->second;
+
+		for (size_t reg=0x01; reg<v.size() && reg<=0xf5; reg++) {
+			if (!port1 && reg >= 0x02 && reg <= 0x04) // Timers
+				continue;
+
+			if (port1 && reg == 0x05) // Already written, see below
+				continue;
+
+			// Key-on registers go last, so notes start with the right instrument
+			if (((reg >= 0xb0 && reg <= 0xb8) || reg == 0xbd) != key_regs)
+				continue;
+
+			if (port1)
+				retrowave_opl3_queue_port1(wctx, reg, v[reg]);
+			else
+				retrowave_opl3_queue_port0(wctx, reg, v[reg]);
+		}
+	};
+
+	// The OPL3 mode enable bit goes before everything else, the chip ignores 0x104 and the
+	// port1 half of the channels while it's off
+	for (int idx : {0x5f, 0xaa}) {
+		auto it = reg_map.find(idx);
+		if (it != reg_map.end() && it->second.size() > 0x05)
+			retrowave_opl3_queue_port1(wctx, 0x05, it->second[0x05]);
+	}
+
+	for (bool key_regs : {false, true}) {
+		opl3_replay(0x5f, true, key_regs);
+		opl3_replay(0xaa, true, key_regs);
+		opl3_replay(0x5e, false, key_regs);
+		opl3_replay(0x5a, false, key_regs);
+	}
+
+	auto ym2413_it = reg_map.find(0x51);
+	if (ym2413_it != reg_map.end()) {
+		auto &v = ym2413_it->second;
+
+		for (bool key_regs : {false, true}) {
+			for (size_t reg=0x00; reg<v.size() && reg<=0x38; reg++) {
+				if (((reg >= 0x20 && reg <= 0x28) || reg == 0x0e) != key_regs)
+					continue;
+
+				retrowave_mastergear_queue_ym2413(wctx, reg, v[reg]);
+			}
+		}
+	}
+
+	auto saa1099_it = reg_map.find(0xbd);
+	if (saa1099_it != reg_map.end()) {
+		auto &v = saa1099_it->second;
+
+		for (size_t reg=0x00; reg<v.size() && reg<=0x1f; reg++) {
+			retrowave_miniblaster_queue(wctx, reg, v[reg]);
+		}
+	}
+
+	for (size_t i=0; i<sizeof(regmap_sn76489)/sizeof(SN76489Registers); i++) {
+		auto &cur_regmap = regmap_sn76489[i];
+		if (!cur_regmap.used)
+			continue;
+
+		std::vector<uint8_t> seq;
+
+		for (uint8_t ch=0; ch<3; ch++) {
+			seq.push_back(0x80 | (ch << 5) | (cur_regmap.freq[ch] & 0xf));
+			seq.push_back((cur_regmap.freq[ch] >> 4) & 0x3f);
+		}
+
+		seq.push_back(0xe0 | cur_regmap.noise_ctrl);
+
+		for (uint8_t ch=0; ch<4; ch++) {
+			seq.push_back(0x90 | (ch << 5) | cur_regmap.att[ch]);
+		}
+
+		// Restore the latch, later data bytes depend on it
+		if (cur_regmap.is_volume)
+			seq.push_back(0x90 | (cur_regmap.channel << 5) | cur_regmap.att[cur_regmap.channel]);
+		else if (cur_regmap.channel == 3)
+			seq.push_back(0xe0 | cur_regmap.noise_ctrl);
+		else
+			seq.push_back(0x80 | (cur_regmap.channel << 5) | (cur_regmap.freq[cur_regmap.channel] & 0xf));
+
+		for (auto it : seq) {
+			if (!sn76489_dual)
+				retrowave_mastergear_queue_sn76489(wctx, it);
+			else if (i)
+				retrowave_mastergear_queue_sn76489_right(wctx, it);
+			else
+				retrowave_mastergear_queue_sn76489_left(wctx, it);
+		}
+
+		if (!sn76489_dual)
+			break;
+	}
+}
@@ -45,25 +45,176 @@
 
 #include "Player.hpp"
 
-#ifdef __APPLE__
-#include <mach/mach.h>
-#include <mach/mach_time.h>
-#endif
+static const struct {
+	RetroWaveBoardType type;
+	const char *name;
+	uint32_t speed_max;
+} spi_boards[] = {
+	{RetroWave_Board_OPL3,        "opl3",        8000000}, // YMF262 has no write wait time to speak of
+	{RetroWave_Board_MasterGear,  "mastergear",  1200000}, // YM2413 wants ~24us after a data write, which is 4 bytes after the strobe
+	{RetroWave_Board_MiniBlaster, "miniblaster", 1600000},
+};
+
+// Time to wait after a reset before the chip takes writes again
+static const struct {
+	uint8_t chip;
+	useconds_t usecs;
+} chip_settle_usecs[] = {
+	{RetroWavePlayer::Chip_OPL3,    1000}, // YMF262 is ready as soon as IC# is released, leave some margin
+	{RetroWavePlayer::Chip_YM2413,  1000},
+	{RetroWavePlayer::Chip_SN76489, 0},    // No reset line, it's only muted
+};
+
+void RetroWavePlayer::spi_speeds_load() {
+	FILE *f = fopen(spi_speeds_path.c_str(), "r");
+
+	if (!f)
+		return;
+
+	char name[32];
+	uint32_t speed;
+
+	while (fscanf(f, "%31s %" SCNu32, name, &speed) == 2) {
+		for (auto &it : spi_boards) {
+			if (strcmp(name, it.name) == 0 && speed) {
+				printf("info: %s SPI speed: %" PRIu32 " Hz\n", it.name, speed);
+				retrowave_set_transfer_speed(&rtctx, it.type, speed);
+			}
+		}
+	}
+
+	fclose(f);
+}
+
+void RetroWavePlayer::spi_calibrate() {
+	std::string results;
+
+	for (auto &it : spi_boards) {
+		printf("Calibrating %s... ", it.name);
+		fflush(stdout);
+
+		uint32_t speed = retrowave_calibrate_transfer_speed(&rtctx, it.type, 400000, it.speed_max, 100000);
+
+		if (speed) {
+			printf("%" PRIu32 " Hz\n", speed);
+			results += std::string(it.name) + " " + std::to_string(speed) + "\n";
+		} else {
+			printf("not found\n");
+		}
+	}
+
+	if (results.empty()) {
+		puts("No board responded, nothing saved.");
+		return;
+	}
+
+	FILE *f = fopen(spi_speeds_path.c_str(), "w");
+
+	if (!f) {
+		printf("error: failed to open `%s': %s\n", spi_speeds_path.c_str(), strerror(errno));
+		return;
+	}
+
+	fputs(results.c_str(), f);
+	fclose(f);
+
+	printf("Saved to `%s'.\n", spi_speeds_path.c_str());
+}
 
 void RetroWavePlayer::mute_chips() {
-	retrowave_opl3_mute(&rtctx);
-	retrowave_mastergear_mute_sn76489(&rtctx);
-	retrowave_mastergear_reset_ym2413(&rtctx);
+	if (wire_cache.active()) {
+		flush_chips();
+		wire_resync();
+	}
+
+	retrowave_opl3_mute_active(wctx);
+	retrowave_mastergear_mute_active(wctx);
+
+	if (pipeline_active())
+		flush_chips();
 }
 
-void RetroWavePlayer::reset_chips() {
-	retrowave_opl3_reset(&rtctx);
-	retrowave_mastergear_mute_sn76489(&rtctx);
-	retrowave_mastergear_reset_ym2413(&rtctx);
+void RetroWavePlayer::reset_chips(uint8_t chips) {
+	if (chips & Chip_OPL3)
+		retrowave_opl3_reset(wctx);
+
+	if ((chips & (Chip_YM2413 | Chip_SN76489)) == (Chip_YM2413 | Chip_SN76489))
+		retrowave_mastergear_reset(wctx);
+	else if (chips & Chip_YM2413)
+		retrowave_mastergear_reset_ym2413(wctx);
+	else if (chips & Chip_SN76489)
+		retrowave_mastergear_mute_sn76489(wctx);
+
+	useconds_t settle_usecs = 0;
+
+	for (auto &it : chip_settle_usecs) {
+		if ((chips & it.chip) && it.usecs > settle_usecs)
+			settle_usecs = it.usecs;
+	}
+
+	// The chips only settle once the I/O thread got the writes to them
+	if (pipeline_active())
+		pipeline_push(PipelineItem::Immediate, 0, settle_usecs);
+	else if (settle_usecs)
+		usleep(settle_usecs);
 }
 
 void RetroWavePlayer::flush_chips() {
-	retrowave_flush(&rtctx);
+	if (wire_pending())
+		wire_send_pending();
+
+	if (pipeline_active())
+		pipeline_push(PipelineItem::Immediate, 0);
+	else
+		retrowave_flush(wctx);
+}
+
+void RetroWavePlayer::callback_null_io(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	auto *ctx = (RetroWavePlayer *)userp;
+
+	if (rx_buf)
+		memset(rx_buf, 0, len);
+
+	uint64_t cost = ctx->null_nsec_per_transfer + (uint64_t)(ctx->null_nsec_per_byte * len);
+
+	// On a clock of its own the transfer takes as long as the modelled link would
+	if (ctx->timing_clock)
+		ctx->timing_clock->spend(cost);
+
+	ctx->rtctx.io_stats.transfers++;
+	ctx->rtctx.io_stats.bytes += len;
+	ctx->rtctx.io_stats.busy_nsec += cost;
+	ctx->rtctx.io_stats.wire_bytes += len;
+	ctx->rtctx.io_stats.wire_nsec += cost;
+
+	size_t bucket = 0;
+
+	while (bucket < sizeof(ctx->transfer_size_hist) / sizeof(ctx->transfer_size_hist[0]) - 1 && (4U << bucket) < len)
+		bucket++;
+
+	ctx->transfer_size_hist[bucket]++;
+}
+
+void RetroWavePlayer::callback_recover(void *userp) {
+	auto *ctx = (RetroWavePlayer *)userp;
+
+	// This runs on the I/O thread, the register maps are the parsing thread's to replay
+	if (ctx->pipeline_active()) {
+		ctx->pipe_recovered = true;
+		ctx->link_recoveries++;
+		ctx->timing_set_epoch(ctx->pipe_sent_samples);
+		return;
+	}
+
+	// Frames from the cache never went into the register maps
+	if (ctx->wire_cache.active())
+		ctx->wire_resync();
+
+	ctx->regmap_replay();
+	ctx->link_recoveries++;
+
+	// Continue from where the link dropped instead of rushing through the missed frames
+	ctx->timing_rebase(ctx->played_samples);
 }
 
 int RetroWavePlayer::callback_header_total_samples(void *userp, uint32_t value) {
@@ -77,7 +228,32 @@ int RetroWavePlayer::callback_header_total_samples(void *userp, uint32_t value)
 int RetroWavePlayer::callback_header_sn76489(void *userp, uint32_t value) {
 	auto *ctx = (RetroWavePlayer *)userp;
 
-	ctx->sn76489_dual = value >> 1;
+	// Bit 30 of the clock field flags a second chip
+	ctx->sn76489_dual = value & 0x40000000;
+
+	return TinyVGM_OK;
+}
+
+int RetroWavePlayer::callback_header_clock(void *userp, TinyVGMHeaderField field, uint32_t value) {
+	auto *ctx = (RetroWavePlayer *)userp;
+
+	if (!value)
+		return TinyVGM_OK;
+
+	switch (field) {
+		case TinyVGM_HeaderField_SN76489_Clock:
+			ctx->chips_used |= Chip_SN76489;
+			break;
+		case TinyVGM_HeaderField_YM2413_Clock:
+			ctx->chips_used |= Chip_YM2413;
+			break;
+		case TinyVGM_HeaderField_YM3812_Clock:
+		case TinyVGM_HeaderField_YMF262_Clock:
+			ctx->chips_used |= Chip_OPL3;
+			break;
+		default:
+			break;
+	}
 
 	return TinyVGM_OK;
 }
@@ -85,7 +261,7 @@ int RetroWavePlayer::callback_header_sn76489(void *userp, uint32_t value) {
 int RetroWavePlayer::callback_header_done(void *userp) {
 	auto *ctx = (RetroWavePlayer *)userp;
 
-	clock_gettime(RETROWAVE_PLAYER_TIME_REF, &ctx->sleep_end);
+	ctx->timing_rebase(ctx->played_samples);
 
 	return TinyVGM_OK;
 }
@@ -99,7 +275,7 @@ int RetroWavePlayer::callback_saa1099(void *userp, uint8_t value, const void *bu
 	uint8_t val = ((uint8_t *)buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_miniblaster_queue(&ctx->rtctx, reg, val);
+	retrowave_miniblaster_queue(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 	return TinyVGM_OK;
@@ -114,7 +290,7 @@ int RetroWavePlayer::callback_opl2(void *userp, uint8_t value, const void *buf,
 	uint8_t val = ((uint8_t *)buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_opl3_queue_port0(&ctx->rtctx, reg, val);
+	retrowave_opl3_queue_port0(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 
@@ -130,7 +306,7 @@ int RetroWavePlayer::callback_opl2_dual(void *userp, uint8_t value, const void *
 	uint8_t val = ((uint8_t *) buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_opl3_queue_port1(&ctx->rtctx, reg, val);
+	retrowave_opl3_queue_port1(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 
@@ -146,7 +322,7 @@ int RetroWavePlayer::callback_opl3_port0(void *userp, uint8_t value, const void
 	uint8_t val = ((uint8_t *) buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_opl3_queue_port0(&ctx->rtctx, reg, val);
+	retrowave_opl3_queue_port0(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 
@@ -162,18 +338,49 @@ int RetroWavePlayer::callback_opl3_port1(void *userp, uint8_t value, const void
 	uint8_t val = ((uint8_t *) buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_opl3_queue_port1(&ctx->rtctx, reg, val);
+	retrowave_opl3_queue_port1(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 	return TinyVGM_OK;
 }
 
-void RetroWavePlayer::sn76489_zero_freq_workaround(uint8_t idx) {
+void RetroWavePlayer::sn76489_queue(uint8_t idx, uint8_t val) {
 	auto &cur_regmap = regmap_sn76489[idx];
+	void (*queue)(RetroWaveContext *, uint8_t);
+
+	// Mono files drive both chips with one strobe, dual files get one chip per channel
+	if (!sn76489_dual)
+		queue = retrowave_mastergear_queue_sn76489;
+	else if (idx)
+		queue = retrowave_mastergear_queue_sn76489_right;
+	else
+		queue = retrowave_mastergear_queue_sn76489_left;
+
+	regmap_sn76489_insert(idx, val);
+
+	bool tone = !cur_regmap.is_volume && cur_regmap.channel < 3;
+	bool bumped = cur_regmap.latch_bumped;
+
+	cur_regmap.latch_bumped = false;
+
+	// A zero period must not reach the chip, bump it to 1 in the same write where possible
+	if (tone && cur_regmap.freq[cur_regmap.channel] == 0) {
+		if (cur_regmap.is_latch) {
+			// Usually just on the way to a new period, the data byte that follows decides
+			cur_regmap.latch_bumped = true;
+			queue(wctx, val | 0x1);
+			return;
+		}
 
-	if (!cur_regmap.is_volume && cur_regmap.channel < 3 && cur_regmap.freq[cur_regmap.channel] == 0) {
-		retrowave_mastergear_queue_sn76489(&rtctx, 0x81 | (regmap_sn76489[idx].channel << 5));
+		if (!bumped)
+			queue(wctx, 0x81 | (cur_regmap.channel << 5));
 	}
+
+	queue(wctx, val);
+
+	// The period didn't end up 0 after all, so the chip gets the real low bits
+	if (tone && bumped && !cur_regmap.is_latch && cur_regmap.freq[cur_regmap.channel])
+		queue(wctx, 0x80 | (cur_regmap.channel << 5) | (cur_regmap.freq[cur_regmap.channel] & 0xf));
 }
 
 int RetroWavePlayer::callback_sn76489_port0(void *userp, uint8_t value, const void *buf, uint32_t len) {
@@ -181,17 +388,7 @@ int RetroWavePlayer::callback_sn76489_port0(void *userp, uint8_t value, const vo
 
 	assert(len == 1);
 
-	uint8_t val = ((uint8_t *) buf)[0];
-
-	ctx->regmap_sn76489_insert(0, val);
-	ctx->sn76489_zero_freq_workaround(0);
-	retrowave_mastergear_queue_sn76489(&ctx->rtctx, val);
-
-	if (!ctx->sn76489_dual) {
-		ctx->regmap_sn76489_insert(1, val);
-		ctx->sn76489_zero_freq_workaround(1);
-		retrowave_mastergear_queue_sn76489(&ctx->rtctx, val);
-	}
+	ctx->sn76489_queue(0, ((uint8_t *) buf)[0]);
 
 	ctx->single_frame_hook();
 
@@ -203,11 +400,7 @@ int RetroWavePlayer::callback_sn76489_port1(void *userp, uint8_t value, const vo
 
 	assert(len == 1);
 
-	uint8_t val = ((uint8_t *) buf)[0];
-
-	ctx->regmap_sn76489_insert(1, val);
-	ctx->sn76489_zero_freq_workaround(1);
-	retrowave_mastergear_queue_sn76489(&ctx->rtctx, val);
+	ctx->sn76489_queue(1, ((uint8_t *) buf)[0]);
 
 	ctx->single_frame_hook();
 
@@ -223,7 +416,7 @@ int RetroWavePlayer::callback_ym2413(void *userp, uint8_t value, const void *buf
 	uint8_t val = ((uint8_t *) buf)[1];
 
 	ctx->regmap_insert(value, reg, val);
-	retrowave_mastergear_queue_ym2413(&ctx->rtctx, reg, val);
+	retrowave_mastergear_queue_ym2413(ctx->wctx, reg, val);
 	ctx->single_frame_hook();
 
 	return TinyVGM_OK;
@@ -256,9 +449,6 @@ int RetroWavePlayer::callback_sleep_7n(void *userp, uint8_t value, const void *b
 }
 
 int RetroWavePlayer::flush_and_sleep(uint32_t sleep_samples) {
-	flush_chips();
-
-	played_samples += sleep_samples;
 	last_slept_samples = sleep_samples;
 
 	uint64_t t = round(1000000000.0 * sleep_samples / sample_rate);
@@ -288,15 +478,21 @@ check_command:
 			paused = !paused;
 			was_paused = 1;
 			if (paused) {
-//				mute_chips();
+				mute_chips();
 				puts("== Paused ==");
 			} else {
+				regmap_replay();
+				flush_chips();
 				puts("== Resumed ==");
 				term_clear();
 			}
 			break;
 		case NEXT:
 		case PREV:
+			// What's still queued belongs to the track being left
+			if (pipeline_active())
+				pipeline_discard();
+
 			return TinyVGM_ECANCELED;
 		case SINGLE_FRAME:
 			single_step = true;
@@ -309,40 +505,151 @@ check_command:
 	}
 
 	if (paused) {
-		usleep(1000);
+		if (pipeline_active())
+			usleep(1000);
+		else
+			timing_sleep_nsec(1000 * 1000);
+
 		goto check_command;
 	} else {
 		if (was_paused)
-			clock_gettime(RETROWAVE_PLAYER_TIME_REF, &sleep_end);
+			timing_rebase(played_samples);
 	}
 
 	if (ff) {
 		key_command = NONE;
-		clock_gettime(RETROWAVE_PLAYER_TIME_REF, &sleep_end);
+		flush_chips();
+		played_samples += sleep_samples;
+		timing_rebase(played_samples);
 		return TinyVGM_OK;
 	}
 
-	timespec_add(sleep_end, nsec_to_timespec(t));
+	uint64_t due_samples = played_samples;
+
+	// Short waits only add up time, their writes go out with the batch once it spans the quantum
+	if (flush_quantum_samples) {
+		if (!quantum_pending_samples)
+			quantum_batch_samples = played_samples;
+
+		// How much earlier than due these writes go out
+		double early = (double)(played_samples - quantum_batch_samples) * 1000000000 / sample_rate;
+
+		sched_stats.batched_frames++;
+		sched_stats.early_sum_nsec += early;
+
+		if (early > sched_stats.early_max_nsec)
+			sched_stats.early_max_nsec = early;
 
-#ifdef __APPLE__
-	struct timespec time_now;
-	clock_gettime(RETROWAVE_PLAYER_TIME_REF, &time_now);
+		quantum_pending_samples += sleep_samples;
 
-	if (timespec_cmp(time_now, sleep_end) < 0) {
-		uint64_t sleep_diff = (sleep_end.tv_sec - time_now.tv_sec) * 1000000000 + (sleep_end.tv_nsec - time_now.tv_nsec);
-		mach_timebase_info_data_t timebase_info;
+		if (quantum_pending_samples < flush_quantum_samples) {
+			played_samples += sleep_samples;
+			return TinyVGM_OK;
+		}
+
+		due_samples = quantum_batch_samples;
+		quantum_pending_samples = 0;
+	}
+
+	// The I/O thread keeps the time, this one only hands it the frame
+	if (pipeline_active()) {
+		pipeline_push(PipelineItem::Frame, due_samples);
+		played_samples += sleep_samples;
+		return TinyVGM_OK;
+	}
 
-		mach_timebase_info(&timebase_info);
-		mach_wait_until(mach_absolute_time() + sleep_diff * timebase_info.denom / timebase_info.numer);
+	if (frame_overrun(due_samples, played_samples + sleep_samples)) {
+		played_samples += sleep_samples;
+		return TinyVGM_OK;
 	}
-#else
-	clock_nanosleep(RETROWAVE_PLAYER_TIME_REF, TIMER_ABSTIME, &sleep_end, nullptr);
-#endif
 
+	frame_cpu_begin();
+
+	uint32_t cmd_bytes = wctx->cmd_buffer_used + (wire_pending() ? wire_pending_cmd_bytes() : 0);
+
+	// Encode for the wire now, so waking up only leaves the write itself
+	if (encode_ahead)
+		retrowave_flush_prepare(wctx);
+
+	frame_flush_at(due_samples, cmd_bytes);
+
+	played_samples += sleep_samples;
+
+	frame_cpu_end();
 
 	return TinyVGM_OK;
 }
 
+bool RetroWavePlayer::frame_overrun(uint64_t due_samples, uint64_t next_samples) {
+	sleep_end = timing_deadline(due_samples);
+
+	timespec time_now;
+	timing_now(time_now);
+
+	if (timespec_cmp(time_now, sleep_end) <= 0)
+		return false;
+
+	double late = timespec_diff_nsec(time_now, sleep_end);
+
+	sched_stats.deadline_misses++;
+
+	if (late > sched_stats.late_max_nsec)
+		sched_stats.late_max_nsec = late;
+
+	switch (overrun_policy) {
+		case Overrun_Merge:
+			// Keep queueing while the next deadline is gone too, the overdue frames then go out in one flush
+			if (next_samples && timespec_cmp(time_now, timing_deadline(next_samples)) > 0) {
+				sched_stats.merged_frames++;
+				return true;
+			}
+			break;
+		case Overrun_Rebase:
+			// Give up on the lost time, later frames keep their spacing from now on
+			sched_stats.rebases++;
+			timing_set_epoch(due_samples);
+			break;
+		default:
+			break;
+	}
+
+	return false;
+}
+
+void RetroWavePlayer::frame_flush_at(uint64_t due_samples, uint32_t cmd_bytes, const WireCapture *wire) {
+	// The queued writes are due at this deadline, start sending them as early as they take to reach the chip
+	sleep_end = timing_deadline(due_samples);
+	ttw_last_nsec = ttw_estimate(cmd_bytes);
+
+	timespec fire = sleep_end, woke, time_now;
+	timespec_sub(fire, nsec_to_timespec(ttw_last_nsec));
+	timing_sleep_until(fire);
+	timing_now(woke);
+
+	if (wire)
+		pipeline_write(*wire);
+	else
+		flush_chips();
+
+	ttw_update();
+	sched_stats.flushes++;
+
+	// Where the last byte landed compared to the deadline, negative is early
+	timing_now(time_now);
+	double land_err = timespec_diff_nsec(time_now, sleep_end);
+	double wake_to_wire = timespec_diff_nsec(time_now, woke);
+
+	sched_stats.wake_to_wire_sum_nsec += wake_to_wire;
+
+	if (wake_to_wire > sched_stats.wake_to_wire_max_nsec)
+		sched_stats.wake_to_wire_max_nsec = wake_to_wire;
+
+	sched_stats.land_err_sum_nsec += land_err;
+
+	if (fabs(land_err) > sched_stats.land_err_max_nsec)
+		sched_stats.land_err_max_nsec = fabs(land_err);
+}
+
 timespec RetroWavePlayer::nsec_to_timespec(uint64_t nsec) {
 	timespec ret;
 	ret.tv_sec = nsec / 1000000000;
@@ -354,9 +661,23 @@ void RetroWavePlayer::timespec_add(timespec &addee, const timespec &adder) {
 	addee.tv_sec += adder.tv_sec;
 	addee.tv_nsec += adder.tv_nsec;
 
-	if (addee.tv_nsec > 999999999) {
+	if (addee.tv_nsec >= 1000000000) {
 		addee.tv_sec += 1;
-		addee.tv_nsec -= 999999999;
+		addee.tv_nsec -= 1000000000;
+	}
+}
+
+int64_t RetroWavePlayer::timespec_diff_nsec(const timespec &a, const timespec &b) {
+	return (int64_t)(a.tv_sec - b.tv_sec) * 1000000000 + (a.tv_nsec - b.tv_nsec);
+}
+
+void RetroWavePlayer::timespec_sub(timespec &subtrahend, const timespec &subtractor) {
+	subtrahend.tv_sec -= subtractor.tv_sec;
+	subtrahend.tv_nsec -= subtractor.tv_nsec;
+
+	if (subtrahend.tv_nsec < 0) {
+		subtrahend.tv_sec -= 1;
+		subtrahend.tv_nsec += 1000000000;
 	}
 }
 
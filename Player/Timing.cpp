@@ -0,0 +1,432 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+// Starting points for the time-to-wire estimate, before anything has been measured. Kept for good on
+// links that can't tell when bytes are out
+static const struct {
+	const char *device;
+	uint32_t nsec_per_byte;
+	bool serial_packed;
+} ttw_seeds[] = {
+	{"tty",  5000, true},  // 2 Mbaud, 10 bits per byte
+	{"spi",  4000, false}, // 2 MHz, 8 bits per byte
+	{"null", 0,    false},
+};
+
+static const struct {
+	RetroWavePlayer::TimingStrategy strategy;
+	const char *name;
+} timing_strategies[] = {
+	{RetroWavePlayer::Timing_Sleep,   "sleep"},
+	{RetroWavePlayer::Timing_Spin,    "spin"},
+#ifdef __linux__
+	{RetroWavePlayer::Timing_TimerFD, "timerfd"},
+#endif
+	{RetroWavePlayer::Timing_Virtual, "virtual"},
+};
+
+static const struct {
+	RetroWavePlayer::OverrunPolicy policy;
+	const char *name;
+} overrun_policies[] = {
+	{RetroWavePlayer::Overrun_Burst,  "burst"},
+	{RetroWavePlayer::Overrun_Merge,  "merge"},
+	{RetroWavePlayer::Overrun_Rebase, "rebase"},
+};
+
+const char *RetroWavePlayer::overrun_policy_name(OverrunPolicy policy) {
+	for (auto &it : overrun_policies) {
+		if (it.policy == policy)
+			return it.name;
+	}
+
+	return "unknown";
+}
+
+bool RetroWavePlayer::overrun_set_policy(const std::string &name) {
+	for (auto &it : overrun_policies) {
+		if (name == it.name) {
+			overrun_policy = it.policy;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *RetroWavePlayer::timing_strategy_name(TimingStrategy strategy) {
+	for (auto &it : timing_strategies) {
+		if (it.strategy == strategy)
+			return it.name;
+	}
+
+	return "unknown";
+}
+
+bool RetroWavePlayer::timing_set_strategy(const std::string &name) {
+	for (auto &it : timing_strategies) {
+		if (name == it.name) {
+			timing_strategy = it.strategy;
+			timing_use_clock(it.strategy == Timing_Virtual ? &timing_virtual : nullptr);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void RetroWavePlayer::timing_use_clock(TimingClock *clock) {
+	timing_clock = clock;
+}
+
+void VirtualClock::now(timespec &ts) {
+	ts = time;
+}
+
+void VirtualClock::sleep_until(const timespec &deadline) {
+	if (RetroWavePlayer::timespec_cmp(time, deadline) < 0)
+		time = deadline;
+}
+
+void VirtualClock::spend(uint64_t nsec) {
+	RetroWavePlayer::timespec_add(time, RetroWavePlayer::nsec_to_timespec(nsec));
+}
+
+void RetroWavePlayer::timing_now(timespec &ts) {
+	if (timing_clock)
+		timing_clock->now(ts);
+	else
+		clock_gettime(RETROWAVE_PLAYER_TIME_REF, &ts);
+}
+
+timespec RetroWavePlayer::samples_to_timespec(uint64_t samples) {
+	timespec ret;
+	ret.tv_sec = samples / sample_rate;
+	ret.tv_nsec = (samples % sample_rate) * 1000000000 / sample_rate;
+	return ret;
+}
+
+void RetroWavePlayer::timing_rebase(uint64_t samples) {
+	quantum_pending_samples = 0;
+
+	// The I/O thread keeps the clock while the pipeline runs
+	if (pipeline_active())
+		pipeline_push(PipelineItem::Rebase, samples);
+	else
+		timing_set_epoch(samples);
+}
+
+void RetroWavePlayer::timing_set_epoch(uint64_t samples) {
+	timing_now(timing_epoch);
+	timing_epoch_samples = samples;
+	sleep_end = timing_epoch;
+}
+
+timespec RetroWavePlayer::timing_deadline(uint64_t samples) {
+	// Always from the epoch, so rounding never piles up over a track
+	timespec ret = timing_epoch;
+	timespec_add(ret, samples_to_timespec(samples - timing_epoch_samples));
+	return ret;
+}
+
+void RetroWavePlayer::timing_sleep_basic(const timespec &deadline) {
+#ifdef __APPLE__
+	struct timespec time_now;
+	clock_gettime(RETROWAVE_PLAYER_TIME_REF, &time_now);
+
+	if (timespec_cmp(time_now, deadline) < 0) {
+		uint64_t sleep_diff = timespec_diff_nsec(deadline, time_now);
+		mach_timebase_info_data_t timebase_info;
+
+		mach_timebase_info(&timebase_info);
+		mach_wait_until(mach_absolute_time() + sleep_diff * timebase_info.denom / timebase_info.numer);
+	}
+#else
+	clock_nanosleep(RETROWAVE_PLAYER_TIME_REF, TIMER_ABSTIME, &deadline, nullptr);
+#endif
+}
+
+void RetroWavePlayer::timing_sleep_strategy(TimingStrategy strategy, const timespec &deadline) {
+	switch (strategy) {
+		case Timing_Spin: {
+			timespec coarse = deadline, time_now;
+
+			timespec_sub(coarse, nsec_to_timespec(timing_spin_margin_nsec));
+
+			timing_sleep_basic(coarse);
+
+			do {
+				clock_gettime(RETROWAVE_PLAYER_TIME_REF, &time_now);
+			} while (timespec_cmp(time_now, deadline) < 0);
+			break;
+		}
+#ifdef __linux__
+		case Timing_TimerFD: {
+			if (timing_fd < 0) {
+				timing_fd = timerfd_create(RETROWAVE_PLAYER_TIME_REF, TFD_CLOEXEC);
+
+				if (timing_fd < 0) {
+					printf("error: timerfd_create: %s, falling back to sleep\n", strerror(errno));
+					timing_strategy = Timing_Sleep;
+					timing_sleep_basic(deadline);
+					break;
+				}
+			}
+
+			itimerspec its{};
+			its.it_value = deadline;
+
+			// A deadline in the past fires right away
+			if (timerfd_settime(timing_fd, TFD_TIMER_ABSTIME, &its, nullptr) == 0) {
+				uint64_t expirations;
+				while (read(timing_fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+			}
+			break;
+		}
+#endif
+		default:
+			timing_sleep_basic(deadline);
+			break;
+	}
+}
+
+void RetroWavePlayer::timing_sleep_nsec(uint64_t nsec) {
+	if (timing_clock) {
+		timespec deadline;
+		timing_clock->now(deadline);
+		timespec_add(deadline, nsec_to_timespec(nsec));
+		timing_clock->sleep_until(deadline);
+	} else {
+		usleep(nsec / 1000);
+	}
+}
+
+void RetroWavePlayer::timing_sleep_until(const timespec &deadline) {
+	timespec time_now;
+	timing_now(time_now);
+
+	// Already late, nothing to measure
+	if (timespec_cmp(time_now, deadline) >= 0)
+		return;
+
+	if (timing_clock)
+		timing_clock->sleep_until(deadline);
+	else
+		timing_sleep_strategy(timing_strategy, deadline);
+
+	timing_now(time_now);
+
+	double late = timespec_diff_nsec(time_now, deadline);
+
+	timing_stats.wakeups++;
+	timing_stats.late_sum += late;
+	timing_stats.late_sqsum += late * late;
+
+	if (late > timing_stats.late_max)
+		timing_stats.late_max = late;
+}
+
+std::vector<int64_t> RetroWavePlayer::timing_measure(TimingStrategy strategy, size_t rounds, uint64_t interval_nsec) {
+	std::vector<int64_t> ret;
+	timespec deadline, time_now;
+
+	ret.reserve(rounds);
+	clock_gettime(RETROWAVE_PLAYER_TIME_REF, &deadline);
+
+	for (size_t i=0; i<rounds; i++) {
+		timespec_add(deadline, nsec_to_timespec(interval_nsec));
+		timing_sleep_strategy(strategy, deadline);
+		clock_gettime(RETROWAVE_PLAYER_TIME_REF, &time_now);
+		ret.push_back(timespec_diff_nsec(time_now, deadline));
+
+		// Don't let one long stall turn the rest into back-to-back wakeups
+		if (ret.back() > (int64_t)interval_nsec)
+			deadline = time_now;
+	}
+
+	std::sort(ret.begin(), ret.end());
+
+	return ret;
+}
+
+void RetroWavePlayer::timing_calibrate() {
+	if (timing_clock)
+		return;
+
+	const size_t rounds = 200;
+	const uint64_t interval_nsec = 500 * 1000;
+
+	// The spin margin has to cover nearly every wakeup of the plain sleep it spins after
+	auto sleep_late = timing_measure(Timing_Sleep, rounds, interval_nsec);
+	timing_spin_margin_nsec = std::clamp<int64_t>(sleep_late[rounds * 99 / 100] + 10 * 1000, 20 * 1000, 2000 * 1000);
+
+	for (auto &it : timing_strategies) {
+		if (it.strategy == Timing_Virtual)
+			continue;
+
+		auto late = it.strategy == Timing_Sleep ? sleep_late : timing_measure(it.strategy, rounds, interval_nsec);
+
+		printf("info: timing: %-7s wakeup lateness p50 %.1lf us, p99 %.1lf us, max %.1lf us\n", it.name,
+		       (double)late[rounds / 2] / 1000, (double)late[rounds * 99 / 100] / 1000, (double)late.back() / 1000);
+	}
+
+	printf("info: timing: using %s, spin margin %.1lf us\n", timing_strategy_name(timing_strategy), (double)timing_spin_margin_nsec / 1000);
+}
+
+void RetroWavePlayer::timing_stats_get(const TimingStats &st, double &avg_usecs, double &jitter_usecs, double &max_usecs) {
+	avg_usecs = jitter_usecs = max_usecs = 0;
+
+	if (!st.wakeups)
+		return;
+
+	double avg = st.late_sum / st.wakeups;
+	double var = st.late_sqsum / st.wakeups - avg * avg;
+
+	avg_usecs = avg / 1000;
+	jitter_usecs = var > 0 ? sqrt(var) / 1000 : 0;
+	max_usecs = st.late_max / 1000;
+}
+
+void RetroWavePlayer::io_snapshot_take(IOSnapshot &out) {
+	auto &st = sched_stats;
+
+	out.io_stats = rtctx.io_stats;
+	out.timing_stats = timing_stats;
+	out.link_recoveries = link_recoveries;
+	out.deadline_misses = st.deadline_misses;
+	out.merged_frames = st.merged_frames;
+	out.rebases = st.rebases;
+	out.flushes = st.flushes;
+	out.late_max_nsec = st.late_max_nsec;
+	out.wake_to_wire_sum_nsec = st.wake_to_wire_sum_nsec;
+	out.wake_to_wire_max_nsec = st.wake_to_wire_max_nsec;
+}
+
+bool RetroWavePlayer::ttw_setup(const std::string &device_type, const std::string &mode) {
+	ttw_nsec_per_byte = 0;
+
+	for (auto &it : ttw_seeds) {
+		if (device_type == it.device) {
+			ttw_nsec_per_byte = it.nsec_per_byte;
+			ttw_serial_packed = it.serial_packed;
+		}
+	}
+
+	if (mode == "auto") {
+		ttw_auto = true;
+		return true;
+	}
+
+	char *end;
+	unsigned long nsec_per_byte = strtoul(mode.c_str(), &end, 10);
+
+	if (mode.empty() || *end)
+		return false;
+
+	ttw_auto = false;
+	ttw_nsec_per_byte = nsec_per_byte;
+
+	return true;
+}
+
+uint64_t RetroWavePlayer::ttw_estimate(uint32_t cmd_bytes) {
+	// Frames are counted in MCP23S17 bytes, the link rate in what they turn into on the wire
+	uint32_t bytes = ttw_serial_packed && cmd_bytes ? retrowave_protocol_serial_packed_length(cmd_bytes) : cmd_bytes;
+
+	return (uint64_t)(ttw_nsec_per_byte * bytes);
+}
+
+void RetroWavePlayer::ttw_update() {
+	if (!ttw_auto)
+		return;
+
+	// Only bytes timed until they were out count, the time spent handing them over says little
+	auto &io_stats = rtctx.io_stats;
+	uint64_t bytes = io_stats.wire_bytes - ttw_stats_last.wire_bytes;
+
+	// Wait for enough traffic that the per-transfer overhead averages out
+	if (bytes < 4096)
+		return;
+
+	double nsec_per_byte = (double)(io_stats.wire_nsec - ttw_stats_last.wire_nsec) / bytes;
+
+	ttw_nsec_per_byte = ttw_nsec_per_byte.load() * 0.75 + nsec_per_byte * 0.25;
+	ttw_stats_last = io_stats;
+}
+
+void RetroWavePlayer::sched_report() {
+	auto &st = sched_stats;
+
+	printf("info: %zu flushes, %zu deadline misses (%.3lf ms max late), %zu merged, %zu rebased\n",
+	       st.flushes, st.deadline_misses, st.late_max_nsec / 1000000, st.merged_frames, st.rebases);
+	printf("info: landing error %.1lf us avg, %.1lf us max\n",
+	       st.flushes ? st.land_err_sum_nsec / st.flushes / 1000 : 0, st.land_err_max_nsec / 1000);
+	printf("info: wake to wire %.1lf us avg, %.1lf us max\n",
+	       st.flushes ? st.wake_to_wire_sum_nsec / st.flushes / 1000 : 0, st.wake_to_wire_max_nsec / 1000);
+	if (st.frame_cpu_count)
+		printf("info: CPU time between flushes %.2lf us avg, %.2lf us max\n", st.frame_cpu_sum_nsec / st.frame_cpu_count / 1000, st.frame_cpu_max_nsec / 1000);
+	if (pipeline_active())
+		pipeline_report(false);
+
+	printf("info: transfer sizes:");
+
+	for (size_t i=0; i<sizeof(transfer_size_hist)/sizeof(transfer_size_hist[0]); i++) {
+		if (transfer_size_hist[i])
+			printf(" <=%u: %zu", 4U << i, transfer_size_hist[i]);
+	}
+
+	puts("");
+}
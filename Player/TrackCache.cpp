@@ -0,0 +1,208 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+static double elapsed_nsec(const timespec &start) {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start.tv_sec) * 1000000000 + (now.tv_nsec - start.tv_nsec);
+}
+
+TrackCache::~TrackCache() {
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		stop = true;
+		queue.clear();
+	}
+
+	cond.notify_all();
+
+	if (thread.joinable())
+		thread.join();
+}
+
+void TrackCache::insert(const std::string &path, const TrackData &data) {
+	auto it = index.find(path);
+
+	if (it != index.end()) {
+		lru.splice(lru.begin(), lru, it->second);
+		return;
+	}
+
+	lru.push_front({path, data});
+	index[path] = lru.begin();
+	st.bytes += data.size();
+	st.entries++;
+
+	// The track just put in stays even if it's over the budget alone, whoever plays it holds a copy anyway
+	while (st.bytes > budget && lru.size() > 1) {
+		auto &victim = lru.back();
+
+		st.bytes -= victim.data.size();
+		st.entries--;
+		index.erase(victim.path);
+		lru.pop_back();
+	}
+}
+
+bool TrackCache::load(const std::string &path, bool quiet) {
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	TrackData data;
+
+	if (!data.load(path, quiet))
+		return false;
+
+	// Page in a mapped track too, so playing it never waits on the disk
+	data.willneed();
+
+	// mlockall(MCL_FUTURE) would pin the whole budget, only the track playing gets locked
+	data.lock(false);
+
+	double nsec = elapsed_nsec(start);
+	std::lock_guard<std::mutex> lk(mutex);
+
+	st.loads++;
+	st.load_sum_nsec += nsec;
+
+	if (nsec > st.load_max_nsec)
+		st.load_max_nsec = nsec;
+
+	insert(path, data);
+
+	return true;
+}
+
+bool TrackCache::get(const std::string &path, TrackData &out) {
+	std::unique_lock<std::mutex> lk(mutex);
+
+	// Half done in the background still beats starting over
+	cond.wait(lk, [&](){
+		return loading != path;
+	});
+
+	auto it = index.find(path);
+
+	if (it != index.end()) {
+		st.hits++;
+		lru.splice(lru.begin(), lru, it->second);
+		out = it->second->data;
+		return true;
+	}
+
+	st.misses++;
+	lk.unlock();
+
+	if (!load(path, false))
+		return false;
+
+	lk.lock();
+	it = index.find(path);
+
+	if (it == index.end())
+		return false;
+
+	out = it->second->data;
+	return true;
+}
+
+void TrackCache::prefetch(const std::vector<std::string> &paths) {
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		queue.assign(paths.rbegin(), paths.rend());
+
+		if (!thread.joinable())
+			thread = std::thread([this](){
+				loader();
+			});
+	}
+
+	cond.notify_all();
+}
+
+void TrackCache::loader() {
+	RetroWavePlayer::realtime_demote_thread();
+
+	std::unique_lock<std::mutex> lk(mutex);
+
+	while (1) {
+		cond.wait(lk, [this](){
+			return stop || !queue.empty();
+		});
+
+		if (stop)
+			break;
+
+		std::string path = std::move(queue.back());
+		queue.pop_back();
+
+		if (index.count(path))
+			continue;
+
+		loading = path;
+		lk.unlock();
+
+		// Errors show up when the track is played, not in the middle of another one
+		bool ok = load(path, true);
+
+		lk.lock();
+		loading.clear();
+
+		if (ok)
+			st.prefetched++;
+
+		cond.notify_all();
+	}
+}
+
+TrackCache::Stats TrackCache::stats() {
+	std::lock_guard<std::mutex> lk(mutex);
+
+	Stats ret = st;
+	ret.budget = budget;
+	return ret;
+}
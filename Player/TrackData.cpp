@@ -0,0 +1,234 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TrackData::Storage::~Storage() {
+	if (map)
+		munmap(map, map_len);
+
+	free(inflated);
+}
+
+void TrackData::clear() {
+	storage.reset();
+	buf = nullptr;
+	len = 0;
+}
+
+void TrackData::willneed() const {
+	// Inflated tracks are in memory already, mapped ones are read in now rather than when played
+	if (storage && storage->map)
+		madvise(storage->map, storage->map_len, MADV_WILLNEED);
+}
+
+bool TrackData::lock(bool on) const {
+	if (!len)
+		return true;
+
+	return (on ? mlock(buf, len) : munlock(buf, len)) == 0;
+}
+
+bool TrackData::inflate_gz(const uint8_t *src, size_t src_len, const std::string &path, bool quiet) {
+	// Anything else would have its last 4 bytes taken for a size
+	if (src_len < 18 || src[0] != 0x1f || src[1] != 0x8b) {
+		if (!quiet)
+			printf("error: file `%s' is neither VGM nor gzip!\n", path.c_str());
+		return false;
+	}
+
+	// ISIZE is the inflated size mod 2^32 of the last member only, so it's just a starting point,
+	// and never more than deflate can expand the file to
+	size_t out_size = src[src_len - 4] | (src[src_len - 3] << 8) | (src[src_len - 2] << 16) | ((uint32_t)src[src_len - 1] << 24);
+
+	if (out_size < src_len)
+		out_size = src_len * 4;
+
+	out_size = std::min(out_size, src_len * 1032);
+
+	uint8_t *out = (uint8_t *)malloc(out_size);
+	size_t out_len = 0;
+
+	if (!out) {
+		if (!quiet)
+			printf("error: out of memory inflating file `%s'!\n", path.c_str());
+		return false;
+	}
+
+	z_stream strm = {};
+	int rc = inflateInit2(&strm, 15|32);
+
+	strm.next_in = (Bytef *)src;
+	strm.avail_in = src_len;
+
+	while (rc == Z_OK) {
+		strm.next_out = out + out_len;
+		strm.avail_out = out_size - out_len;
+
+		rc = inflate(&strm, Z_FINISH);
+
+		out_len = out_size - strm.avail_out;
+
+		if (rc == Z_STREAM_END) {
+			// Concatenated members are one file to us, anything else after them is padding
+			if (strm.avail_in < 2 || strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b)
+				break;
+
+			rc = inflateReset(&strm);
+			continue;
+		}
+
+		if (rc == Z_BUF_ERROR && !strm.avail_out) {
+			uint8_t *grown = (uint8_t *)realloc(out, out_size * 2);
+
+			if (!grown) {
+				rc = Z_MEM_ERROR;
+				break;
+			}
+
+			out = grown;
+			out_size *= 2;
+			rc = Z_OK;
+		}
+	}
+
+	inflateEnd(&strm);
+
+	if (rc != Z_STREAM_END) {
+		free(out);
+
+		if (!quiet)
+			printf("zlib error %d in file `%s'!\n", rc, path.c_str());
+
+		return false;
+	}
+
+	storage->inflated = out;
+	buf = out;
+	len = out_len;
+
+	return true;
+}
+
+bool TrackData::load(const std::string &path, bool quiet) {
+	clear();
+
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		if (!quiet)
+			printf("error: failed to open file `%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		if (!quiet)
+			printf("error: failed to stat file `%s': %s\n", path.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (st.st_size <= 32) {
+		if (!quiet)
+			printf("error: file too small!\n");
+		close(fd);
+		return false;
+	}
+
+	storage = std::make_shared<Storage>();
+	storage->map_len = st.st_size;
+	storage->map = mmap(nullptr, storage->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (storage->map == MAP_FAILED) {
+		storage->map = nullptr;
+		clear();
+
+		if (!quiet)
+			printf("error: failed to map file `%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	static const uint8_t vgm_header[] = "Vgm ";
+	auto file = (const uint8_t *)storage->map;
+
+	// Commands are read front to back, once
+	madvise(storage->map, storage->map_len, MADV_SEQUENTIAL);
+
+	if (memcmp(file, vgm_header, 4) == 0) {
+		buf = file;
+		len = storage->map_len;
+		return true;
+	}
+
+	if (!quiet)
+		printf("info: VGM header not found, try gunzip\n");
+
+	bool ok = inflate_gz(file, storage->map_len, path, quiet);
+
+	// Only the inflated copy is needed from here on
+	munmap(storage->map, storage->map_len);
+	storage->map = nullptr;
+	storage->map_len = 0;
+
+	if (!ok) {
+		clear();
+		return false;
+	}
+
+	if (len <= 32 || memcmp(buf, vgm_header, 4) != 0) {
+		if (!quiet)
+			printf("info: 2nd try failed\n");
+		clear();
+		return false;
+	}
+
+	return true;
+}
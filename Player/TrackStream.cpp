@@ -0,0 +1,258 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#include <poll.h>
+
+static const size_t chunk_size = 64 * 1024;
+
+TrackStream::~TrackStream() {
+	close();
+}
+
+bool TrackStream::open(const std::string &path, size_t buffer_size, size_t retain_size) {
+	close();
+
+	if (path == "-") {
+		fd = dup(STDIN_FILENO);
+	} else {
+		// A FIFO would block here until its writer shows up, which is what we want
+		fd = ::open(path.c_str(), O_RDONLY);
+	}
+
+	if (fd < 0) {
+		printf("error: failed to open file `%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	ring.resize(std::max(buffer_size, retain_size + chunk_size));
+	retain = retain_size;
+	head = consumed = 0;
+	seen_head = seen_keep_from = 0;
+	eof = stop = false;
+
+	thread = std::thread(&TrackStream::reader, this);
+
+	return true;
+}
+
+void TrackStream::close() {
+	if (thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+
+		cond.notify_all();
+		thread.join();
+	}
+
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+
+	ring.clear();
+	ring.shrink_to_fit();
+}
+
+bool TrackStream::push(const uint8_t *data, size_t len) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (len) {
+		cond.wait(lock, [&]{ return stop || head - keep_from() < ring.size(); });
+
+		if (stop)
+			return false;
+
+		size_t space = ring.size() - (head - keep_from());
+		size_t pos = head % ring.size();
+		size_t n = std::min({len, space, ring.size() - pos});
+
+		memcpy(ring.data() + pos, data, n);
+		head += n;
+		data += n;
+		len -= n;
+
+		cond.notify_all();
+	}
+
+	return true;
+}
+
+void TrackStream::reader() {
+	std::vector<uint8_t> in(chunk_size), out(chunk_size);
+	z_stream strm = {};
+	bool gz = false, first = true;
+
+	RetroWavePlayer::realtime_demote_thread();
+
+	while (1) {
+		pollfd pfd = {fd, POLLIN, 0};
+
+		// Wake up now and then to see if playback moved on
+		int rc = poll(&pfd, 1, 100);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stop)
+				break;
+		}
+
+		if (rc == 0 || (rc < 0 && errno == EINTR))
+			continue;
+
+		ssize_t in_len = ::read(fd, in.data(), in.size());
+
+		if (in_len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			printf("error: failed to read track: %s\n", strerror(errno));
+			break;
+		}
+
+		if (in_len == 0)
+			break;
+
+		if (first) {
+			first = false;
+			gz = in_len >= 2 && in[0] == 0x1f && in[1] == 0x8b;
+
+			if (gz)
+				inflateInit2(&strm, 15|32);
+		}
+
+		if (!gz) {
+			if (!push(in.data(), in_len))
+				break;
+
+			continue;
+		}
+
+		strm.next_in = in.data();
+		strm.avail_in = in_len;
+
+		bool failed = false;
+
+		while (strm.avail_in && !failed) {
+			strm.next_out = out.data();
+			strm.avail_out = out.size();
+
+			int zrc = inflate(&strm, Z_NO_FLUSH);
+
+			if (zrc < 0 && zrc != Z_BUF_ERROR) {
+				printf("zlib error %d in track!\n", zrc);
+				failed = true;
+			}
+
+			if (!push(out.data(), out.size() - strm.avail_out))
+				failed = true;
+
+			// Concatenated members are one stream to us
+			if (zrc == Z_STREAM_END)
+				inflateReset(&strm);
+		}
+
+		if (failed)
+			break;
+	}
+
+	if (gz)
+		inflateEnd(&strm);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	eof = true;
+	cond.notify_all();
+}
+
+void TrackStream::copy_out(uint64_t pos, uint8_t *buf, uint32_t len) {
+	uint32_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) % ring.size();
+		size_t n = std::min<size_t>(len - done, ring.size() - off);
+
+		memcpy(buf + done, ring.data() + off, n);
+		done += n;
+	}
+}
+
+int32_t TrackStream::read(uint64_t pos, uint8_t *buf, uint32_t len) {
+	// The writer can't touch what was there at the last look until the consumer says it's done, so no lock needed
+	if (pos >= seen_keep_from && pos < seen_head) {
+		uint32_t n = std::min<uint64_t>(len, seen_head - pos);
+		copy_out(pos, buf, n);
+		return n;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (pos < keep_from())
+		return -1;
+
+	// Data skipped over by a forward seek doesn't need to stay around
+	if (pos > consumed)
+		consumed = pos;
+
+	cond.notify_all();
+	cond.wait(lock, [&]{ return head > pos || eof; });
+
+	if (pos >= head)
+		return 0;
+
+	uint32_t n = std::min<uint64_t>(len, head - pos);
+	copy_out(pos, buf, n);
+
+	if (pos + n > consumed)
+		consumed = pos + n;
+
+	seen_head = head;
+	seen_keep_from = keep_from();
+	cond.notify_all();
+
+	return n;
+}
@@ -0,0 +1,574 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+    Copyright (C) 2021 Yukino Song <yukino@sudomaker.com>
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include "Player.hpp"
+
+#include <atomic>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <RetroWaveLib/Protocol/Serial.h>
+
+static const char wire_magic[8] = {'R', 'W', 'W', 'I', 'R', 'E', 0, 0};
+
+static inline uint64_t align8(uint64_t v) {
+	return (v + 7) & ~7ULL;
+}
+
+WireCache::~WireCache() {
+	clear();
+}
+
+void WireCache::clear() {
+	if (map)
+		munmap(map, map_len);
+
+	map = nullptr;
+	map_len = 0;
+	hdr = nullptr;
+}
+
+bool WireCache::load(const std::string &path, uint64_t content_hash, uint64_t config_hash) {
+	clear();
+
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(WireCacheHeader)) {
+		close(fd);
+		return false;
+	}
+
+	map_len = st.st_size;
+	map = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		map = nullptr;
+		return false;
+	}
+
+	auto h = (const WireCacheHeader *)map;
+
+	auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+		return offset <= map_len && count <= (map_len - offset) / size;
+	};
+
+	// Anything off means a stale or foreign file, which just gets compiled again
+	if (memcmp(h->magic, wire_magic, sizeof(wire_magic)) || h->version != version ||
+	    h->content_hash != content_hash || h->config_hash != config_hash || !h->frame_count ||
+	    !fits(h->frames_offset, h->frame_count, sizeof(WireCacheFrame)) ||
+	    !fits(h->segments_offset, h->segment_count, sizeof(RetroWaveSegment)) ||
+	    !fits(h->events_offset, h->event_count, sizeof(CompiledTrack::Event)) ||
+	    !fits(h->data_offset, h->data_size, 1)) {
+		clear();
+		return false;
+	}
+
+	hdr = h;
+
+	auto f = frames();
+
+	for (uint32_t i=0; i<hdr->frame_count; i++) {
+		if ((uint64_t)f[i].data_offset + f[i].data_len > hdr->data_size ||
+		    (uint64_t)f[i].first_segment + f[i].segment_count > hdr->segment_count ||
+		    (uint64_t)f[i].first_event + f[i].event_count > hdr->event_count ||
+		    (i && f[i].deadline < f[i - 1].deadline)) {
+			clear();
+			return false;
+		}
+	}
+
+	madvise(map, map_len, MADV_SEQUENTIAL);
+
+	return true;
+}
+
+bool WireCache::save(const std::string &path, const WireCacheHeader &header, const std::vector<WireCacheFrame> &frames,
+		     const std::vector<RetroWaveSegment> &segments, const std::vector<CompiledTrack::Event> &events, const std::vector<uint8_t> &data) {
+	WireCacheHeader h = header;
+
+	memcpy(h.magic, wire_magic, sizeof(wire_magic));
+	h.version = version;
+	h.frame_count = frames.size();
+	h.segment_count = segments.size();
+	h.event_count = events.size();
+	h.frames_offset = align8(sizeof(h));
+	h.segments_offset = align8(h.frames_offset + frames.size() * sizeof(WireCacheFrame));
+	h.events_offset = align8(h.segments_offset + segments.size() * sizeof(RetroWaveSegment));
+	h.data_offset = align8(h.events_offset + events.size() * sizeof(CompiledTrack::Event));
+	h.data_size = data.size();
+
+	// Written aside and renamed, so a player never maps half a file
+	std::string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	FILE *f = fopen(tmp_path.c_str(), "wb");
+
+	if (!f) {
+		printf("error: failed to create `%s': %s\n", tmp_path.c_str(), strerror(errno));
+		return false;
+	}
+
+	static const uint8_t zeros[8] = {0};
+	bool ok = true;
+
+	auto put = [&](uint64_t offset, const void *p, size_t len) {
+		long pos = ftell(f);
+
+		if (pos < 0 || (uint64_t)pos > offset) {
+			ok = false;
+			return;
+		}
+
+		ok = ok && fwrite(zeros, 1, offset - pos, f) == offset - pos;
+		ok = ok && (!len || fwrite(p, 1, len, f) == len);
+	};
+
+	put(0, &h, sizeof(h));
+	put(h.frames_offset, frames.data(), frames.size() * sizeof(WireCacheFrame));
+	put(h.segments_offset, segments.data(), segments.size() * sizeof(RetroWaveSegment));
+	put(h.events_offset, events.data(), events.size() * sizeof(CompiledTrack::Event));
+	put(h.data_offset, data.data(), data.size());
+
+	ok = (fclose(f) == 0) && ok;
+
+	if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+		printf("error: failed to write `%s': %s\n", path.c_str(), strerror(errno));
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t RetroWavePlayer::wire_hash(const void *data, size_t len, uint64_t hash) {
+	auto p = (const uint8_t *)data;
+
+	// FNV-1a
+	for (size_t i=0; i<len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+uint64_t RetroWavePlayer::wire_config_hash(uint32_t format) {
+	uint32_t version = WireCache::version;
+	uint64_t hash = wire_hash(&version, sizeof(version));
+
+	hash = wire_hash(&format, sizeof(format), hash);
+	hash = wire_hash(rtctx.board_transfer_speed, sizeof(rtctx.board_transfer_speed), hash);
+
+	std::vector<uint8_t> disabled(disabled_vgm_commands.begin(), disabled_vgm_commands.end());
+	std::sort(disabled.begin(), disabled.end());
+	hash = wire_hash(disabled.data(), disabled.size(), hash);
+
+	// The lookahead plan is made against the device's starting link cost, which doesn't change between runs
+	if (lookahead) {
+		double cost = ttw_auto ? 0 : ttw_nsec_per_byte.load();
+
+		hash = wire_hash(device_name.data(), device_name.size(), hash);
+		hash = wire_hash(&cost, sizeof(cost), hash);
+		hash = wire_hash(&null_nsec_per_byte, sizeof(null_nsec_per_byte), hash);
+	}
+
+	return hash;
+}
+
+std::string RetroWavePlayer::wire_cache_path(uint64_t content_hash, uint64_t config_hash) {
+	char name[64];
+	snprintf(name, sizeof(name), "/%016" PRIx64 "-%016" PRIx64 ".rww", content_hash, config_hash);
+	return cache_dir + name;
+}
+
+bool RetroWavePlayer::wire_cache_open() {
+	wire_cache.clear();
+
+	struct stat st;
+
+	// Hashing a track costs a pass over it, so don't bother until something was compiled
+	if (cache_dir.empty() || stat(cache_dir.c_str(), &st) || !S_ISDIR(st.st_mode))
+		return false;
+
+	uint32_t format = wctx->callback_io_raw ? WireCache::Format_SerialPacked : WireCache::Format_Segments;
+	uint64_t content_hash = wire_hash(file_buf.data(), file_buf.size());
+	uint64_t config_hash = wire_config_hash(format);
+
+	if (!wire_cache.load(wire_cache_path(content_hash, config_hash), content_hash, config_hash))
+		return false;
+
+	// The events are kept for rebuilding the register maps, see wire_resync()
+	auto &h = wire_cache.header();
+	auto frames = wire_cache.frames();
+
+	compiled.clear();
+	compiled.events.assign(wire_cache.events(), wire_cache.events() + h.event_count);
+
+	for (uint32_t i=0; i<h.frame_count; i++) {
+		uint32_t wait = i + 1 < h.frame_count ? frames[i + 1].deadline - frames[i].deadline : CompiledTrack::no_wait;
+		compiled.frames.push_back({frames[i].first_event, frames[i].event_count, frames[i].bytes, wait});
+	}
+
+	if (timing_strategy == Timing_Virtual)
+		printf("info: playing from the wire cache, %" PRIu32 " frames, %" PRIu64 " bytes\n", h.frame_count, h.data_size);
+
+	return true;
+}
+
+void RetroWavePlayer::callback_capture_segments(void *userp, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count) {
+	auto cap = (WireCapture *)userp;
+
+	for (uint32_t i=0; i<count; i++) {
+		auto &seg = segments[i];
+		uint32_t offset = cap->data.size();
+
+		cap->cmd_bytes += seg.len;
+
+		if (cap->format == WireCache::Format_SerialPacked) {
+			cap->data.resize(offset + retrowave_protocol_serial_packed_length(seg.len));
+			uint32_t len = retrowave_protocol_serial_pack(buf + seg.offset, seg.len, cap->data.data() + offset);
+			cap->data.resize(offset + len);
+		} else {
+			cap->data.insert(cap->data.end(), buf + seg.offset, buf + seg.offset + seg.len);
+			cap->segments.push_back({offset - cap->frame_data_start, seg.len, seg.transfer_speed});
+		}
+	}
+}
+
+void RetroWavePlayer::callback_capture_io(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	RetroWaveSegment seg = {0, len, data_rate};
+	callback_capture_segments(userp, (const uint8_t *)tx_buf, &seg, 1);
+}
+
+void RetroWavePlayer::callback_capture_raw(void *userp, const uint8_t *data, uint32_t len) {
+	auto cap = (WireCapture *)userp;
+
+	// Already packed, so this counts wire bytes rather than MCP23S17 ones
+	cap->cmd_bytes += len;
+	cap->data.insert(cap->data.end(), data, data + len);
+}
+
+bool RetroWavePlayer::wire_compile_file(const std::string &path, uint32_t format) {
+	if (!load_file(path))
+		return false;
+
+	chips_used = 0;
+	sn76489_dual = false;
+	memset(regmap_sn76489, 0, sizeof(regmap_sn76489));
+
+	if (tinyvgm_parse_header(&tvc) != TinyVGM_OK) {
+		printf("error: `%s' is not a VGM file.\n", path.c_str());
+		return false;
+	}
+
+	lookahead_plan();
+	compile_track();
+
+	WireCapture cap;
+	cap.format = format;
+
+	// Same encoder as playback, only the platform is swapped for the capture
+	RetroWaveContext saved = rtctx;
+	retrowave_init(&rtctx);
+	memcpy(rtctx.board_transfer_speed, saved.board_transfer_speed, sizeof(rtctx.board_transfer_speed));
+	rtctx.user_data = &cap;
+	rtctx.callback_io = callback_capture_io;
+	rtctx.callback_io_segments = callback_capture_segments;
+
+	std::vector<WireCacheFrame> frames;
+	uint64_t deadline = 0;
+
+	frames.reserve(compiled.frames.size());
+
+	for (auto &frame : compiled.frames) {
+		WireCacheFrame wf = {};
+
+		cap.frame_data_start = cap.data.size();
+		cap.cmd_bytes = 0;
+
+		wf.deadline = deadline;
+		wf.data_offset = cap.frame_data_start;
+		wf.first_segment = cap.segments.size();
+		wf.first_event = frame.first;
+		wf.event_count = frame.count;
+		wf.bytes = frame.bytes;
+
+		for (uint32_t i=0; i<frame.count; i++)
+			queue_event(compiled.events[frame.first + i]);
+
+		retrowave_flush(&rtctx);
+
+		wf.data_len = cap.data.size() - cap.frame_data_start;
+		wf.segment_count = cap.segments.size() - wf.first_segment;
+		wf.cmd_bytes = cap.cmd_bytes;
+
+		frames.push_back(wf);
+
+		if (frame.wait != CompiledTrack::no_wait)
+			deadline += frame.wait;
+	}
+
+	retrowave_deinit(&rtctx);
+	rtctx = saved;
+
+	WireCacheHeader header = {};
+	header.format = format;
+	header.content_hash = wire_hash(file_buf.data(), file_buf.size());
+	header.config_hash = wire_config_hash(format);
+
+	return WireCache::save(wire_cache_path(header.content_hash, header.config_hash), header, frames, cap.segments, compiled.events, cap.data);
+}
+
+static bool has_vgm_suffix(const std::string &name) {
+	auto dot = name.rfind('.');
+
+	if (dot == std::string::npos)
+		return false;
+
+	std::string ext = name.substr(dot + 1);
+
+	for (auto &c : ext)
+		c = tolower(c);
+
+	return ext == "vgm" || ext == "vgz";
+}
+
+static void collect_tracks(const std::string &path, std::vector<std::string> &out) {
+	struct stat st;
+
+	if (stat(path.c_str(), &st)) {
+		printf("error: `%s': %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		out.push_back(path);
+		return;
+	}
+
+	DIR *dir = opendir(path.c_str());
+
+	if (!dir)
+		return;
+
+	std::vector<std::string> names;
+
+	while (auto ent = readdir(dir)) {
+		if (ent->d_name[0] != '.')
+			names.push_back(ent->d_name);
+	}
+
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	for (auto &name : names) {
+		std::string child = path + "/" + name;
+
+		if (stat(child.c_str(), &st) == 0 && (S_ISDIR(st.st_mode) || has_vgm_suffix(name)))
+			collect_tracks(child, out);
+	}
+}
+
+void RetroWavePlayer::wire_compile_library(const std::vector<std::string> &paths) {
+	std::vector<std::string> tracks;
+
+	for (auto &it : paths)
+		collect_tracks(it, tracks);
+
+	// mkdir -p
+	for (size_t pos = 1; pos <= cache_dir.size(); pos++) {
+		if (pos == cache_dir.size() || cache_dir[pos] == '/')
+			mkdir(cache_dir.substr(0, pos).c_str(), 0755);
+	}
+
+	uint32_t format = device_name == "tty" ? WireCache::Format_SerialPacked : WireCache::Format_Segments;
+	size_t workers = std::max(1U, std::thread::hardware_concurrency());
+
+	workers = std::min(workers, tracks.size());
+
+	printf("info: compiling %zu tracks into `%s' with %zu threads\n", tracks.size(), cache_dir.c_str(), workers);
+
+	std::atomic<size_t> next{0}, done{0};
+	std::vector<std::thread> threads;
+
+	for (size_t i=0; i<workers; i++) {
+		threads.emplace_back([&](){
+			// Each thread gets its own player, which has all the per track state
+			auto w = std::make_unique<RetroWavePlayer>();
+
+			w->init_tinyvgm();
+			retrowave_init(&w->rtctx);
+			memcpy(w->rtctx.board_transfer_speed, rtctx.board_transfer_speed, sizeof(rtctx.board_transfer_speed));
+			w->disabled_vgm_commands = disabled_vgm_commands;
+			w->lookahead = lookahead;
+			w->ttw_auto = ttw_auto;
+			w->ttw_nsec_per_byte = ttw_nsec_per_byte.load();
+			w->ttw_serial_packed = ttw_serial_packed;
+			w->null_nsec_per_byte = null_nsec_per_byte;
+			w->device_name = device_name;
+			w->cache_dir = cache_dir;
+
+			for (size_t idx; (idx = next++) < tracks.size(); ) {
+				if (w->wire_compile_file(tracks[idx], format)) {
+					done++;
+					printf("info: compiled `%s'\n", tracks[idx].c_str());
+				}
+			}
+
+			w->file_buf.clear();
+			retrowave_deinit(&w->rtctx);
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	printf("info: %zu of %zu tracks compiled\n", done.load(), tracks.size());
+}
+
+int RetroWavePlayer::play_wire() {
+	auto &h = wire_cache.header();
+	auto frames = wire_cache.frames();
+
+	wire_sent_frames = wire_queued_frames = 0;
+	wire_resynced_events = 0;
+
+	for (uint32_t i=0; i<h.frame_count; i++) {
+		auto &wf = frames[i];
+
+		// A batched or merged wait leaves the last frames unsent, this one goes out after them
+		queued_bytes += wf.bytes;
+		wire_queued_frames = i + 1;
+
+		if (single_step)
+			single_frame_hook();
+
+		// The last frame goes out with the mute at the end, like the writes after the last wait do
+		if (i + 1 == h.frame_count)
+			break;
+
+		int rc = flush_and_sleep(frames[i + 1].deadline - wf.deadline);
+
+		if (rc != TinyVGM_OK)
+			return rc;
+	}
+
+	return TinyVGM_OK;
+}
+
+uint32_t RetroWavePlayer::wire_pending_cmd_bytes() const {
+	auto frames = wire_cache.frames();
+	uint32_t ret = 0;
+
+	for (size_t i=wire_sent_frames; i<wire_queued_frames; i++)
+		ret += frames[i].cmd_bytes;
+
+	return ret;
+}
+
+void RetroWavePlayer::wire_send_pending() {
+	auto frames = wire_cache.frames();
+
+	while (wire_sent_frames < wire_queued_frames) {
+		auto &wf = frames[wire_sent_frames];
+		const uint8_t *buf = wire_cache.data() + wf.data_offset;
+
+		if (wire_cache.header().format == WireCache::Format_SerialPacked)
+			retrowave_flush_raw(wctx, buf, wf.data_len);
+		else
+			retrowave_flush_segments(wctx, buf, wire_cache.segments() + wf.first_segment, wf.segment_count);
+
+		wire_sent_frames++;
+	}
+}
+
+static void wire_discard_io(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	if (rx_buf)
+		memset(rx_buf, 0, len);
+}
+
+void RetroWavePlayer::wire_resync() {
+	// Frames from the cache never passed through the board drivers or the register maps, so catch them up now
+	size_t end = 0;
+
+	if (wire_sent_frames) {
+		auto &last = compiled.frames[wire_sent_frames - 1];
+		end = last.first + last.count;
+	}
+
+	RetroWaveContext saved = *wctx;
+	retrowave_init(wctx);
+	wctx->callback_io = wire_discard_io;
+
+	reg_map_refreshed_list.clear();
+
+	// Only a new track or a seek back starts over, pausing and stepping just add the frames sent since
+	if (!wire_resynced_events || end < wire_resynced_events) {
+		reg_map.clear();
+		memset(regmap_sn76489, 0, sizeof(regmap_sn76489));
+		wire_resynced_events = 0;
+	} else {
+		wctx->chip_state = wire_chip_state;
+	}
+
+	for (size_t i=wire_resynced_events; i<end; i++) {
+		auto &ev = compiled.events[i];
+
+		if (queue_event(ev))
+			regmap_insert(ev.cmd, ev.reg, ev.val);
+	}
+
+	wire_resynced_events = end;
+	wire_chip_state = wctx->chip_state;
+
+	retrowave_deinit(wctx);
+	*wctx = saved;
+	wctx->chip_state = wire_chip_state;
+}
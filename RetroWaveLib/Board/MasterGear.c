@@ -45,110 +45,184 @@
 
 static const int transfer_speed = 1e6;
 
+// GPIOA values that select the SN76489 chips, on CS#, CS#+WR# and WR# strobes
+enum {
+	SN76489_Both = 0, SN76489_Left, SN76489_Right
+};
+
+static const uint8_t sn76489_strobes[3][3] = {
+	{0x5f, 0x0f, 0xaf},
+	{0xdf, 0xcf, 0xef},
+	{0x7f, 0x3f, 0xbf},
+};
+
+#define SN76489_W(v)	0xff, (v), 0x5f, (v), 0x0f, (v), 0xaf, (v), 0xff, 0x00
+
+// Both chips: tone 1-3 and noise to max attenuation
+#define SN76489_MUTE	SN76489_W(0x9f), SN76489_W(0xbf), SN76489_W(0xdf), SN76489_W(0xff)
+
+static const uint8_t sn76489_mute_seq[] = {RetroWave_Board_MasterGear, 0x12, SN76489_MUTE};
+
+// YM2413 IC# low for 2 bytes, then high again
+static const uint8_t ym2413_reset_seq[] = {RetroWave_Board_MasterGear, 0x12, 0xfe, 0x00, 0xff, 0x00};
+
+static const uint8_t reset_seq[] = {RetroWave_Board_MasterGear, 0x12, 0xfe, 0x00, 0xff, 0x00, SN76489_MUTE};
+
+#undef SN76489_MUTE
+#undef SN76489_W
+
+static inline void put_ym2413(uint8_t *buf, uint32_t *len, uint8_t reg, uint8_t val) {
+	const uint8_t seq[] = {0xff, reg, 0xf1, reg, 0xff, val, 0xf9, val, 0xf7, val, 0xff, val};
+	memcpy(buf + *len, seq, sizeof(seq));
+	*len += sizeof(seq);
+}
+
+static inline void put_sn76489(uint8_t *buf, uint32_t *len, int chips, uint8_t val) {
+	const uint8_t seq[] = {
+		0xff, val,				// Set data only
+		sn76489_strobes[chips][0], val,		// CS# on
+		sn76489_strobes[chips][1], val,		// CS#+WR# on
+		sn76489_strobes[chips][2], val,		// WR# on
+		0xff, 0x00				// ALL off
+	};
+	memcpy(buf + *len, seq, sizeof(seq));
+	*len += sizeof(seq);
+}
+
+static inline void track_ym2413(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	if (reg == 0x0e) {
+		ctx->chip_state.ym2413_rhythm = val;
+	} else if (reg >= 0x20 && reg <= 0x28) {
+		ctx->chip_state.ym2413_key[reg - 0x20] = val;
+	} else if (reg >= 0x30 && reg <= 0x38) {
+		ctx->chip_state.ym2413_vol[reg - 0x30] = val;
+	}
+}
+
+static inline void track_sn76489_chip(RetroWaveContext *ctx, int chip, uint8_t val) {
+	if (val & 0x80)
+		ctx->chip_state.sn76489_latch[chip] = val;
+
+	uint8_t latch = ctx->chip_state.sn76489_latch[chip];
+
+	if (latch & 0x10)
+		ctx->chip_state.sn76489_att[chip][(latch >> 5) & 0x3] = val & 0xf;
+}
+
+static inline void track_sn76489(RetroWaveContext *ctx, int chips, uint8_t val) {
+	if (chips != SN76489_Right)
+		track_sn76489_chip(ctx, 0, val);
+	if (chips != SN76489_Left)
+		track_sn76489_chip(ctx, 1, val);
+}
+
+static void queue_sn76489(RetroWaveContext *ctx, int chips, uint8_t val) {
+	track_sn76489(ctx, chips, val);
+
+	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MasterGear, 0x12);
+	ctx->transfer_speed_hint = retrowave_get_transfer_speed(ctx, RetroWave_Board_MasterGear, transfer_speed);
+
+	put_sn76489(ctx->cmd_buffer, &ctx->cmd_buffer_used, chips, val);
+}
+
 void retrowave_mastergear_queue_ym2413(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	track_ym2413(ctx, reg, val);
+
 	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MasterGear, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
-
-	ctx->cmd_buffer_used += 12;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 12] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 11] = reg;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 10] = 0xf1;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 9] = reg;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 8] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 7] = val;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0xf9;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 5] = val;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 4] = 0xf7;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 3] = val;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 2] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 1] = val;
+	ctx->transfer_speed_hint = retrowave_get_transfer_speed(ctx, RetroWave_Board_MasterGear, transfer_speed);
+
+	put_ym2413(ctx->cmd_buffer, &ctx->cmd_buffer_used, reg, val);
 }
 
 void retrowave_mastergear_reset_ym2413(RetroWaveContext *ctx) {
-	uint8_t buf[] = {RetroWave_Board_MasterGear, 0x12, 0xfe};
-	ctx->callback_io(ctx->user_data, transfer_speed / 10, buf, NULL, sizeof(buf));
-	buf[2] = 0xff;
-	ctx->callback_io(ctx->user_data, transfer_speed / 10, buf, NULL, sizeof(buf));
+	retrowave_flush(ctx);
+
+	ctx->callback_io(ctx->user_data, transfer_speed / 10, ym2413_reset_seq, NULL, sizeof(ym2413_reset_seq));
+
+	memset(ctx->chip_state.ym2413_key, 0, sizeof(ctx->chip_state.ym2413_key));
+	memset(ctx->chip_state.ym2413_vol, 0, sizeof(ctx->chip_state.ym2413_vol));
+	ctx->chip_state.ym2413_rhythm = 0;
 }
 
 void retrowave_mastergear_queue_sn76489(RetroWaveContext *ctx, uint8_t val) {
-	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MasterGear, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
-
-	ctx->cmd_buffer_used += 10;
-	// Set data only
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 10] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 9] = val;
-	// CS# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 8] = 0x5f;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 7] = val;
-	// CS#+WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0x0f;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 5] = val;
-	// WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 4] = 0xaf;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 3] = val;
-	// ALL off
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 2] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 1] = 0x00;
+	queue_sn76489(ctx, SN76489_Both, val);
 }
 
 void retrowave_mastergear_mute_sn76489(RetroWaveContext *ctx) {
-	uint8_t mute_tone1 = 0x9f;
-	uint8_t mute_tone2 = 0xdf;
-	uint8_t mute_tone3 = 0xbf;
-	uint8_t mute_noise = 0xff;
-
-	uint8_t buf[] = {RetroWave_Board_MasterGear, 0x12,
-			 0xff, mute_tone1, 0x5f, mute_tone1, 0x0f, mute_tone1, 0xaf, mute_tone1, 0xff, 0x00,
-			 0xff, mute_tone2, 0x5f, mute_tone2, 0x0f, mute_tone2, 0xaf, mute_tone2, 0xff, 0x00,
-			 0xff, mute_tone3, 0x5f, mute_tone3, 0x0f, mute_tone3, 0xaf, mute_tone3, 0xff, 0x00,
-			 0xff, mute_noise, 0x5f, mute_noise, 0x0f, mute_noise, 0xaf, mute_noise, 0xff, 0x00,
-	};
+	retrowave_flush(ctx);
+
+	ctx->callback_io(ctx->user_data, transfer_speed / 10, sn76489_mute_seq, NULL, sizeof(sn76489_mute_seq));
 
-	ctx->callback_io(ctx->user_data, transfer_speed / 10, buf, NULL, sizeof(buf));
+	memset(ctx->chip_state.sn76489_att, 0xf, sizeof(ctx->chip_state.sn76489_att));
 }
 
 void retrowave_mastergear_queue_sn76489_left(RetroWaveContext *ctx, uint8_t val) {
-	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MasterGear, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
-
-	ctx->cmd_buffer_used += 10;
-	// Set data only
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 10] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 9] = val;
-	// CS# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 8] = 0xdf;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 7] = val;
-	// CS#+WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0xcf;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 5] = val;
-	// WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 4] = 0xef;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 3] = val;
-	// ALL off
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 2] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 1] = 0x00;
+	queue_sn76489(ctx, SN76489_Left, val);
 }
 
 void retrowave_mastergear_queue_sn76489_right(RetroWaveContext *ctx, uint8_t val) {
-	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MasterGear, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
-
-	ctx->cmd_buffer_used += 10;
-	// Set data only
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 10] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 9] = val;
-	// CS# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 8] = 0x7f;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 7] = val;
-	// CS#+WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0x3f;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 5] = val;
-	// WR# on
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 4] = 0xbf;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 3] = val;
-	// ALL off
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 2] = 0xff;
-	ctx->cmd_buffer[ctx->cmd_buffer_used - 1] = 0x00;
-}
\ No newline at end of file
+	queue_sn76489(ctx, SN76489_Right, val);
+}
+
+void retrowave_mastergear_reset(RetroWaveContext *ctx) {
+	retrowave_flush(ctx);
+
+	ctx->callback_io(ctx->user_data, transfer_speed / 10, reset_seq, NULL, sizeof(reset_seq));
+
+	memset(ctx->chip_state.ym2413_key, 0, sizeof(ctx->chip_state.ym2413_key));
+	memset(ctx->chip_state.ym2413_vol, 0, sizeof(ctx->chip_state.ym2413_vol));
+	ctx->chip_state.ym2413_rhythm = 0;
+	memset(ctx->chip_state.sn76489_att, 0xf, sizeof(ctx->chip_state.sn76489_att));
+}
+
+void retrowave_mastergear_mute_active(RetroWaveContext *ctx) {
+	retrowave_flush(ctx);
+
+	// YM2413: 9 channels * (key off + volume), plus rhythm. SN76489: 4 channels * 2 chips.
+	uint8_t buf[2 + (9 * 2 + 1) * 12 + 4 * 2 * 10];
+	uint32_t len = 2;
+
+	buf[0] = RetroWave_Board_MasterGear;
+	buf[1] = 0x12;
+
+	RetroWaveChipState *state = &ctx->chip_state;
+
+	for (uint8_t ch=0; ch<9; ch++) {
+		if (!(state->ym2413_key[ch] & 0x10))
+			continue;
+
+		state->ym2413_key[ch] &= ~0x10;
+		state->ym2413_vol[ch] |= 0x0f;
+
+		put_ym2413(buf, &len, 0x20 + ch, state->ym2413_key[ch]);
+		put_ym2413(buf, &len, 0x30 + ch, state->ym2413_vol[ch]);
+	}
+
+	if ((state->ym2413_rhythm & 0x20) && (state->ym2413_rhythm & 0x1f)) {
+		state->ym2413_rhythm &= ~0x1f;
+		put_ym2413(buf, &len, 0x0e, state->ym2413_rhythm);
+	}
+
+	for (uint8_t ch=0; ch<4; ch++) {
+		int left = state->sn76489_att[0][ch] != 0xf, right = state->sn76489_att[1][ch] != 0xf;
+		uint8_t mute = 0x9f | (ch << 5);
+
+		if (left && right)
+			put_sn76489(buf, &len, SN76489_Both, mute);
+		else if (left)
+			put_sn76489(buf, &len, SN76489_Left, mute);
+		else if (right)
+			put_sn76489(buf, &len, SN76489_Right, mute);
+		else
+			continue;
+
+		state->sn76489_att[0][ch] = state->sn76489_att[1][ch] = 0xf;
+	}
+
+	// Later data bytes must not land on a channel the old latch pointed to
+	if (len > 2)
+		state->sn76489_latch[0] = state->sn76489_latch[1] = 0;
+
+	if (len > 2)
+		ctx->callback_io(ctx->user_data, retrowave_get_transfer_speed(ctx, RetroWave_Board_MasterGear, transfer_speed), buf, NULL, len);
+}
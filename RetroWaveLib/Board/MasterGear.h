@@ -59,6 +59,11 @@ extern void retrowave_mastergear_queue_sn76489_right(RetroWaveContext *ctx, uint
 
 extern void retrowave_mastergear_mute_sn76489(RetroWaveContext *ctx);
 
+// Resets the YM2413 and mutes the SN76489 in one transfer
+extern void retrowave_mastergear_reset(RetroWaveContext *ctx);
+// Keys off and silences only the voices that are sounding
+extern void retrowave_mastergear_mute_active(RetroWaveContext *ctx);
+
 #ifdef __cplusplus
 };
 #endif
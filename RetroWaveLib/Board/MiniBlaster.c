@@ -49,7 +49,7 @@ static const int transfer_speed = 0.8e6;
 
 void retrowave_miniblaster_queue(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
 	retrowave_cmd_buffer_init(ctx, RetroWave_Board_MiniBlaster, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
+	ctx->transfer_speed_hint = retrowave_get_transfer_speed(ctx, RetroWave_Board_MiniBlaster, transfer_speed);
 
 	if (reg < 0x80) {
 		reg &= 0x7f;
@@ -45,9 +45,54 @@
 
 static const int transfer_speed = 2e6;
 
+// Slot offsets of the two operators of each channel
+static const uint8_t channel_slots[9] = {0x00, 0x01, 0x02, 0x08, 0x09, 0x0a, 0x10, 0x11, 0x12};
+
+#define MUTE_VAL(r)	((r) >= 0x40 && (r) <= 0x55 ? 0xff : 0x00)
+#define MUTE_W(r)	0xe1, (r), 0xe3, MUTE_VAL(r), 0xfb, MUTE_VAL(r), \
+			0xe5, (r), 0xe7, MUTE_VAL(r), 0xfb, MUTE_VAL(r)
+#define MUTE_ROW(h)	MUTE_W((h) | 0x0), MUTE_W((h) | 0x1), MUTE_W((h) | 0x2), MUTE_W((h) | 0x3), \
+			MUTE_W((h) | 0x4), MUTE_W((h) | 0x5), MUTE_W((h) | 0x6), MUTE_W((h) | 0x7), \
+			MUTE_W((h) | 0x8), MUTE_W((h) | 0x9), MUTE_W((h) | 0xa), MUTE_W((h) | 0xb), \
+			MUTE_W((h) | 0xc), MUTE_W((h) | 0xd), MUTE_W((h) | 0xe), MUTE_W((h) | 0xf)
+
+// 0x20-0xF5 on both ports: TL to max attenuation, everything else cleared
+static const uint8_t mute_seq[] = {
+	RetroWave_Board_OPL3, 0x12,
+	MUTE_ROW(0x20), MUTE_ROW(0x30), MUTE_ROW(0x40), MUTE_ROW(0x50), MUTE_ROW(0x60), MUTE_ROW(0x70),
+	MUTE_ROW(0x80), MUTE_ROW(0x90), MUTE_ROW(0xa0), MUTE_ROW(0xb0), MUTE_ROW(0xc0), MUTE_ROW(0xd0),
+	MUTE_ROW(0xe0),
+	MUTE_W(0xf0), MUTE_W(0xf1), MUTE_W(0xf2), MUTE_W(0xf3), MUTE_W(0xf4), MUTE_W(0xf5)
+};
+
+#undef MUTE_ROW
+#undef MUTE_W
+#undef MUTE_VAL
+
+// IC# low for 2 bytes, then high again
+static const uint8_t reset_seq[] = {RetroWave_Board_OPL3, 0x12, 0xfe, 0x00, 0xff, 0x00};
+
+static inline void track(RetroWaveContext *ctx, uint8_t port, uint8_t reg, uint8_t val) {
+	if (reg >= 0xb0 && reg <= 0xb8) {
+		ctx->chip_state.opl3_bx[port][reg - 0xb0] = val;
+	} else if (reg == 0xbd && !port) {
+		ctx->chip_state.opl3_bd = val;
+	}
+}
+
+static inline void put_write(uint8_t *buf, uint32_t *len, uint8_t port, uint8_t reg, uint8_t val) {
+	buf[(*len)++] = port ? 0xe5 : 0xe1;
+	buf[(*len)++] = reg;
+	buf[(*len)++] = port ? 0xe7 : 0xe3;
+	buf[(*len)++] = val;
+	buf[(*len)++] = 0xfb;
+	buf[(*len)++] = val;
+}
+
 void retrowave_opl3_queue_port0(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	track(ctx, 0, reg, val);
 	retrowave_cmd_buffer_init(ctx, RetroWave_Board_OPL3, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
+	ctx->transfer_speed_hint = retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed);
 
 	ctx->cmd_buffer_used += 6;
 	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0xe1;
@@ -59,8 +104,9 @@ void retrowave_opl3_queue_port0(RetroWaveContext *ctx, uint8_t reg, uint8_t val)
 }
 
 void retrowave_opl3_queue_port1(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	track(ctx, 1, reg, val);
 	retrowave_cmd_buffer_init(ctx, RetroWave_Board_OPL3, 0x12);
-	ctx->transfer_speed_hint = transfer_speed;
+	ctx->transfer_speed_hint = retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed);
 
 	ctx->cmd_buffer_used += 6;
 	ctx->cmd_buffer[ctx->cmd_buffer_used - 6] = 0xe5;
@@ -72,25 +118,74 @@ void retrowave_opl3_queue_port1(RetroWaveContext *ctx, uint8_t reg, uint8_t val)
 }
 
 void retrowave_opl3_emit_port0(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	track(ctx, 0, reg, val);
 	uint8_t buf[] = {RetroWave_Board_OPL3, 0x12, 0xe1, reg, 0xe3, val, 0xfb, val};
-	ctx->callback_io(ctx->user_data, transfer_speed, buf, NULL, sizeof(buf));
+	ctx->callback_io(ctx->user_data, retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed), buf, NULL, sizeof(buf));
 }
 
 void retrowave_opl3_emit_port1(RetroWaveContext *ctx, uint8_t reg, uint8_t val) {
+	track(ctx, 1, reg, val);
 	uint8_t buf[] = {RetroWave_Board_OPL3, 0x12, 0xe5, reg, 0xe7, val, 0xfb, val};
-	ctx->callback_io(ctx->user_data, transfer_speed, buf, NULL, sizeof(buf));
+	ctx->callback_io(ctx->user_data, retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed), buf, NULL, sizeof(buf));
 }
 
 void retrowave_opl3_reset(RetroWaveContext *ctx) {
-	uint8_t buf[] = {RetroWave_Board_OPL3, 0x12, 0xfe, 0x00};
-	ctx->callback_io(ctx->user_data, transfer_speed / 10, buf, NULL, sizeof(buf));
-	buf[2] = 0xff;
-	ctx->callback_io(ctx->user_data, transfer_speed / 10, buf, NULL, sizeof(buf));
+	retrowave_flush(ctx);
+
+	ctx->callback_io(ctx->user_data, transfer_speed / 10, reset_seq, NULL, sizeof(reset_seq));
+
+	memset(ctx->chip_state.opl3_bx, 0, sizeof(ctx->chip_state.opl3_bx));
+	ctx->chip_state.opl3_bd = 0;
 }
 
 void retrowave_opl3_mute(RetroWaveContext *ctx) {
-	for (uint8_t i = 0x20; i <= 0xF5; i++) {
-		retrowave_opl3_emit_port0(ctx, i, i >= 0x40 && i <= 0x55 ? 0xFF : 0x00);
-		retrowave_opl3_emit_port1(ctx, i, i >= 0x40 && i <= 0x55 ? 0xFF : 0x00);
+	retrowave_flush(ctx);
+
+	ctx->callback_io(ctx->user_data, retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed), mute_seq, NULL, sizeof(mute_seq));
+
+	memset(ctx->chip_state.opl3_bx, 0, sizeof(ctx->chip_state.opl3_bx));
+	ctx->chip_state.opl3_bd = 0;
+}
+
+void retrowave_opl3_mute_active(RetroWaveContext *ctx) {
+	retrowave_flush(ctx);
+
+	// 2 ports * 9 channels * (key off + 2 operators), plus rhythm
+	uint8_t buf[2 + (2 * 9 * 3 + 1 + 6) * 6];
+	uint32_t len = 2;
+
+	buf[0] = RetroWave_Board_OPL3;
+	buf[1] = 0x12;
+
+	for (uint8_t port=0; port<2; port++) {
+		for (uint8_t ch=0; ch<9; ch++) {
+			uint8_t bx = ctx->chip_state.opl3_bx[port][ch];
+
+			if (!(bx & 0x20))
+				continue;
+
+			put_write(buf, &len, port, 0xb0 + ch, bx & ~0x20);
+			put_write(buf, &len, port, 0x40 + channel_slots[ch], 0xff);
+			put_write(buf, &len, port, 0x43 + channel_slots[ch], 0xff);
+
+			ctx->chip_state.opl3_bx[port][ch] = bx & ~0x20;
+		}
 	}
+
+	uint8_t bd = ctx->chip_state.opl3_bd;
+
+	if ((bd & 0x20) && (bd & 0x1f)) {
+		put_write(buf, &len, 0, 0xbd, bd & ~0x1f);
+
+		// Percussion lives on channels 6-8
+		for (uint8_t ch=6; ch<9; ch++) {
+			put_write(buf, &len, 0, 0x40 + channel_slots[ch], 0xff);
+			put_write(buf, &len, 0, 0x43 + channel_slots[ch], 0xff);
+		}
+
+		ctx->chip_state.opl3_bd = bd & ~0x1f;
+	}
+
+	if (len > 2)
+		ctx->callback_io(ctx->user_data, retrowave_get_transfer_speed(ctx, RetroWave_Board_OPL3, transfer_speed), buf, NULL, len);
 }
@@ -56,6 +56,7 @@ extern void retrowave_opl3_emit_port1(RetroWaveContext *ctx, uint8_t reg, uint8_
 
 extern void retrowave_opl3_reset(RetroWaveContext *ctx);
 extern void retrowave_opl3_mute(RetroWaveContext *ctx);
+extern void retrowave_opl3_mute_active(RetroWaveContext *ctx);
 
 #ifdef __cplusplus
 };
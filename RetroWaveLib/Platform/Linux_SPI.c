@@ -47,13 +47,27 @@
 
 static const char log_tag[] = "retrowave platform linux_spi";
 
+static const char *cs_mode_names[] = {"auto", "native", "GPIO v2", "GPIO v1"};
 
-static inline void __attribute__((always_inline)) set_cs(RetroWavePlatform_LinuxSPI *ctx, int value) {
-	struct gpiohandle_data gpio_data;
+// spidev can't take more than this many transfers in one message
+static const uint32_t max_xfers_per_message = (1 << _IOC_SIZEBITS) / sizeof(struct spi_ioc_transfer) - 1;
 
-	gpio_data.values[0] = value;
+static inline void __attribute__((always_inline)) set_cs(RetroWavePlatform_LinuxSPI *ctx, int value) {
+	int rc;
+
+#ifdef GPIO_V2_LINE_SET_VALUES_IOCTL
+	if (ctx->cs_mode == RetroWave_LinuxSPI_CS_GPIO_V2) {
+		struct gpio_v2_line_values gpio_values = {.bits = value, .mask = 1};
+		rc = ioctl(ctx->fd_gpioline, GPIO_V2_LINE_SET_VALUES_IOCTL, &gpio_values);
+	} else
+#endif
+	{
+		struct gpiohandle_data gpio_data;
+		gpio_data.values[0] = value;
+		rc = ioctl(ctx->fd_gpioline, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &gpio_data);
+	}
 
-	if (ioctl(ctx->fd_gpioline, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &gpio_data)) {
+	if (rc) {
 		fprintf(stderr, "%s: FATAL: failed to set GPIO value: %s\n", log_tag, strerror(errno));
 		abort();
 	}
@@ -74,53 +88,385 @@ static inline void set_device_lock(RetroWavePlatform_LinuxSPI *ctx, int value) {
 	}
 }
 
-static struct spi_ioc_transfer spi_tr = {0};
+static uint64_t monotonic_nsec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
-	RetroWavePlatform_LinuxSPI *ctx = userp;
+static uint32_t read_spidev_bufsiz() {
+	uint32_t ret = 0;
+
+	FILE *f = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+
+	if (f) {
+		if (fscanf(f, "%" SCNu32, &ret) != 1)
+			ret = 0;
+		fclose(f);
+	}
+
+	if (ret < 64)
+		ret = 4096; // Kernel default
+
+	return ret;
+}
+
+static struct spi_ioc_transfer *xfer_get(RetroWavePlatform_LinuxSPI *ctx, uint32_t idx) {
+	if (idx >= ctx->xfers_size) {
+		ctx->xfers_size = ctx->xfers_size ? ctx->xfers_size * 2 : 64;
+		ctx->xfers = realloc(ctx->xfers, ctx->xfers_size * sizeof(struct spi_ioc_transfer));
+	}
+
+	struct spi_ioc_transfer *ret = &ctx->xfers[idx];
+	memset(ret, 0, sizeof(struct spi_ioc_transfer));
+	return ret;
+}
+
+// Adds the transfers of one board segment, split into chip select windows that fit in bufsiz.
+// Windows after the first one repeat the 2 byte MCP23S17 header and carry whole GPIOA/GPIOB pairs.
+static uint32_t build_segment(RetroWavePlatform_LinuxSPI *ctx, uint32_t xfer_idx, const uint8_t *tx_buf, uint8_t *rx_buf, uint32_t len, uint32_t speed) {
+	const uint32_t header_len = 2;
+	uint32_t max_payload = (ctx->bufsiz - header_len) & ~1U;
+
+	uint32_t piece_len = len <= ctx->bufsiz ? len : header_len + max_payload;
+
+	struct spi_ioc_transfer *tr = xfer_get(ctx, xfer_idx++);
+	tr->tx_buf = (uintptr_t)tx_buf;
+	tr->rx_buf = (uintptr_t)rx_buf;
+	tr->len = piece_len;
+	tr->speed_hz = speed;
+	tr->cs_change = 1;
+
+	uint32_t pos = piece_len;
 
-	spi_tr.tx_buf = (__u64)tx_buf;
-	spi_tr.rx_buf = (__u64)rx_buf;
-	spi_tr.len = len;
-	spi_tr.speed_hz = data_rate;
-//	spi_tr.bits_per_word = 8;
+	while (pos < len) {
+		tr = xfer_get(ctx, xfer_idx++);
+		tr->tx_buf = (uintptr_t)tx_buf;
+		tr->len = header_len;
+		tr->speed_hz = speed;
 
-//	set_device_lock(ctx, 1);
+		piece_len = len - pos < max_payload ? len - pos : max_payload;
 
-	set_cs(ctx, 0);
+		tr = xfer_get(ctx, xfer_idx++);
+		tr->tx_buf = (uintptr_t)(tx_buf + pos);
+		tr->rx_buf = rx_buf ? (uintptr_t)(rx_buf + pos) : 0;
+		tr->len = piece_len;
+		tr->speed_hz = speed;
+		tr->cs_change = 1;
 
-	if (ioctl(ctx->fd_spi, SPI_IOC_MESSAGE(1), &spi_tr) < 0) {
+		pos += piece_len;
+	}
+
+	return xfer_idx;
+}
+
+static void do_message(RetroWavePlatform_LinuxSPI *ctx, uint32_t first, uint32_t count) {
+	// On the last transfer of a message, cs_change would keep chip select asserted
+	ctx->xfers[first + count - 1].cs_change = 0;
+
+	if (ctx->cs_mode != RetroWave_LinuxSPI_CS_Native) {
+		set_cs(ctx, 0);
+		ctx->ctx->io_stats.syscalls += 2;
+	}
+
+	if (ioctl(ctx->fd_spi, SPI_IOC_MESSAGE(count), &ctx->xfers[first]) < 0) {
 		fprintf(stderr, "%s: FATAL: failed to do SPI transfer: %s\n", log_tag, strerror(errno));
 		abort();
 	}
 
-//	printf("SPI TX: ");
-//
-//	for (int i=0; i<len; i++) {
-//		printf("%02x ", ((uint8_t *)tx_buf)[i]);
-//	}
-//
-//	puts("");
-//
-//	printf("SPI RX: ");
-//
-//	for (int i=0; i<len; i++) {
-//		printf("%02x ", ((uint8_t *)rx_buf)[i]);
-//	}
-//
-//	puts("");
+	if (ctx->cs_mode != RetroWave_LinuxSPI_CS_Native)
+		set_cs(ctx, 1);
+
+	ctx->ctx->io_stats.syscalls++;
+}
+
+// cs_change marks the last transfer of each chip select window. With native chip select, as many windows
+// as bufsiz allows share one message. Otherwise every window needs its own message between the GPIO writes.
+static void submit(RetroWavePlatform_LinuxSPI *ctx, uint32_t xfer_count) {
+	uint64_t time_start = monotonic_nsec(), bytes_start = ctx->ctx->io_stats.bytes;
+	uint32_t first = 0, message_len = 0, window_first = 0, window_len = 0;
+
+	for (uint32_t i=0; i<xfer_count; i++) {
+		window_len += ctx->xfers[i].len;
+
+		if (!ctx->xfers[i].cs_change)
+			continue;
+
+		if (ctx->cs_mode == RetroWave_LinuxSPI_CS_Native) {
+			if (window_first > first && (message_len + window_len > ctx->bufsiz || i - first + 1 > max_xfers_per_message)) {
+				do_message(ctx, first, window_first - first);
+				first = window_first;
+				message_len = 0;
+			}
+		} else {
+			first = window_first;
+			message_len = 0;
+		}
+
+		message_len += window_len;
+		ctx->ctx->io_stats.bytes += window_len;
+
+		window_first = i + 1;
+		window_len = 0;
+
+		if (ctx->cs_mode != RetroWave_LinuxSPI_CS_Native) {
+			do_message(ctx, first, window_first - first);
+			first = window_first;
+		}
+	}
+
+	if (window_first > first)
+		do_message(ctx, first, window_first - first);
+
+	uint64_t busy_nsec = monotonic_nsec() - time_start;
+
+	// The ioctl() only returns once the transfer is done
+	ctx->ctx->io_stats.transfers++;
+	ctx->ctx->io_stats.busy_nsec += busy_nsec;
+	ctx->ctx->io_stats.wire_bytes += ctx->ctx->io_stats.bytes - bytes_start;
+	ctx->ctx->io_stats.wire_nsec += busy_nsec;
+}
+
+static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	RetroWavePlatform_LinuxSPI *ctx = userp;
+
+	uint32_t xfer_count = build_segment(ctx, 0, tx_buf, rx_buf, len, data_rate);
+	submit(ctx, xfer_count);
+}
+
+static void io_segments_callback(void *userp, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count) {
+	RetroWavePlatform_LinuxSPI *ctx = userp;
+
+	uint32_t xfer_count = 0;
+
+	for (uint32_t i=0; i<count; i++) {
+		xfer_count = build_segment(ctx, xfer_count, buf + segments[i].offset, NULL, segments[i].len, segments[i].transfer_speed);
+	}
+
+	submit(ctx, xfer_count);
+}
+
+static int read_be32(const char *path, uint32_t *value) {
+	FILE *f = fopen(path, "rb");
+
+	if (!f)
+		return -1;
+
+	uint8_t cell[4];
+	int ret = fread(cell, sizeof(cell), 1, f) == 1 ? 0 : -1;
+
+	fclose(f);
 
-	set_cs(ctx, 1);
+	if (ret == 0)
+		*value = ((uint32_t)cell[0] << 24) | ((uint32_t)cell[1] << 16) | ((uint32_t)cell[2] << 8) | cell[3];
 
-//	set_device_lock(ctx, 0);
+	return ret;
+}
+
+// The /dev/gpiochipN whose device tree node has this phandle, and that node's #gpio-cells.
+// -1 if there's none, or more than one and we can't tell which.
+static int gpiochip_by_phandle(uint32_t phandle, uint32_t *gpio_cells) {
+	DIR *dir = opendir("/sys/bus/gpio/devices");
+
+	if (!dir)
+		return -1;
+
+	struct dirent *de;
+	int ret = -1, found = 0;
+
+	while ((de = readdir(dir))) {
+		unsigned int chip;
+		char pathbuf[320];
+		uint32_t value;
+
+		if (sscanf(de->d_name, "gpiochip%u", &chip) != 1)
+			continue;
+
+		snprintf(pathbuf, sizeof(pathbuf), "/sys/bus/gpio/devices/%s/of_node/phandle", de->d_name);
+
+		if (read_be32(pathbuf, &value)) {
+			snprintf(pathbuf, sizeof(pathbuf), "/sys/bus/gpio/devices/%s/of_node/linux,phandle", de->d_name);
+
+			if (read_be32(pathbuf, &value))
+				continue;
+		}
+
+		if (value != phandle)
+			continue;
+
+		snprintf(pathbuf, sizeof(pathbuf), "/sys/bus/gpio/devices/%s/of_node/#gpio-cells", de->d_name);
+
+		if (read_be32(pathbuf, gpio_cells))
+			continue;
+
+		ret = chip;
+		found++;
+	}
+
+	closedir(dir);
+
+	return found == 1 ? ret : -1;
+}
+
+// True if the controller behind spidevB.C drives its chip select C through cs-gpios on the given chip and line.
+// Anything we can't read for sure counts as false, so a GPIO drives chip select rather than nothing at all.
+static int controller_has_cs_gpio(const char *spi_dev, int cs_gpio_chip, int cs_gpio_line) {
+	unsigned int bus, cs;
+
+	if (sscanf(spi_dev, "/dev/spidev%u.%u", &bus, &cs) != 2)
+		return 0;
+
+	char pathbuf[64];
+	snprintf(pathbuf, sizeof(pathbuf), "/sys/class/spi_master/spi%u/of_node/cs-gpios", bus);
+
+	FILE *f = fopen(pathbuf, "rb");
+
+	if (!f)
+		return 0;
+
+	uint8_t raw[256 * 4];
+	size_t cells_used = fread(raw, 4, 256, f);
+
+	fclose(f);
+
+	uint32_t cells[256];
+
+	for (size_t i=0; i<cells_used; i++)
+		cells[i] = ((uint32_t)raw[i*4] << 24) | ((uint32_t)raw[i*4+1] << 16) | ((uint32_t)raw[i*4+2] << 8) | raw[i*4+3];
+
+	// One entry per chip select, either <0> for a native one or <&gpio specifier...>, whose
+	// length is the #gpio-cells of the node the phandle points to
+	size_t pos = 0;
+
+	for (unsigned int i=0; pos<cells_used; i++) {
+		uint32_t phandle = cells[pos++];
+
+		if (!phandle) {
+			if (i == cs)
+				return 0;
+
+			continue;
+		}
+
+		uint32_t gpio_cells;
+		int chip = gpiochip_by_phandle(phandle, &gpio_cells);
+
+		// Without the length of this entry, the ones after it can't be found either
+		if (chip < 0)
+			return 0;
+
+		if (i == cs) {
+			// With more than <line flags>, turning the specifier into a line is up to the driver
+			if (gpio_cells < 1 || gpio_cells > 2 || pos >= cells_used)
+				return 0;
+
+			return chip == cs_gpio_chip && cells[pos] == (uint32_t)cs_gpio_line;
+		}
+
+		pos += gpio_cells;
+	}
+
+	return 0;
+}
+
+static int request_gpio_line(RetroWavePlatform_LinuxSPI *pctx, int cs_gpio_line) {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+	if (pctx->cs_mode == RetroWave_LinuxSPI_CS_GPIO_V2) {
+		struct gpio_v2_line_request gl_req = {0};
+		gl_req.offsets[0] = cs_gpio_line;
+		gl_req.num_lines = 1;
+		gl_req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+		gl_req.config.num_attrs = 1;
+		gl_req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		gl_req.config.attrs[0].attr.values = 1; // CS should be high if not used
+		gl_req.config.attrs[0].mask = 1;
+		strcpy(gl_req.consumer, "RetroWave SPI CS");
+
+		while (ioctl(pctx->fd_gpiochip, GPIO_V2_GET_LINE_IOCTL, &gl_req)) {
+			if (errno != EBUSY)
+				return -1;
+		}
+
+		pctx->fd_gpioline = gl_req.fd;
+		return 0;
+	}
+#endif
+
+	struct gpiohandle_request gl_req = {0};
+	gl_req.lineoffsets[0] = cs_gpio_line;
+	gl_req.default_values[0] = 1; // CS should be high if not used
+	gl_req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+	gl_req.lines = 1;
+	strcpy(gl_req.consumer_label, "RetroWave SPI CS");
+
+	while (ioctl(pctx->fd_gpiochip, GPIO_GET_LINEHANDLE_IOCTL, &gl_req)) {
+		if (errno != EBUSY)
+			return -1;
+	}
+
+	pctx->fd_gpioline = gl_req.fd;
+	return 0;
+}
+
+int retrowave_linux_spi_set_pm_qos(RetroWaveContext *ctx, int32_t latency_usecs) {
+	RetroWavePlatform_LinuxSPI *pctx = ctx->user_data;
+
+	if (pctx->fd_pm_qos >= 0) {
+		close(pctx->fd_pm_qos);
+		pctx->fd_pm_qos = -1;
+	}
+
+	if (latency_usecs < 0)
+		return 0;
+
+	int fd = open("/dev/cpu_dma_latency", O_WRONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: can't open /dev/cpu_dma_latency: %s, CPU idle states may add latency\n", log_tag, strerror(errno));
+		return -1;
+	}
+
+	if (write(fd, &latency_usecs, sizeof(latency_usecs)) != sizeof(latency_usecs)) {
+		fprintf(stderr, "%s: can't request a %" PRId32 " us CPU latency: %s\n", log_tag, latency_usecs, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	pctx->fd_pm_qos = fd;
+
+	return 0;
 }
 
 int retrowave_init_linux_spi(RetroWaveContext *ctx, const char *spi_dev, int cs_gpio_chip, int cs_gpio_line) {
+	return retrowave_init_linux_spi_cs(ctx, spi_dev, RetroWave_LinuxSPI_CS_Auto, cs_gpio_chip, cs_gpio_line);
+}
+
+int retrowave_init_linux_spi_cs(RetroWaveContext *ctx, const char *spi_dev, RetroWaveLinuxSPICSMode cs_mode, int cs_gpio_chip, int cs_gpio_line) {
 	retrowave_init(ctx);
 
 	ctx->user_data = malloc(sizeof(RetroWavePlatform_LinuxSPI));
 
 	RetroWavePlatform_LinuxSPI *pctx = ctx->user_data;
+	memset(pctx, 0, sizeof(RetroWavePlatform_LinuxSPI));
+
+	pctx->ctx = ctx;
+	pctx->bufsiz = read_spidev_bufsiz();
+	pctx->fd_gpiochip = pctx->fd_gpioline = -1;
+	pctx->fd_pm_qos = -1;
+
+	if (cs_mode == RetroWave_LinuxSPI_CS_Auto) {
+		if (controller_has_cs_gpio(spi_dev, cs_gpio_chip, cs_gpio_line)) {
+			cs_mode = RetroWave_LinuxSPI_CS_Native;
+		} else {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+			cs_mode = RetroWave_LinuxSPI_CS_GPIO_V2;
+#else
+			cs_mode = RetroWave_LinuxSPI_CS_GPIO_V1;
+#endif
+		}
+	}
+
+	pctx->cs_mode = cs_mode;
 
 	// SPI Init
 	pctx->fd_spi = open(spi_dev, O_RDWR);
@@ -130,7 +476,7 @@ int retrowave_init_linux_spi(RetroWaveContext *ctx, const char *spi_dev, int cs_
 		return -1;
 	}
 
-	int spi_mode = SPI_NO_CS;
+	int spi_mode = cs_mode == RetroWave_LinuxSPI_CS_Native ? SPI_MODE_0 : SPI_NO_CS;
 	if (ioctl(pctx->fd_spi, SPI_IOC_WR_MODE32, &spi_mode) < 0) {
 		fprintf(stderr, "%s: failed to set SPI mode 0x%02x: %s\n", log_tag, spi_mode, strerror(errno));
 		free(pctx);
@@ -144,35 +490,38 @@ int retrowave_init_linux_spi(RetroWaveContext *ctx, const char *spi_dev, int cs_
 		return -1;
 	}
 
-	// GPIO Init
-	char pathbuf[24];
-	snprintf(pathbuf, sizeof(pathbuf)-1, "/dev/gpiochip%d", cs_gpio_chip);
-	pctx->fd_gpiochip = open(pathbuf, O_RDWR);
-	if (pctx->fd_gpiochip < 0) {
-		fprintf(stderr, "%s: failed to open GPIO device `%s': %s\n", log_tag, pathbuf, strerror(errno));
-		free(pctx);
-		return -1;
-	}
+	if (cs_mode != RetroWave_LinuxSPI_CS_Native) {
+		// GPIO Init
+		char pathbuf[24];
+		snprintf(pathbuf, sizeof(pathbuf)-1, "/dev/gpiochip%d", cs_gpio_chip);
+		pctx->fd_gpiochip = open(pathbuf, O_RDWR);
+		if (pctx->fd_gpiochip < 0) {
+			fprintf(stderr, "%s: failed to open GPIO device `%s': %s\n", log_tag, pathbuf, strerror(errno));
+			free(pctx);
+			return -1;
+		}
 
-	struct gpiohandle_request gl_req = {0};
-	gl_req.lineoffsets[0] = cs_gpio_line;
-	gl_req.default_values[0] = 1; // CS should be high if not used
-	gl_req.flags = GPIOHANDLE_REQUEST_OUTPUT;
-	gl_req.lines = 1;
-	strcpy(gl_req.consumer_label, "RetroWave SPI CS");
+		int rc = request_gpio_line(pctx, cs_gpio_line);
 
-retry_lock:
-	if (ioctl(pctx->fd_gpiochip, GPIO_GET_LINEHANDLE_IOCTL, &gl_req)) {
-		if (errno == EBUSY) {
-			goto retry_lock;
+		// Kernels older than 5.10 only have the v1 API
+		if (rc && pctx->cs_mode == RetroWave_LinuxSPI_CS_GPIO_V2 && (errno == ENOTTY || errno == EINVAL)) {
+			pctx->cs_mode = RetroWave_LinuxSPI_CS_GPIO_V1;
+			rc = request_gpio_line(pctx, cs_gpio_line);
+		}
+
+		if (rc) {
+			fprintf(stderr, "%s: failed to request GPIO line %d: %s\n", log_tag, cs_gpio_line, strerror(errno));
+			abort();
 		}
-		fprintf(stderr, "%s: failed to request GPIO line %d: %s\n", log_tag, cs_gpio_line, strerror(errno));
-		abort();
 	}
 
-	pctx->fd_gpioline = gl_req.fd;
+	fprintf(stderr, "%s: using %s chip select\n", log_tag, cs_mode_names[pctx->cs_mode]);
 
 	ctx->callback_io = io_callback;
+	ctx->callback_io_segments = io_segments_callback;
+
+	// Not fatal, the transfers just get slower to start
+	retrowave_linux_spi_set_pm_qos(ctx, 0);
 
 	return 0;
 }
@@ -181,9 +530,17 @@ void retrowave_deinit_linux_spi(RetroWaveContext *ctx) {
 	RetroWavePlatform_LinuxSPI *pctx = ctx->user_data;
 
 	close(pctx->fd_spi);
-	close(pctx->fd_gpioline);
-	close(pctx->fd_gpiochip);
 
+	if (pctx->fd_gpioline >= 0)
+		close(pctx->fd_gpioline);
+
+	if (pctx->fd_gpiochip >= 0)
+		close(pctx->fd_gpiochip);
+
+	if (pctx->fd_pm_qos >= 0)
+		close(pctx->fd_pm_qos);
+
+	free(pctx->xfers);
 	free(pctx);
 }
 
@@ -51,11 +51,13 @@
 #include <inttypes.h>
 
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <dirent.h>
 #include <linux/types.h>
 #include <linux/version.h>
 #include <linux/gpio.h>
@@ -67,14 +69,36 @@
 extern "C" {
 #endif
 
+typedef enum {
+	RetroWave_LinuxSPI_CS_Auto = 0,	// Native if the controller drives the given chip and line through cs-gpios, GPIO otherwise
+	RetroWave_LinuxSPI_CS_Native,	// Toggled by the kernel inside the transfer, no extra syscalls
+	RetroWave_LinuxSPI_CS_GPIO_V2,	// GPIO chardev v2 line request
+	RetroWave_LinuxSPI_CS_GPIO_V1,	// Deprecated GPIO chardev v1 line handle
+} RetroWaveLinuxSPICSMode;
+
 typedef struct {
 	int fd_spi, fd_gpiochip;
 	int fd_gpioline;
+	RetroWaveContext *ctx;
+	RetroWaveLinuxSPICSMode cs_mode;
+
+	// spidev refuses messages longer than this
+	uint32_t bufsiz;
+
+	struct spi_ioc_transfer *xfers;
+	uint32_t xfers_size;
+
+	// PM QoS request on /dev/cpu_dma_latency, held for as long as it stays open
+	int fd_pm_qos;
 } RetroWavePlatform_LinuxSPI;
 
 extern int retrowave_init_linux_spi(RetroWaveContext *ctx, const char *spi_dev, int cs_gpio_chip, int cs_gpio_line);
+extern int retrowave_init_linux_spi_cs(RetroWaveContext *ctx, const char *spi_dev, RetroWaveLinuxSPICSMode cs_mode, int cs_gpio_chip, int cs_gpio_line);
 extern void retrowave_deinit_linux_spi(RetroWaveContext *ctx);
 
+// Caps the CPU wakeup latency while the device is open, so idle states don't stretch SPI transfers. Negative to release
+extern int retrowave_linux_spi_set_pm_qos(RetroWaveContext *ctx, int32_t latency_usecs);
+
 #ifdef __cplusplus
 };
 #endif
@@ -112,39 +112,241 @@ static inline void set_device_lock(RetroWavePlatform_POSIXSerialPort *ctx, int v
 	}
 }
 
-static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
-	RetroWavePlatform_POSIXSerialPort *ctx = userp;
+static uint64_t monotonic_msec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	set_device_lock(ctx, 1);
+// Find a /dev/serial/by-id link that points to this tty. It follows the board if it re-enumerates under another name.
+static void find_tty_by_id(RetroWavePlatform_POSIXSerialPort *ctx) {
+	static const char by_id_dir[] = "/dev/serial/by-id";
 
-	uint32_t packed_len = retrowave_protocol_serial_packed_length(len);
+	ctx->tty_path_by_id[0] = 0;
 
-	uint8_t *packed_data;
+	char tty_real[PATH_MAX], link_path[PATH_MAX], link_real[PATH_MAX];
 
-	if (packed_len > 128)
-		packed_data = malloc(packed_len);
-	else
-		packed_data = alloca(packed_len);
+	if (!realpath(ctx->tty_path, tty_real))
+		return;
+
+	DIR *dir = opendir(by_id_dir);
+
+	if (!dir)
+		return;
+
+	struct dirent *ent;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(link_path, sizeof(link_path), "%s/%s", by_id_dir, ent->d_name);
+
+		if (realpath(link_path, link_real) && strcmp(link_real, tty_real) == 0) {
+			strcpy(ctx->tty_path_by_id, link_path);
+			break;
+		}
+	}
+
+	closedir(dir);
+}
+
+static int reconnect(RetroWavePlatform_POSIXSerialPort *ctx) {
+	uint64_t time_start = monotonic_msec();
+	uint32_t backoff_ms = 5, attempts = 0;
+
+	fprintf(stderr, "%s: lost tty device `%s' (%s), trying to reconnect\n", log_tag, ctx->tty_path, strerror(errno));
+
+	close(ctx->fd_tty);
+	ctx->fd_tty = -1;
+
+	while (1) {
+		const char *paths[] = {ctx->tty_path_by_id, ctx->tty_path};
+
+		attempts++;
+
+		for (size_t i=0; i<sizeof(paths)/sizeof(paths[0]) && ctx->fd_tty < 0; i++) {
+			if (!paths[i][0])
+				continue;
+
+			int fd = open(paths[i], O_RDWR);
 
+			if (fd < 0)
+				continue;
 
-	assert(retrowave_protocol_serial_pack(tx_buf, len, packed_data) == packed_len);
+			if (set_tty(fd)) {
+				close(fd);
+				continue;
+			}
 
+			ctx->fd_tty = fd;
+		}
+
+		if (ctx->fd_tty >= 0) {
+			// Replay may fail too if the link flaps, in that case start over
+			ctx->recovering = 1;
+			ctx->recover_failed = 0;
+			retrowave_recover(ctx->ctx);
+			ctx->recovering = 0;
+
+			if (!ctx->recover_failed)
+				break;
+
+			close(ctx->fd_tty);
+			ctx->fd_tty = -1;
+		}
+
+		if (monotonic_msec() - time_start >= ctx->recover_timeout_ms) {
+			fprintf(stderr, "%s: FATAL: failed to reconnect after %" PRIu32 " attempts\n", log_tag, attempts);
+			return -1;
+		}
+
+		usleep(backoff_ms * 1000);
+
+		if (backoff_ms < 500)
+			backoff_ms *= 2;
+	}
+
+	fprintf(stderr, "%s: reconnected after %" PRIu32 " attempts, recovery took %" PRIu64 " ms\n", log_tag, attempts, monotonic_msec() - time_start);
+
+	return 0;
+}
+
+static uint64_t monotonic_nsec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t pack_segments(const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count, uint8_t *packed_data) {
+	uint32_t packed_pos = 0;
+
+	for (uint32_t i=0; i<count; i++) {
+		packed_pos += retrowave_protocol_serial_pack(buf + segments[i].offset, segments[i].len, packed_data + packed_pos);
+	}
+
+	return packed_pos;
+}
+
+static uint32_t packed_segments_length(const RetroWaveSegment *segments, uint32_t count) {
+	uint32_t packed_len = 0;
+
+	for (uint32_t i=0; i<count; i++) {
+		packed_len += retrowave_protocol_serial_packed_length(segments[i].len);
+	}
+
+	return packed_len;
+}
+
+// Only a write into an empty output queue times its own bytes
+static int drain_sample_due(RetroWavePlatform_POSIXSerialPort *ctx) {
+	if (!ctx->drain_interval || ctx->recovering || --ctx->drain_countdown)
+		return 0;
+
+	ctx->drain_countdown = ctx->drain_interval;
+
+#ifdef TIOCOUTQ
+	int queued = 0;
+	return ioctl(ctx->fd_tty, TIOCOUTQ, &queued) == 0 && queued == 0;
+#else
+	return 0;
+#endif
+}
+
+static void write_packed(RetroWavePlatform_POSIXSerialPort *ctx, const uint8_t *packed_data, uint32_t packed_len, uint64_t time_start) {
+	set_device_lock(ctx, 1);
+
+	int drain_sample = drain_sample_due(ctx);
+	uint64_t time_write = monotonic_nsec();
 	size_t written = 0;
 
-	while (written < len) {
+	while (written < packed_len) {
 		ssize_t rc = write(ctx->fd_tty, packed_data + written, packed_len - written);
+		ctx->ctx->io_stats.syscalls++;
+
 		if (rc > 0) {
 			written += rc;
+		} else if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		} else if (ctx->recovering) {
+			ctx->recover_failed = 1;
+			break;
+		} else if (ctx->recover_timeout_ms && reconnect(ctx) == 0) {
+			// The frames are self synchronized, so just send all of them again
+			set_device_lock(ctx, 1);
+			written = 0;
+			drain_sample = 0;
 		} else {
 			fprintf(stderr, "%s: FATAL: failed to write to tty: %s\n", log_tag, strerror(errno));
 			abort();
 		}
 	}
 
+	if (drain_sample && written == packed_len && tcdrain(ctx->fd_tty) == 0) {
+		ctx->ctx->io_stats.wire_bytes += written;
+		ctx->ctx->io_stats.wire_nsec += monotonic_nsec() - time_write;
+	}
+
+	if (!ctx->recover_failed)
+		set_device_lock(ctx, 0);
+
+	ctx->ctx->io_stats.transfers++;
+	ctx->ctx->io_stats.bytes += written;
+	ctx->ctx->io_stats.busy_nsec += monotonic_nsec() - time_start;
+}
+
+// Every segment is packed into its own self synchronized frame, and all of them go out in one write()
+static void io_segments_callback(void *userp, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count) {
+	RetroWavePlatform_POSIXSerialPort *ctx = userp;
+
+	uint64_t time_start = monotonic_nsec();
+
+	uint32_t packed_len = packed_segments_length(segments, count);
+	uint8_t *packed_data;
+
+	if (packed_len > 128)
+		packed_data = malloc(packed_len);
+	else
+		packed_data = alloca(packed_len);
+
+	uint32_t packed_pos = pack_segments(buf, segments, count, packed_data);
+	assert(packed_pos == packed_len);
+
+	write_packed(ctx, packed_data, packed_len, time_start);
+
 	if (packed_len > 128)
 		free(packed_data);
+}
 
-	set_device_lock(ctx, 0);
+static void io_prepare_callback(void *userp, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count) {
+	RetroWavePlatform_POSIXSerialPort *ctx = userp;
+
+	uint32_t packed_len = packed_segments_length(segments, count);
+
+	if (packed_len > ctx->prepared_size) {
+		free(ctx->prepared_data);
+		ctx->prepared_data = malloc(packed_len);
+		ctx->prepared_size = packed_len;
+	}
+
+	ctx->prepared_len = pack_segments(buf, segments, count, ctx->prepared_data);
+	assert(ctx->prepared_len == packed_len);
+}
+
+static void io_prepared_callback(void *userp) {
+	RetroWavePlatform_POSIXSerialPort *ctx = userp;
+
+	write_packed(ctx, ctx->prepared_data, ctx->prepared_len, monotonic_nsec());
+}
+
+// For retrowave_flush_raw(), which takes segments packed one by one with retrowave_protocol_serial_pack()
+static void io_raw_callback(void *userp, const uint8_t *data, uint32_t len) {
+	write_packed(userp, data, len, monotonic_nsec());
+}
+
+static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	RetroWaveSegment segment = {0, len, data_rate};
+	io_segments_callback(userp, tx_buf, &segment, 1);
 }
 
 int retrowave_init_posix_serialport(RetroWaveContext *ctx, const char *tty_path) {
@@ -153,6 +355,9 @@ int retrowave_init_posix_serialport(RetroWaveContext *ctx, const char *tty_path)
 	ctx->user_data = malloc(sizeof(RetroWavePlatform_POSIXSerialPort));
 
 	RetroWavePlatform_POSIXSerialPort *pctx = ctx->user_data;
+	memset(pctx, 0, sizeof(RetroWavePlatform_POSIXSerialPort));
+
+	pctx->ctx = ctx;
 
 	pctx->fd_tty = open(tty_path, O_RDWR);
 	if (pctx->fd_tty < 0) {
@@ -169,14 +374,32 @@ int retrowave_init_posix_serialport(RetroWaveContext *ctx, const char *tty_path)
 #endif
 	}
 
+	snprintf(pctx->tty_path, sizeof(pctx->tty_path), "%s", tty_path);
+	find_tty_by_id(pctx);
+
 	ctx->callback_io = io_callback;
+	ctx->callback_io_segments = io_segments_callback;
+	ctx->callback_io_prepare = io_prepare_callback;
+	ctx->callback_io_prepared = io_prepared_callback;
+	ctx->callback_io_raw = io_raw_callback;
 
 	return 0;
 }
 
+void retrowave_posix_serialport_set_recover_timeout(RetroWaveContext *ctx, uint32_t timeout_ms) {
+	RetroWavePlatform_POSIXSerialPort *pctx = ctx->user_data;
+	pctx->recover_timeout_ms = timeout_ms;
+}
+
+void retrowave_posix_serialport_set_drain_interval(RetroWaveContext *ctx, uint32_t writes) {
+	RetroWavePlatform_POSIXSerialPort *pctx = ctx->user_data;
+	pctx->drain_interval = pctx->drain_countdown = writes;
+}
+
 void retrowave_deinit_posix_serialport(RetroWaveContext *ctx) {
 	RetroWavePlatform_POSIXSerialPort *pctx = ctx->user_data;
 	close(pctx->fd_tty);
+	free(pctx->prepared_data);
 	free(pctx);
 }
 
@@ -54,6 +54,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include <sys/ioctl.h>
 #include <sys/file.h>
@@ -71,11 +74,31 @@ extern "C" {
 
 typedef struct {
 	int fd_tty;
+	RetroWaveContext *ctx;
+
+	// Recovery
+	char tty_path[PATH_MAX], tty_path_by_id[PATH_MAX];
+	uint32_t recover_timeout_ms;
+	int recovering, recover_failed;
+
+	// Frames packed by retrowave_flush_prepare()
+	uint8_t *prepared_data;
+	uint32_t prepared_len, prepared_size;
+
+	// Wire time sampling
+	uint32_t drain_interval, drain_countdown;
 } RetroWavePlatform_POSIXSerialPort;
 
 extern int retrowave_init_posix_serialport(RetroWaveContext *ctx, const char *tty_path);
 extern void retrowave_deinit_posix_serialport(RetroWaveContext *ctx);
 
+// Reopen the tty and replay state when a write fails, instead of aborting. 0 to disable.
+extern void retrowave_posix_serialport_set_recover_timeout(RetroWaveContext *ctx, uint32_t timeout_ms);
+
+// write() returns once the kernel has the bytes. Every this many writes, wait until they're out and
+// count that in io_stats.wire_*, at the cost of that write's wire time in latency. 0 to disable.
+extern void retrowave_posix_serialport_set_drain_interval(RetroWaveContext *ctx, uint32_t writes);
+
 #ifdef __cplusplus
 };
 #endif
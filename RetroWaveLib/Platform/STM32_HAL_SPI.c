@@ -47,6 +47,7 @@
 
 extern void HAL_GPIO_WritePin(void *GPIOx, uint16_t GPIO_Pin, int PinState);
 extern int HAL_SPI_TransmitReceive(void *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout);
+extern int HAL_SPI_Transmit_DMA(void *hspi, uint8_t *pData, uint16_t Size);
 
 static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
 	RetroWavePlatform_STM32_HAL_SPI *ctx = userp;
@@ -58,6 +59,140 @@ static void io_callback(void *userp, uint32_t data_rate, const void *tx_buf, voi
 	HAL_GPIO_WritePin(ctx->cs_gpiox, ctx->cs_gpio_pin, 1);
 }
 
+static void dma_buffer_done(RetroWavePlatform_STM32_HAL_SPI *ctx, RetroWaveSTM32DMABuffer *buf);
+
+static void dma_start_window(RetroWavePlatform_STM32_HAL_SPI *ctx, RetroWaveSTM32DMABuffer *buf) {
+	const RetroWaveSegment *win = &buf->windows[buf->window_cur];
+
+	HAL_GPIO_WritePin(ctx->cs_gpiox, ctx->cs_gpio_pin, 0);
+
+	if (HAL_SPI_Transmit_DMA(ctx->hspi, buf->data + win->offset, win->len) == 0)
+		return;
+
+	// HAL_BUSY or HAL_ERROR: no completion is coming, so the rest of the buffer goes out the blocking way
+	HAL_GPIO_WritePin(ctx->cs_gpiox, ctx->cs_gpio_pin, 1);
+
+	for (; buf->window_cur < buf->windows_used; buf->window_cur++) {
+		win = &buf->windows[buf->window_cur];
+		io_callback(ctx, win->transfer_speed, buf->data + win->offset, NULL, win->len);
+	}
+
+	dma_buffer_done(ctx, buf);
+}
+
+static void dma_start_buffer(RetroWavePlatform_STM32_HAL_SPI *ctx, RetroWaveSTM32DMABuffer *buf) {
+	buf->window_cur = 0;
+	__atomic_store_n(&buf->state, RetroWave_STM32_DMA_Busy, __ATOMIC_SEQ_CST);
+	dma_start_window(ctx, buf);
+}
+
+// Whoever flips dma_active from 0 to 1 owns starting the next buffer, this keeps
+// the submit path and the completion ISR from both starting (or both skipping) it.
+static void dma_kick(RetroWavePlatform_STM32_HAL_SPI *ctx, RetroWaveSTM32DMABuffer *buf) {
+	int idle = 0;
+
+	if (__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST) == RetroWave_STM32_DMA_Queued && __atomic_compare_exchange_n(&ctx->dma_active, &idle, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		dma_start_buffer(ctx, buf);
+}
+
+static void dma_wait_idle(RetroWavePlatform_STM32_HAL_SPI *ctx) {
+	while (__atomic_load_n(&ctx->dma_active, __ATOMIC_SEQ_CST));
+}
+
+static void io_segments_dma_callback(void *userp, const uint8_t *data, const RetroWaveSegment *segments, uint32_t count) {
+	RetroWavePlatform_STM32_HAL_SPI *ctx = userp;
+
+	uint32_t total = 0;
+
+	for (uint32_t i=0; i<count; i++)
+		total += segments[i].len;
+
+	// Doesn't fit a ping-pong buffer, drain and send it the blocking way
+	if (total > ctx->dma_buffer_size || count > RETROWAVE_MAX_SEGMENTS) {
+		dma_wait_idle(ctx);
+
+		for (uint32_t i=0; i<count; i++)
+			io_callback(ctx, segments[i].transfer_speed, data + segments[i].offset, NULL, segments[i].len);
+
+		return;
+	}
+
+	RetroWaveSTM32DMABuffer *buf = &ctx->dma_buffers[ctx->dma_next];
+
+	// Both buffers in flight, wait for the ISR to hand this one back
+	while (__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST) != RetroWave_STM32_DMA_Free);
+
+	uint32_t pos = 0;
+
+	for (uint32_t i=0; i<count; i++) {
+		memcpy(buf->data + pos, data + segments[i].offset, segments[i].len);
+		buf->windows[i].offset = pos;
+		buf->windows[i].len = segments[i].len;
+		buf->windows[i].transfer_speed = segments[i].transfer_speed;
+		pos += segments[i].len;
+	}
+
+	buf->windows_used = count;
+	ctx->dma_next ^= 1;
+
+	__atomic_store_n(&buf->state, RetroWave_STM32_DMA_Queued, __ATOMIC_SEQ_CST);
+	dma_kick(ctx, buf);
+}
+
+static void io_dma_callback(void *userp, uint32_t data_rate, const void *tx_buf, void *rx_buf, uint32_t len) {
+	RetroWavePlatform_STM32_HAL_SPI *ctx = userp;
+
+	// Reads need the data back right away
+	if (rx_buf) {
+		dma_wait_idle(ctx);
+		io_callback(ctx, data_rate, tx_buf, rx_buf, len);
+		return;
+	}
+
+	RetroWaveSegment seg = {0, len, data_rate};
+
+	io_segments_dma_callback(ctx, tx_buf, &seg, 1);
+}
+
+void retrowave_stm32_hal_spi_dma_complete(RetroWaveContext *ctx) {
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx->user_data;
+
+	RetroWaveSTM32DMABuffer *buf = &pctx->dma_buffers[0];
+
+	if (__atomic_load_n(&buf->state, __ATOMIC_SEQ_CST) != RetroWave_STM32_DMA_Busy)
+		buf = &pctx->dma_buffers[1];
+
+	HAL_GPIO_WritePin(pctx->cs_gpiox, pctx->cs_gpio_pin, 1);
+
+	buf->window_cur++;
+
+	if (buf->window_cur < buf->windows_used) {
+		dma_start_window(pctx, buf);
+		return;
+	}
+
+	dma_buffer_done(pctx, buf);
+}
+
+// The buffer is all out: start the other one if it's queued, or go idle
+static void dma_buffer_done(RetroWavePlatform_STM32_HAL_SPI *ctx, RetroWaveSTM32DMABuffer *buf) {
+	__atomic_store_n(&buf->state, RetroWave_STM32_DMA_Free, __ATOMIC_SEQ_CST);
+
+	RetroWaveSTM32DMABuffer *next = buf == &ctx->dma_buffers[0] ? &ctx->dma_buffers[1] : &ctx->dma_buffers[0];
+
+	if (__atomic_load_n(&next->state, __ATOMIC_SEQ_CST) == RetroWave_STM32_DMA_Queued) {
+		dma_start_buffer(ctx, next);
+	} else {
+		__atomic_store_n(&ctx->dma_active, 0, __ATOMIC_SEQ_CST);
+		// The other buffer may have been queued after the check above
+		dma_kick(ctx, next);
+	}
+}
+
+void retrowave_stm32_hal_spi_dma_wait(RetroWaveContext *ctx) {
+	dma_wait_idle(ctx->user_data);
+}
+
 int retrowave_init_stm32_hal_spi(RetroWaveContext *ctx, void *hspi, void *cs_gpiox, uint16_t cs_gpio_pin) {
 	retrowave_init(ctx);
 
@@ -65,6 +200,8 @@ int retrowave_init_stm32_hal_spi(RetroWaveContext *ctx, void *hspi, void *cs_gpi
 
 	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx->user_data;
 
+	memset(pctx, 0, sizeof(RetroWavePlatform_STM32_HAL_SPI));
+
 	pctx->hspi = hspi;
 	pctx->cs_gpiox = cs_gpiox;
 	pctx->cs_gpio_pin = cs_gpio_pin;
@@ -76,7 +213,36 @@ int retrowave_init_stm32_hal_spi(RetroWaveContext *ctx, void *hspi, void *cs_gpi
 	return 0;
 }
 
+int retrowave_init_stm32_hal_spi_dma(RetroWaveContext *ctx, void *hspi, void *cs_gpiox, uint16_t cs_gpio_pin, uint32_t buffer_size) {
+	retrowave_init_stm32_hal_spi(ctx, hspi, cs_gpiox, cs_gpio_pin);
+
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx->user_data;
+
+	for (int i=0; i<2; i++) {
+		pctx->dma_buffers[i].data = malloc(buffer_size);
+
+		if (!pctx->dma_buffers[i].data) {
+			retrowave_deinit_stm32_hal_spi(ctx);
+			return -1;
+		}
+	}
+
+	pctx->dma_buffer_size = buffer_size;
+
+	ctx->callback_io = io_dma_callback;
+	ctx->callback_io_segments = io_segments_dma_callback;
+
+	return 0;
+}
+
 void retrowave_deinit_stm32_hal_spi(RetroWaveContext *ctx) {
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx->user_data;
+
+	dma_wait_idle(pctx);
+
+	for (int i=0; i<2; i++)
+		free(pctx->dma_buffers[i].data);
+
 	free(ctx->user_data);
 }
-#endif
\ No newline at end of file
+#endif
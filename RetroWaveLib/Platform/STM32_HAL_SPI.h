@@ -55,13 +55,42 @@
 extern "C" {
 #endif
 
+enum RetroWaveSTM32DMABufferState {
+	RetroWave_STM32_DMA_Free = 0,
+	RetroWave_STM32_DMA_Queued,
+	RetroWave_STM32_DMA_Busy,
+};
+
+typedef struct {
+	uint8_t *data;
+	RetroWaveSegment windows[RETROWAVE_MAX_SEGMENTS];
+	uint32_t windows_used;
+	uint32_t window_cur;
+	volatile int state;
+} RetroWaveSTM32DMABuffer;
+
 typedef struct {
 	void *hspi;
 	void *cs_gpiox;
 	uint16_t cs_gpio_pin;
+
+	// DMA mode only
+	uint32_t dma_buffer_size;
+	RetroWaveSTM32DMABuffer dma_buffers[2];
+	uint8_t dma_next;
+	volatile int dma_active;
 } RetroWavePlatform_STM32_HAL_SPI;
 
 extern int retrowave_init_stm32_hal_spi(RetroWaveContext *ctx, void *hspi, void *cs_gpiox, uint16_t cs_gpio_pin);
+
+// Sends with HAL_SPI_Transmit_DMA from two ping-pong buffers of buffer_size bytes each,
+// so the caller can queue the next frame while the current one is clocked out.
+// retrowave_stm32_hal_spi_dma_complete() must be called from HAL_SPI_TxCpltCallback().
+extern int retrowave_init_stm32_hal_spi_dma(RetroWaveContext *ctx, void *hspi, void *cs_gpiox, uint16_t cs_gpio_pin, uint32_t buffer_size);
+extern void retrowave_stm32_hal_spi_dma_complete(RetroWaveContext *ctx);
+// Blocks until all queued transfers are out
+extern void retrowave_stm32_hal_spi_dma_wait(RetroWaveContext *ctx);
+
 extern void retrowave_deinit_stm32_hal_spi(RetroWaveContext *ctx);
 
 #ifdef __cplusplus
@@ -46,7 +46,9 @@
 
 void retrowave_init(RetroWaveContext *ctx) {
 	memset(ctx, 0, sizeof(RetroWaveContext));
-	ctx->cmd_buffer = malloc(8192);
+	memset(ctx->chip_state.sn76489_att, 0xf, sizeof(ctx->chip_state.sn76489_att));
+	ctx->cmd_buffer_size = 8192;
+	ctx->cmd_buffer = malloc(ctx->cmd_buffer_size);
 }
 
 void retrowave_deinit(RetroWaveContext *ctx) {
@@ -89,31 +91,229 @@ void retrowave_io_init(RetroWaveContext *ctx) {
 	}
 }
 
+void retrowave_recover(RetroWaveContext *ctx) {
+	retrowave_io_init(ctx);
+
+	if (!ctx->callback_recover)
+		return;
+
+	// The command buffer may be in flight when the link drops, so replay through a scratch one
+	uint8_t *cmd_buffer = ctx->cmd_buffer;
+	uint32_t cmd_buffer_used = ctx->cmd_buffer_used;
+	uint32_t transfer_speed_hint = ctx->transfer_speed_hint;
+	uint32_t segments_used = ctx->segments_used, segment_start = ctx->segment_start;
+	int prepared = ctx->prepared;
+	RetroWaveSegment segments[RETROWAVE_MAX_SEGMENTS];
+
+	memcpy(segments, ctx->segments, sizeof(segments));
+
+	ctx->cmd_buffer = malloc(ctx->cmd_buffer_size);
+	ctx->cmd_buffer_used = 0;
+	ctx->segments_used = 0;
+	ctx->segment_start = 0;
+	ctx->prepared = 0;
+
+	ctx->callback_recover(ctx->recover_user_data);
+	retrowave_flush(ctx);
+
+	free(ctx->cmd_buffer);
+
+	ctx->cmd_buffer = cmd_buffer;
+	ctx->cmd_buffer_used = cmd_buffer_used;
+	ctx->transfer_speed_hint = transfer_speed_hint;
+	ctx->segments_used = segments_used;
+	ctx->segment_start = segment_start;
+	ctx->prepared = prepared;
+	memcpy(ctx->segments, segments, sizeof(segments));
+}
+
+void retrowave_set_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t speed) {
+	ctx->board_transfer_speed[(board_type >> 1) & 0x7] = speed;
+}
+
+uint32_t retrowave_get_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t default_speed) {
+	uint32_t ret = ctx->board_transfer_speed[(board_type >> 1) & 0x7];
+	return ret ? ret : default_speed;
+}
+
+static void mcp23s17_write(RetroWaveContext *ctx, uint8_t addr, uint32_t speed, uint8_t reg, const uint8_t val[2]) {
+	uint8_t buf[] = {addr, reg, val[0], val[1]};
+	ctx->callback_io(ctx->user_data, speed, buf, NULL, sizeof(buf));
+}
+
+static void mcp23s17_read(RetroWaveContext *ctx, uint8_t addr, uint32_t speed, uint8_t reg, uint8_t val[2]) {
+	uint8_t buf[] = {addr | 1, reg, 0, 0};
+	uint8_t rx_buf[sizeof(buf)] = {0};
+	ctx->callback_io(ctx->user_data, speed, buf, rx_buf, sizeof(buf));
+	val[0] = rx_buf[2];
+	val[1] = rx_buf[3];
+}
+
+static int mcp23s17_verify(RetroWaveContext *ctx, uint8_t addr, uint32_t speed, uint8_t reg, const uint8_t val[2]) {
+	uint8_t readback[2];
+
+	mcp23s17_write(ctx, addr, speed, reg, val);
+	mcp23s17_read(ctx, addr, speed, reg, readback);
+
+	return readback[0] == val[0] && readback[1] == val[1];
+}
+
+uint32_t retrowave_calibrate_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t speed_min, uint32_t speed_max, uint32_t speed_step) {
+	// IPOL only matters for inputs, so test patterns there don't disturb the sound chip bus
+	static const uint8_t patterns[][2] = {{0x55, 0xaa}, {0xaa, 0x55}, {0x00, 0xff}, {0xff, 0x00}, {0x0f, 0xf0}, {0xf0, 0x0f}};
+	static const uint8_t all_output[2] = {0x00, 0x00};
+	const int rounds = 16;
+
+	uint8_t addr = board_type;
+	uint8_t olat[2];
+
+	// IODIR and OLAT get their current values written back, which is a no-op on the pins
+	mcp23s17_read(ctx, addr, speed_min, 0x14, olat);
+
+	uint32_t speed_good = 0;
+
+	for (uint32_t speed = speed_min; speed <= speed_max; speed += speed_step) {
+		int ok = 1;
+
+		for (int i=0; i<rounds && ok; i++) {
+			for (size_t j=0; j<sizeof(patterns)/sizeof(patterns[0]) && ok; j++) {
+				ok = mcp23s17_verify(ctx, addr, speed, 0x02, patterns[j]);
+			}
+
+			ok = ok && mcp23s17_verify(ctx, addr, speed, 0x00, all_output);
+			ok = ok && mcp23s17_verify(ctx, addr, speed, 0x14, olat);
+		}
+
+		if (!ok)
+			break;
+
+		speed_good = speed;
+	}
+
+	// Writes at the speed that failed may have landed wrong, so put everything back at a known good one
+	static const uint8_t ipol_default[2] = {0x00, 0x00};
+	mcp23s17_write(ctx, addr, speed_min, 0x02, ipol_default);
+	mcp23s17_write(ctx, addr, speed_min, 0x00, all_output);
+	mcp23s17_write(ctx, addr, speed_min, 0x14, olat);
+
+	if (!speed_good)
+		return 0;
+
+	// 20% below the fastest clean speed, for temperature and cable drift
+	uint32_t ret = speed_good - speed_good / 5;
+	return ret < speed_min ? speed_min : ret;
+}
+
+static inline void cmd_buffer_segment_close(RetroWaveContext *ctx) {
+	RetroWaveSegment *seg = &ctx->segments[ctx->segments_used];
+
+	seg->offset = ctx->segment_start;
+	seg->len = ctx->cmd_buffer_used - ctx->segment_start;
+	seg->transfer_speed = ctx->transfer_speed_hint;
+
+	ctx->segments_used++;
+	ctx->segment_start = ctx->cmd_buffer_used;
+}
+
 void retrowave_cmd_buffer_init(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint8_t first_reg) {
+	ctx->prepared = 0;
+
+	// 16 bytes is more than any single register write takes
+	if (ctx->cmd_buffer_used + 16 > ctx->cmd_buffer_size) {
+		retrowave_flush(ctx);
+	}
+
 	if (ctx->cmd_buffer_used) {
-		if (ctx->cmd_buffer[0] != board_type) {
-			retrowave_flush(ctx);
+		if (ctx->cmd_buffer[ctx->segment_start] != board_type) {
+			// Boards can share one transfer if the platform knows how to toggle chip select in between
+			if (ctx->callback_io_segments && ctx->segments_used + 1 < RETROWAVE_MAX_SEGMENTS) {
+				cmd_buffer_segment_close(ctx);
+			} else {
+				retrowave_flush(ctx);
+			}
 		}
 	}
 
-	if (!ctx->cmd_buffer_used) {
-		ctx->cmd_buffer[0] = board_type;
-		ctx->cmd_buffer[1] = first_reg;
-		ctx->cmd_buffer_used = 2;
+	if (ctx->cmd_buffer_used == ctx->segment_start) {
+		ctx->cmd_buffer[ctx->cmd_buffer_used] = board_type;
+		ctx->cmd_buffer[ctx->cmd_buffer_used + 1] = first_reg;
+		ctx->cmd_buffer_used += 2;
 	}
 }
 
 static inline void cmd_buffer_deinit(RetroWaveContext *ctx) {
+	ctx->prepared = 0;
 	ctx->cmd_buffer_used = 0;
+	ctx->segments_used = 0;
+	ctx->segment_start = 0;
+}
+
+void retrowave_flush_prepare(RetroWaveContext *ctx) {
+	if (!ctx->cmd_buffer_used || !ctx->callback_io_prepare || ctx->prepared)
+		return;
+
+	// More commands may still be queued, so the open segment is only closed in a copy
+	RetroWaveSegment segments[RETROWAVE_MAX_SEGMENTS];
+	uint32_t count = ctx->segments_used;
+
+	memcpy(segments, ctx->segments, sizeof(RetroWaveSegment) * count);
+
+	segments[count].offset = ctx->segment_start;
+	segments[count].len = ctx->cmd_buffer_used - ctx->segment_start;
+	segments[count].transfer_speed = ctx->transfer_speed_hint;
+	count++;
+
+	ctx->callback_io_prepare(ctx->user_data, ctx->cmd_buffer, segments, count);
+	ctx->prepared = 1;
 }
 
 void retrowave_flush(RetroWaveContext *ctx) {
-	if (ctx->cmd_buffer_used) {
-		ctx->callback_io(ctx->user_data, ctx->transfer_speed_hint, ctx->cmd_buffer, NULL, ctx->cmd_buffer_used);
+	if (ctx->prepared) {
+		ctx->callback_io_prepared(ctx->user_data);
+		cmd_buffer_deinit(ctx);
+	} else if (ctx->cmd_buffer_used) {
+		cmd_buffer_segment_close(ctx);
+
+		if (ctx->callback_io_segments) {
+			ctx->callback_io_segments(ctx->user_data, ctx->cmd_buffer, ctx->segments, ctx->segments_used);
+		} else {
+			for (uint32_t i=0; i<ctx->segments_used; i++) {
+				RetroWaveSegment *seg = &ctx->segments[i];
+				ctx->callback_io(ctx->user_data, seg->transfer_speed, ctx->cmd_buffer + seg->offset, NULL, seg->len);
+			}
+		}
+
 		cmd_buffer_deinit(ctx);
 	}
 }
 
+void retrowave_flush_segments(RetroWaveContext *ctx, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count) {
+	retrowave_flush(ctx);
+
+	if (!count)
+		return;
+
+	if (ctx->callback_io_segments) {
+		ctx->callback_io_segments(ctx->user_data, buf, segments, count);
+	} else {
+		for (uint32_t i=0; i<count; i++) {
+			ctx->callback_io(ctx->user_data, segments[i].transfer_speed, buf + segments[i].offset, NULL, segments[i].len);
+		}
+	}
+}
+
+int retrowave_flush_raw(RetroWaveContext *ctx, const uint8_t *data, uint32_t len) {
+	if (!ctx->callback_io_raw)
+		return -1;
+
+	retrowave_flush(ctx);
+
+	if (len)
+		ctx->callback_io_raw(ctx->user_data, data, len);
+
+	return 0;
+}
+
 uint8_t retrowave_invert_byte(uint8_t val) {
 	uint8_t ret;
 
@@ -60,22 +60,78 @@ typedef enum {
 	RetroWave_Board_MasterGear = 0x24 << 1
 } RetroWaveBoardType;
 
+#define RETROWAVE_MAX_SEGMENTS		16
+
+// One board's run of commands in the command buffer, sent in its own chip select window
+typedef struct {
+	uint32_t offset, len;
+	uint32_t transfer_speed;
+} RetroWaveSegment;
+
+typedef struct {
+	uint64_t transfers;	// Calls into the platform
+	uint64_t syscalls;	// ioctl()/write() calls made by the platform
+	uint64_t bytes;		// Bytes put on the wire
+	uint64_t busy_nsec;	// Time spent inside the platform
+	// Bytes timed until they were out on the wire, and that time. Platforms whose writes return
+	// before that only time some of them, others none at all
+	uint64_t wire_bytes;
+	uint64_t wire_nsec;
+} RetroWaveIOStats;
+
+// Registers seen by the board drivers, so a mute only has to touch the voices that are sounding
+typedef struct {
+	uint8_t opl3_bx[2][9];		// 0xB0-0xB8, key-on is bit 5
+	uint8_t opl3_bd;		// Rhythm key-ons are bits 0-4
+	uint8_t ym2413_rhythm;		// 0x0E
+	uint8_t ym2413_key[9];		// 0x20-0x28, key-on is bit 4
+	uint8_t ym2413_vol[9];		// 0x30-0x38, volume is bits 0-3
+	uint8_t sn76489_latch[2];	// Left, right
+	uint8_t sn76489_att[2][4];
+} RetroWaveChipState;
+
 typedef struct {
 	void *user_data;
 	void (*callback_io)(void *, uint32_t, const void *, void *, uint32_t);
+	void (*callback_io_segments)(void *, const uint8_t *, const RetroWaveSegment *, uint32_t);
+	// Optional: encode the queued segments for the wire ahead of time, then send what was encoded
+	void (*callback_io_prepare)(void *, const uint8_t *, const RetroWaveSegment *, uint32_t);
+	void (*callback_io_prepared)(void *);
+	int prepared;
+	// Optional: send bytes that are already in the platform's own wire format
+	void (*callback_io_raw)(void *, const uint8_t *, uint32_t);
 	uint8_t *cmd_buffer;
 	uint32_t cmd_buffer_used, cmd_buffer_size;
 	uint32_t transfer_speed_hint;
+	uint32_t board_transfer_speed[8];	// Calibrated speed by MCP23S17 address, 0 for the board default
+	RetroWaveSegment segments[RETROWAVE_MAX_SEGMENTS];
+	uint32_t segments_used, segment_start;
+	RetroWaveIOStats io_stats;
+	RetroWaveChipState chip_state;
+	void *recover_user_data;
+	void (*callback_recover)(void *);
 } RetroWaveContext;
 
 extern void retrowave_init(RetroWaveContext *ctx);
 extern void retrowave_deinit(RetroWaveContext *ctx);
 
 extern void retrowave_io_init(RetroWaveContext *ctx);
+extern void retrowave_recover(RetroWaveContext *ctx);
+
+extern void retrowave_set_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t speed);
+extern uint32_t retrowave_get_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t default_speed);
+extern uint32_t retrowave_calibrate_transfer_speed(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint32_t speed_min, uint32_t speed_max, uint32_t speed_step);
 
 extern void retrowave_cmd_buffer_init(RetroWaveContext *ctx, RetroWaveBoardType board_type, uint8_t first_reg);
 
 extern void retrowave_flush(RetroWaveContext *ctx);
+// Lets the platform encode the queued commands now, so the next retrowave_flush() only has to send them
+extern void retrowave_flush_prepare(RetroWaveContext *ctx);
+
+// Send commands encoded earlier, e.g. from a cache, as one flush of them would. Anything queued goes first
+extern void retrowave_flush_segments(RetroWaveContext *ctx, const uint8_t *buf, const RetroWaveSegment *segments, uint32_t count);
+// Same for bytes already packed for the platform's wire, -1 if the platform doesn't take them
+extern int retrowave_flush_raw(RetroWaveContext *ctx, const uint8_t *data, uint32_t len);
 
 extern uint8_t retrowave_invert_byte(uint8_t val);
 
@@ -0,0 +1,285 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "STM32_HAL.h"
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t dma_thread;
+	int stop;
+
+	void (*tx_complete)(void *);
+	void *tx_complete_arg;
+
+	uint32_t nsec_per_byte, nsec_jitter_max;
+	int manual;
+	uint32_t fail_dma_starts;
+	uint32_t rand_state;
+
+	int cs;
+	int dma_busy;
+	const uint8_t *dma_data;
+	uint32_t dma_len;
+
+	MockHALLog log;
+} mock;
+
+static void mock_error(const char *what) {
+	printf("mock HAL: %s\n", what);
+	mock.log.errors++;
+}
+
+static void transfer_append(const uint8_t *data, uint32_t len, int dma) {
+	MockHALTransfer *t = &mock.log.transfers[mock.log.transfers_used - 1];
+
+	t->data = realloc(t->data, t->len + len);
+	memcpy(t->data + t->len, data, len);
+	t->len += len;
+
+	if (dma)
+		t->dma_len += len;
+}
+
+static void *dma_thread(void *arg) {
+	pthread_mutex_lock(&mock.lock);
+
+	while (1) {
+		while ((!mock.dma_busy || mock.manual) && !mock.stop)
+			pthread_cond_wait(&mock.cond, &mock.lock);
+
+		if (mock.stop)
+			break;
+
+		uint64_t nsec = (uint64_t)mock.dma_len * mock.nsec_per_byte;
+
+		if (mock.nsec_jitter_max) {
+			mock.rand_state = mock.rand_state * 1103515245 + 12345;
+			nsec += (mock.rand_state >> 8) % mock.nsec_jitter_max;
+		}
+
+		pthread_mutex_unlock(&mock.lock);
+
+		if (nsec) {
+			struct timespec ts = {nsec / 1000000000, nsec % 1000000000};
+			nanosleep(&ts, NULL);
+		}
+
+		pthread_mutex_lock(&mock.lock);
+
+		// Like the real controller, the buffer is read while it's clocked out, not when it's handed over
+		transfer_append(mock.dma_data, mock.dma_len, 1);
+		mock.dma_busy = 0;
+
+		pthread_mutex_unlock(&mock.lock);
+		mock.tx_complete(mock.tx_complete_arg);
+		pthread_mutex_lock(&mock.lock);
+	}
+
+	pthread_mutex_unlock(&mock.lock);
+
+	return NULL;
+}
+
+void HAL_GPIO_WritePin(void *GPIOx, uint16_t GPIO_Pin, int PinState) {
+	pthread_mutex_lock(&mock.lock);
+
+	if (PinState == mock.cs) {
+		mock_error(PinState ? "chip select released twice" : "chip select asserted twice");
+	} else if (!PinState) {
+		mock.log.transfers = realloc(mock.log.transfers, sizeof(MockHALTransfer) * (mock.log.transfers_used + 1));
+		memset(&mock.log.transfers[mock.log.transfers_used], 0, sizeof(MockHALTransfer));
+		mock.log.transfers_used++;
+	} else if (mock.dma_busy) {
+		mock_error("chip select released during a DMA transfer");
+	} else if (mock.log.transfers_used && !mock.log.transfers[mock.log.transfers_used - 1].len) {
+		// The chips ignore a select with no clocks, so it doesn't count as a transfer
+		mock.log.transfers_used--;
+		mock.log.empty_selects++;
+	}
+
+	mock.cs = PinState;
+
+	pthread_mutex_unlock(&mock.lock);
+}
+
+int HAL_SPI_TransmitReceive(void *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout) {
+	pthread_mutex_lock(&mock.lock);
+
+	mock.log.blocking_calls++;
+
+	if (mock.cs)
+		mock_error("blocking transfer without chip select");
+	else if (mock.dma_busy)
+		mock_error("blocking transfer during a DMA transfer");
+	else
+		transfer_append(pTxData, Size, 0);
+
+	// Reads come back as written, like a register that holds its value
+	if (pRxData)
+		memcpy(pRxData, pTxData, Size);
+
+	pthread_mutex_unlock(&mock.lock);
+
+	return 0;
+}
+
+int HAL_SPI_Transmit_DMA(void *hspi, uint8_t *pData, uint16_t Size) {
+	pthread_mutex_lock(&mock.lock);
+
+	if (mock.fail_dma_starts) {
+		mock.fail_dma_starts--;
+		mock.log.dma_failed++;
+		pthread_mutex_unlock(&mock.lock);
+		return 2;	// HAL_BUSY
+	}
+
+	if (mock.cs) {
+		mock_error("DMA transfer without chip select");
+	} else if (mock.dma_busy) {
+		mock_error("DMA transfer started during another one");
+	} else {
+		mock.log.dma_starts++;
+		mock.dma_data = pData;
+		mock.dma_len = Size;
+		mock.dma_busy = 1;
+		pthread_cond_signal(&mock.cond);
+	}
+
+	pthread_mutex_unlock(&mock.lock);
+
+	return 0;
+}
+
+void mock_hal_init(void (*tx_complete)(void *), void *tx_complete_arg) {
+	memset(&mock, 0, sizeof(mock));
+
+	pthread_mutex_init(&mock.lock, NULL);
+	pthread_cond_init(&mock.cond, NULL);
+
+	mock.tx_complete = tx_complete;
+	mock.tx_complete_arg = tx_complete_arg;
+	mock.rand_state = 1;
+	mock.cs = -1;	// Until the platform sets it
+
+	pthread_create(&mock.dma_thread, NULL, dma_thread, NULL);
+}
+
+void mock_hal_deinit() {
+	pthread_mutex_lock(&mock.lock);
+	mock.stop = 1;
+	pthread_cond_signal(&mock.cond);
+	pthread_mutex_unlock(&mock.lock);
+
+	pthread_join(mock.dma_thread, NULL);
+
+	mock_hal_log_clear();
+
+	pthread_cond_destroy(&mock.cond);
+	pthread_mutex_destroy(&mock.lock);
+}
+
+void mock_hal_set_timing(uint32_t nsec_per_byte, uint32_t nsec_jitter_max) {
+	pthread_mutex_lock(&mock.lock);
+	mock.nsec_per_byte = nsec_per_byte;
+	mock.nsec_jitter_max = nsec_jitter_max;
+	pthread_mutex_unlock(&mock.lock);
+}
+
+void mock_hal_set_manual(int manual) {
+	pthread_mutex_lock(&mock.lock);
+	mock.manual = manual;
+	pthread_mutex_unlock(&mock.lock);
+}
+
+void mock_hal_fail_dma_starts(uint32_t count) {
+	pthread_mutex_lock(&mock.lock);
+	mock.fail_dma_starts = count;
+	pthread_mutex_unlock(&mock.lock);
+}
+
+void mock_hal_dma_complete() {
+	pthread_mutex_lock(&mock.lock);
+
+	if (!mock.dma_busy) {
+		mock_error("completion without a DMA transfer");
+		pthread_mutex_unlock(&mock.lock);
+		return;
+	}
+
+	transfer_append(mock.dma_data, mock.dma_len, 1);
+	mock.dma_busy = 0;
+
+	pthread_mutex_unlock(&mock.lock);
+	mock.tx_complete(mock.tx_complete_arg);
+}
+
+int mock_hal_dma_busy() {
+	pthread_mutex_lock(&mock.lock);
+	int ret = mock.dma_busy;
+	pthread_mutex_unlock(&mock.lock);
+
+	return ret;
+}
+
+const MockHALLog *mock_hal_log() {
+	return &mock.log;
+}
+
+void mock_hal_log_clear() {
+	pthread_mutex_lock(&mock.lock);
+
+	for (size_t i=0; i<mock.log.transfers_used; i++)
+		free(mock.log.transfers[i].data);
+
+	free(mock.log.transfers);
+	memset(&mock.log, 0, sizeof(mock.log));
+
+	pthread_mutex_unlock(&mock.lock);
+}
@@ -0,0 +1,97 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#pragma once
+
+// A stand-in for the bits of the STM32 HAL the SPI platform uses, so it can run on a PC.
+// DMA transfers are clocked out by a thread standing in for the controller, which reads
+// the buffer only when the transfer completes and then calls the completion "ISR".
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What went out between one chip select assertion and its release
+typedef struct {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t dma_len;	// Part of it that went out through DMA
+} MockHALTransfer;
+
+typedef struct {
+	MockHALTransfer *transfers;
+	size_t transfers_used;
+
+	size_t dma_starts;
+	size_t dma_failed;	// Starts turned down by mock_hal_fail_dma_starts()
+	size_t empty_selects;	// Chip select pulses with nothing sent, not kept in transfers
+	size_t blocking_calls;
+	size_t errors;		// Protocol violations, each also printed
+} MockHALLog;
+
+// tx_complete is what HAL_SPI_TxCpltCallback() would call
+extern void mock_hal_init(void (*tx_complete)(void *), void *tx_complete_arg);
+extern void mock_hal_deinit();
+
+// Time the controller takes per byte and a random extra per transfer, 0 completes right away
+extern void mock_hal_set_timing(uint32_t nsec_per_byte, uint32_t nsec_jitter_max);
+
+// Leaves DMA transfers hanging until mock_hal_dma_complete() finishes them, in the calling thread
+extern void mock_hal_set_manual(int manual);
+extern void mock_hal_dma_complete();
+
+// Turns down the next count DMA starts with HAL_BUSY, like a controller that's still tied up
+extern void mock_hal_fail_dma_starts(uint32_t count);
+
+// Whether a DMA transfer is being clocked out right now
+extern int mock_hal_dma_busy();
+
+extern const MockHALLog *mock_hal_log();
+extern void mock_hal_log_clear();
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,387 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+// Runs the STM32 HAL SPI platform against the mock HAL: the DMA ping-pong path has to put
+// the same chip select windows on the bus as the blocking one, whatever the DMA timing.
+
+#include <unistd.h>
+
+#include "../RetroWaveLib/RetroWave.h"
+#include "../RetroWaveLib/Board/OPL3.h"
+#include "../RetroWaveLib/Board/MiniBlaster.h"
+#include "../RetroWaveLib/Board/MasterGear.h"
+#include "../RetroWaveLib/Platform/STM32_HAL_SPI.h"
+
+#include "Mock/STM32_HAL.h"
+#include "Check.h"
+
+static RetroWaveContext ctx;
+
+typedef struct {
+	size_t frames;
+	size_t returned_early;	// Flushes that came back while DMA was still going
+	size_t both_buffers;	// Flushes that left both ping-pong buffers taken
+} WorkloadStats;
+
+static uint32_t rand_next(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+static void tx_complete(void *arg) {
+	retrowave_stm32_hal_spi_dma_complete(arg);
+}
+
+// Frames of writes to all boards, some bigger than a DMA buffer, with a register read now and then
+static WorkloadStats workload(uint32_t seed) {
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx.user_data;
+	WorkloadStats st = {0};
+	uint32_t r = seed;
+
+	retrowave_io_init(&ctx);
+
+	for (size_t frame=0; frame<2000; frame++) {
+		uint32_t writes = frame % 50 == 49 ? 400 : rand_next(&r) % 40;
+
+		for (uint32_t i=0; i<writes; i++) {
+			uint8_t reg = rand_next(&r), val = rand_next(&r);
+
+			switch (rand_next(&r) % 5) {
+				case 0:
+					retrowave_opl3_queue_port0(&ctx, reg, val);
+					break;
+				case 1:
+					retrowave_opl3_queue_port1(&ctx, reg, val);
+					break;
+				case 2:
+					retrowave_miniblaster_queue(&ctx, reg & 0x1f, val);
+					break;
+				case 3:
+					retrowave_mastergear_queue_ym2413(&ctx, reg & 0x3f, val);
+					break;
+				default:
+					retrowave_mastergear_queue_sn76489(&ctx, val);
+					break;
+			}
+		}
+
+		retrowave_flush(&ctx);
+		st.frames++;
+
+		if (pctx->dma_buffer_size) {
+			if (__atomic_load_n(&pctx->dma_active, __ATOMIC_SEQ_CST))
+				st.returned_early++;
+
+			if (__atomic_load_n(&pctx->dma_buffers[0].state, __ATOMIC_SEQ_CST) != RetroWave_STM32_DMA_Free &&
+			    __atomic_load_n(&pctx->dma_buffers[1].state, __ATOMIC_SEQ_CST) != RetroWave_STM32_DMA_Free)
+				st.both_buffers++;
+		}
+
+		if (frame % 97 == 0) {
+			uint8_t tx[4] = {RetroWave_Board_OPL3 | 1, 0x14, frame, frame >> 8};
+			uint8_t rx[4] = {0};
+
+			ctx.callback_io(ctx.user_data, 1000000, tx, rx, sizeof(tx));
+			CHECK(memcmp(tx, rx, sizeof(tx)) == 0, "read in frame %zu came back wrong", frame);
+		}
+	}
+
+	if (pctx->dma_buffer_size)
+		retrowave_stm32_hal_spi_dma_wait(&ctx);
+
+	return st;
+}
+
+static MockHALLog log_copy(const MockHALLog *log) {
+	MockHALLog ret = *log;
+
+	ret.transfers = malloc(sizeof(MockHALTransfer) * log->transfers_used);
+
+	for (size_t i=0; i<log->transfers_used; i++) {
+		ret.transfers[i] = log->transfers[i];
+		ret.transfers[i].data = malloc(log->transfers[i].len);
+		memcpy(ret.transfers[i].data, log->transfers[i].data, log->transfers[i].len);
+	}
+
+	return ret;
+}
+
+static MockHALLog run_blocking(uint32_t seed) {
+	mock_hal_init(tx_complete, &ctx);
+	retrowave_init_stm32_hal_spi(&ctx, NULL, NULL, 0);
+
+	workload(seed);
+
+	const MockHALLog *log = mock_hal_log();
+
+	CHECK(log->errors == 0, "blocking: %zu bus errors", log->errors);
+	CHECK(log->dma_starts == 0, "blocking: %zu DMA transfers", log->dma_starts);
+	CHECK(log->transfers_used > 2000, "blocking: only %zu transfers", log->transfers_used);
+
+	MockHALLog ret = log_copy(log);
+
+	retrowave_deinit_stm32_hal_spi(&ctx);
+	retrowave_deinit(&ctx);
+	mock_hal_deinit();
+
+	return ret;
+}
+
+static void run_dma(const MockHALLog *ref, uint32_t seed, uint32_t nsec_per_byte, uint32_t nsec_jitter_max, int expect_overlap) {
+	printf("DMA, %u ns/byte, up to %u ns jitter\n", nsec_per_byte, nsec_jitter_max);
+
+	mock_hal_init(tx_complete, &ctx);
+	mock_hal_set_timing(nsec_per_byte, nsec_jitter_max);
+
+	CHECK(retrowave_init_stm32_hal_spi_dma(&ctx, NULL, NULL, 0, 512) == 0, "init failed");
+
+	WorkloadStats st = workload(seed);
+
+	CHECK(!mock_hal_dma_busy(), "DMA still busy after retrowave_stm32_hal_spi_dma_wait()");
+
+	const MockHALLog *log = mock_hal_log();
+
+	CHECK(log->errors == 0, "%zu bus errors", log->errors);
+	CHECK(log->dma_starts > 0, "nothing went through DMA");
+	CHECK(log->blocking_calls > 0, "reads and oversized frames didn't use the blocking path");
+	CHECK(log->transfers_used == ref->transfers_used, "%zu transfers, %zu expected", log->transfers_used, ref->transfers_used);
+
+	for (size_t i=0; i<log->transfers_used && i<ref->transfers_used; i++) {
+		const MockHALTransfer *t = &log->transfers[i], *t_ref = &ref->transfers[i];
+
+		// A window either goes out whole through DMA or whole the blocking way
+		CHECK(t->dma_len == 0 || t->dma_len == t->len, "transfer %zu mixes DMA and blocking bytes", i);
+
+		if (t->len != t_ref->len || memcmp(t->data, t_ref->data, t->len) != 0) {
+			CHECK(0, "transfer %zu differs: %u bytes, %u expected", i, t->len, t_ref->len);
+			break;
+		}
+	}
+
+	if (expect_overlap) {
+		CHECK(st.returned_early > st.frames / 2, "only %zu of %zu flushes returned before their DMA finished", st.returned_early, st.frames);
+		CHECK(st.both_buffers > 0, "the second buffer was never queued behind a busy one");
+	}
+
+	printf("  %zu transfers, %zu through DMA, %zu flushes returned early, %zu with both buffers taken\n",
+	       log->transfers_used, log->dma_starts, st.returned_early, st.both_buffers);
+
+	retrowave_deinit_stm32_hal_spi(&ctx);
+	retrowave_deinit(&ctx);
+	mock_hal_deinit();
+}
+
+static int dma_state(int idx) {
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx.user_data;
+	return __atomic_load_n(&pctx->dma_buffers[idx].state, __ATOMIC_SEQ_CST);
+}
+
+static int dma_active() {
+	RetroWavePlatform_STM32_HAL_SPI *pctx = ctx.user_data;
+	return __atomic_load_n(&pctx->dma_active, __ATOMIC_SEQ_CST);
+}
+
+static int idle() {
+	return !dma_active() && dma_state(0) == RetroWave_STM32_DMA_Free && dma_state(1) == RetroWave_STM32_DMA_Free;
+}
+
+// Steps through the hand-over between the submit path and the completion ISR one completion at a time
+static void run_dma_steps() {
+	puts("DMA, completions one at a time");
+
+	mock_hal_init(tx_complete, &ctx);
+	mock_hal_set_manual(1);
+
+	CHECK(retrowave_init_stm32_hal_spi_dma(&ctx, NULL, NULL, 0, 512) == 0, "init failed");
+
+	const MockHALLog *log = mock_hal_log();
+
+	// Idle: the submit path wins dma_active and starts the transfer itself
+	retrowave_opl3_queue_port0(&ctx, 0x20, 0x01);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_starts == 1 && dma_active(), "first frame didn't start");
+	CHECK(dma_state(0) == RetroWave_STM32_DMA_Busy && dma_state(1) == RetroWave_STM32_DMA_Free, "first frame isn't in buffer 0");
+
+	// Busy: the next frame, with two boards, waits in the other buffer
+	retrowave_opl3_queue_port0(&ctx, 0x40, 0x02);
+	retrowave_miniblaster_queue(&ctx, 0x1c, 0x01);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_starts == 1, "second frame started while the first was busy");
+	CHECK(dma_state(1) == RetroWave_STM32_DMA_Queued, "second frame isn't queued in buffer 1");
+
+	// The ISR hands over to the queued buffer without dropping dma_active
+	mock_hal_dma_complete();
+
+	CHECK(log->dma_starts == 2 && dma_active(), "completion didn't start the queued frame");
+	CHECK(dma_state(0) == RetroWave_STM32_DMA_Free && dma_state(1) == RetroWave_STM32_DMA_Busy, "buffers not handed over");
+
+	// Next window of the same buffer, in its own chip select window
+	mock_hal_dma_complete();
+
+	CHECK(log->dma_starts == 3 && dma_state(1) == RetroWave_STM32_DMA_Busy, "second window didn't start");
+
+	mock_hal_dma_complete();
+
+	CHECK(idle(), "not idle after the last window");
+
+	// Idle again, so the submit path owns the start once more
+	retrowave_opl3_queue_port1(&ctx, 0x05, 0x01);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_starts == 4 && dma_state(0) == RetroWave_STM32_DMA_Busy, "frame after idle didn't start");
+
+	mock_hal_dma_complete();
+
+	CHECK(log->errors == 0, "%zu bus errors", log->errors);
+	CHECK(log->transfers_used == 4, "%zu transfers, 4 expected", log->transfers_used);
+
+	for (size_t i=0; i<log->transfers_used; i++)
+		CHECK(log->transfers[i].dma_len == log->transfers[i].len, "transfer %zu didn't go through DMA", i);
+
+	retrowave_deinit_stm32_hal_spi(&ctx);
+	retrowave_deinit(&ctx);
+	mock_hal_deinit();
+}
+
+// A DMA start the HAL turns down never completes, so that window and the rest of its buffer have to go out blocking
+static void run_dma_failed_starts() {
+	puts("DMA, failed starts");
+
+	mock_hal_init(tx_complete, &ctx);
+	mock_hal_set_manual(1);
+
+	CHECK(retrowave_init_stm32_hal_spi_dma(&ctx, NULL, NULL, 0, 512) == 0, "init failed");
+
+	const MockHALLog *log = mock_hal_log();
+
+	// In the submit path
+	mock_hal_fail_dma_starts(1);
+	retrowave_opl3_queue_port0(&ctx, 0x20, 0x01);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_failed == 1 && log->dma_starts == 0, "start wasn't turned down");
+	CHECK(idle(), "not idle after a failed start in the submit path");
+
+	// In the ISR, handing over to a queued buffer with two windows
+	retrowave_opl3_queue_port0(&ctx, 0x40, 0x02);
+	retrowave_flush(&ctx);
+	retrowave_opl3_queue_port1(&ctx, 0x41, 0x03);
+	retrowave_miniblaster_queue(&ctx, 0x1c, 0x01);
+	retrowave_flush(&ctx);
+
+	// The failed frame took buffer 0, so this time the busy one is buffer 1
+	CHECK(log->dma_starts == 1 && dma_state(1) == RetroWave_STM32_DMA_Busy && dma_state(0) == RetroWave_STM32_DMA_Queued, "second frame isn't queued");
+
+	mock_hal_fail_dma_starts(1);
+	mock_hal_dma_complete();
+
+	CHECK(log->dma_failed == 2 && log->dma_starts == 1, "hand-over start wasn't turned down");
+	CHECK(idle(), "not idle after a failed start in the ISR");
+
+	// In the ISR, between two windows of the same buffer
+	retrowave_opl3_queue_port1(&ctx, 0x42, 0x04);
+	retrowave_miniblaster_queue(&ctx, 0x1d, 0x02);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_starts == 2 && dma_active(), "third frame didn't start");
+
+	mock_hal_fail_dma_starts(1);
+	mock_hal_dma_complete();
+
+	CHECK(log->dma_failed == 3 && idle(), "not idle after a failed start mid-buffer");
+
+	// And DMA carries on afterwards
+	retrowave_opl3_queue_port0(&ctx, 0x43, 0x05);
+	retrowave_flush(&ctx);
+
+	CHECK(log->dma_starts == 3 && dma_active(), "frame after the failures didn't start");
+
+	mock_hal_dma_complete();
+
+	CHECK(idle() && !mock_hal_dma_busy(), "not idle at the end");
+	CHECK(log->errors == 0, "%zu bus errors", log->errors);
+	CHECK(log->empty_selects == 3, "%zu empty chip select pulses, 3 expected", log->empty_selects);
+	CHECK(log->transfers_used == 7, "%zu transfers, 7 expected", log->transfers_used);
+
+	const int through_dma[7] = {0, 1, 0, 0, 1, 0, 1};
+
+	for (size_t i=0; i<log->transfers_used && i<7; i++) {
+		const MockHALTransfer *t = &log->transfers[i];
+		CHECK(t->len > 0 && t->dma_len == (through_dma[i] ? t->len : 0), "transfer %zu went the wrong way", i);
+	}
+
+	retrowave_deinit_stm32_hal_spi(&ctx);
+	retrowave_deinit(&ctx);
+	mock_hal_deinit();
+}
+
+int main() {
+	// A lost completion leaves the spin waits hanging, which counts as a failure too
+	alarm(120);
+
+	const uint32_t seed = 20211001;
+
+	run_dma_steps();
+	run_dma_failed_starts();
+
+	MockHALLog ref = run_blocking(seed);
+
+	// Completing right away races the ISR with the submit path on every frame
+	for (int i=0; i<5; i++)
+		run_dma(&ref, seed, 0, 0, 0);
+
+	run_dma(&ref, seed, 0, 20000, 0);
+	run_dma(&ref, seed, 200, 0, 1);
+	run_dma(&ref, seed, 50, 50000, 0);
+
+	for (size_t i=0; i<ref.transfers_used; i++)
+		free(ref.transfers[i].data);
+
+	free(ref.transfers);
+
+	puts(check_failures ? "FAIL" : "PASS");
+
+	return check_failures ? 1 : 0;
+}
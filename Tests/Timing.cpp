@@ -0,0 +1,292 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+// The playback scheduler on the virtual clock. Each test can be run alone by name.
+
+#include <map>
+
+#include "VirtualPlayback.hpp"
+#include "Check.h"
+
+static void test_drift() {
+	// 24 hours of VGM waits, from the shortest to the longest there is
+	const uint32_t waits[] = {735, 882, 1, 7, 16, 65535, 12345, 441};
+	const uint64_t total = 24ULL * 3600 * RetroWavePlayer::sample_rate;
+
+	VirtualPlayback vp;
+	uint64_t last_wait = 0;
+	int64_t worst = 0;
+
+	vp.play(total, [&](size_t i) {
+		// The last frame went out at the start of its wait, to the nanosecond it truncates to
+		int64_t err = vp.error_nsec(vp.player.played_samples - last_wait);
+
+		if (llabs(err) > llabs(worst))
+			worst = err;
+
+		last_wait = waits[i % (sizeof(waits) / sizeof(waits[0]))];
+
+		return last_wait;
+	});
+
+	CHECK(vp.player.played_samples == total, "played %zu samples, %" PRIu64 " expected", vp.player.played_samples, total);
+	CHECK(vp.error_nsec() == 0, "ends %" PRId64 " ns off after 24 hours", vp.error_nsec());
+	CHECK(worst >= -1 && worst <= 0, "a deadline was %" PRId64 " ns off", worst);
+	CHECK(vp.player.sched_stats.deadline_misses == 0, "%zu deadline misses", vp.player.sched_stats.deadline_misses);
+}
+
+static void test_ttw() {
+	VirtualPlayback vp;
+	auto &p = vp.player;
+
+	// Serial frames are estimated by what they pack into, at the 2 Mbaud seed
+	p.ttw_setup("tty", "auto");
+	CHECK(p.ttw_estimate(700) == 5000ULL * (800 + 2), "700 command bytes over tty take %" PRIu64 " ns", p.ttw_estimate(700));
+
+	// A link of 2 us per byte, which the estimate has to find on its own
+	p.ttw_setup("null", "auto");
+	p.null_nsec_per_byte = 2000;
+
+	// 30 seconds to learn it, then each frame has to be started early enough to be out by its deadline
+	const size_t learn_frames = 30 * 60;
+
+	vp.play(90 * RetroWavePlayer::sample_rate, [&](size_t i) {
+		if (i == learn_frames) {
+			CHECK(fabs(p.ttw_nsec_per_byte - 2000) < 20, "measured %.1f ns/byte, 2000 expected", p.ttw_nsec_per_byte.load());
+			p.sched_stats = {};
+		}
+
+		for (int j=0; j<20; j++)
+			retrowave_opl3_queue_port0(&p.rtctx, 0xa0 + j % 9, i + j);
+
+		return 735;
+	});
+
+	auto &st = p.sched_stats;
+	double land_avg = st.land_err_sum_nsec / st.flushes;
+
+	CHECK(fabs(land_avg) < 1000 && st.land_err_max_nsec < 5000, "frames land %.1f us off on average, %.1f us at most",
+	      land_avg / 1000, st.land_err_max_nsec / 1000);
+	CHECK(st.deadline_misses == 0, "%zu deadline misses", st.deadline_misses);
+}
+
+static void test_overrun() {
+	// 10 minutes of 60 Hz frames, with the host stalling for 50 ms every 5 seconds right after a flush.
+	// The 2 frames due during a stall are late, by 33.3 and 16.7 ms.
+	const uint64_t total = 600ULL * RetroWavePlayer::sample_rate;
+	const size_t frames = 600 * 60, stalls = 600 / 5;
+	const uint64_t stall_nsec = 50 * 1000 * 1000, lost_nsec = stall_nsec - 735ULL * 1000000000 / RetroWavePlayer::sample_rate;
+
+	for (auto policy : {RetroWavePlayer::Overrun_Burst, RetroWavePlayer::Overrun_Merge, RetroWavePlayer::Overrun_Rebase}) {
+		VirtualPlayback vp;
+		auto &st = vp.player.sched_stats;
+
+		vp.player.overrun_policy = policy;
+
+		vp.play(total, [&](size_t i) {
+			if (i % 300 == 150)
+				vp.stall(stall_nsec);
+
+			return 735;
+		});
+
+		printf("%-6s: %zu misses, %.3f ms max late, %zu flushes, %zu merged, %zu rebased, ends %.3f ms late\n",
+		       RetroWavePlayer::overrun_policy_name(policy), st.deadline_misses, st.late_max_nsec / 1000000, st.flushes,
+		       st.merged_frames, st.rebases, (double)vp.error_nsec() / 1000000);
+
+		CHECK(fabs(st.late_max_nsec - lost_nsec) < 1000, "%.3f ms late at most, %.3f expected", st.late_max_nsec / 1000000, (double)lost_nsec / 1000000);
+
+		switch (policy) {
+			case RetroWavePlayer::Overrun_Burst:
+				// Every frame due during a stall is late, and they all go out one by one right after
+				CHECK(st.deadline_misses == stalls * 2, "%zu misses, %zu expected", st.deadline_misses, stalls * 2);
+				CHECK(st.flushes == frames && !st.merged_frames && !st.rebases, "frames were merged or rebased");
+				CHECK(vp.error_nsec() == 0, "ends %" PRId64 " ns off", vp.error_nsec());
+				break;
+			case RetroWavePlayer::Overrun_Merge:
+				// The frames that are overdue together go out in one flush
+				CHECK(st.deadline_misses == stalls * 2, "%zu misses, %zu expected", st.deadline_misses, stalls * 2);
+				CHECK(st.merged_frames == stalls, "%zu merged, %zu expected", st.merged_frames, stalls);
+				CHECK(st.flushes == frames - st.merged_frames, "%zu flushes for %zu frames with %zu merged", st.flushes, frames, st.merged_frames);
+				CHECK(vp.error_nsec() == 0, "ends %" PRId64 " ns off", vp.error_nsec());
+				break;
+			default:
+				// The first late frame gives up the time it's late, the rest keep their spacing from there
+				CHECK(st.deadline_misses == stalls && st.rebases == stalls, "%zu misses and %zu rebases, %zu expected", st.deadline_misses, st.rebases, stalls);
+				CHECK(st.flushes == frames, "%zu flushes, %zu expected", st.flushes, frames);
+				CHECK(llabs(vp.error_nsec() - (int64_t)(stalls * lost_nsec)) < 1000 * 1000, "ends %" PRId64 " ns late, %" PRIu64 " expected",
+				      vp.error_nsec(), stalls * lost_nsec);
+				break;
+		}
+	}
+}
+
+static void test_quantum() {
+	// A minute of 1-16 sample waits, like streamed PCM, batched into flushes of at least the quantum
+	const uint64_t total = 60ULL * RetroWavePlayer::sample_rate;
+
+	for (uint32_t quantum_usecs : {0, 100, 250, 500, 1000, 2000, 5000}) {
+		VirtualPlayback vp;
+		auto &p = vp.player;
+		auto &st = p.sched_stats;
+
+		p.flush_quantum_samples = (uint64_t)quantum_usecs * RetroWavePlayer::sample_rate / 1000000;
+
+		// A flush shows up in the next frame, by then played_samples is at the end of its batch
+		size_t last_flushes = 0;
+		uint64_t last_batch_end = 0, batch_min = UINT64_MAX, batch_max = 0;
+
+		vp.play(total, [&](size_t i) {
+			if (st.flushes != last_flushes) {
+				uint64_t batch = p.played_samples - last_batch_end;
+
+				batch_min = std::min(batch_min, batch);
+				batch_max = std::max(batch_max, batch);
+				last_flushes = st.flushes;
+				last_batch_end = p.played_samples;
+			}
+
+			retrowave_opl3_queue_port0(&p.rtctx, 0xa0, i);
+
+			return i % 16 + 1;
+		});
+
+		double quantum_nsec = (double)p.flush_quantum_samples * 1000000000 / RetroWavePlayer::sample_rate;
+
+		printf("quantum %4" PRIu32 " us: %7.0lf flushes/s, batches of %" PRIu64 "-%" PRIu64 " samples, writes %7.1lf us early avg, %7.1lf us max, ends %" PRId64 " ns off\n",
+		       quantum_usecs, (double)st.flushes / 60, batch_min, batch_max,
+		       st.batched_frames ? st.early_sum_nsec / st.batched_frames / 1000 : 0, st.early_max_nsec / 1000, vp.error_nsec());
+
+		// A batch closes with the wait that takes it to the quantum, so it spans less than one more wait past it
+		uint64_t lo = std::max<uint64_t>(p.flush_quantum_samples, 1), hi = p.flush_quantum_samples + 15;
+
+		if (!p.flush_quantum_samples)
+			hi = 16;
+
+		CHECK(batch_min >= lo && batch_max <= hi, "batches of %" PRIu64 "-%" PRIu64 " samples, %" PRIu64 "-%" PRIu64 " expected", batch_min, batch_max, lo, hi);
+
+		// Writes go out at the start of their batch, never a whole quantum early
+		CHECK(st.early_max_nsec < quantum_nsec || (!quantum_nsec && !st.early_max_nsec), "writes went out %.1f us early, the quantum is %.1f us",
+		      st.early_max_nsec / 1000, quantum_nsec / 1000);
+		CHECK(vp.error_nsec() == 0, "ends %" PRId64 " ns off", vp.error_nsec());
+		CHECK(st.deadline_misses == 0, "%zu deadline misses", st.deadline_misses);
+	}
+}
+
+static void test_simulate() {
+	// 5 minutes of 60 Hz frames with 4-400 OPL3 writes each, over a link of 1 us per byte and 20 us per transfer
+	const uint64_t total = 300ULL * RetroWavePlayer::sample_rate;
+
+	VirtualPlayback vp;
+	auto &p = vp.player;
+	auto &st = p.sched_stats;
+
+	p.ttw_setup("null", "auto");
+	p.null_nsec_per_byte = 1000;
+	p.null_nsec_per_transfer = 20 * 1000;
+
+	timespec wall_start, wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+	vp.play(total, [&](size_t i) {
+		size_t writes = 4 + (i * 7919) % 397;
+
+		for (size_t j=0; j<writes; j++)
+			retrowave_opl3_queue_port0(&p.rtctx, 0xa0 + j % 9, j);
+
+		return 735;
+	});
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+	double wall_secs = (double)RetroWavePlayer::timespec_diff_nsec(wall_end, wall_start) / 1000000000;
+
+	printf("info: 300 s played in %.3lf s, ended %.3lf ms after the last deadline\n", wall_secs, (double)vp.error_nsec() / 1000000);
+	p.sched_report();
+
+	// Every transfer took its modelled time on the clock, and the link never fell behind
+	auto &io = p.rtctx.io_stats;
+
+	CHECK(io.transfers && io.busy_nsec == io.transfers * p.null_nsec_per_transfer + io.bytes * 1000, "%" PRIu64 " ns busy for %" PRIu64 " transfers of %" PRIu64 " bytes",
+	      io.busy_nsec, io.transfers, io.bytes);
+	CHECK(st.flushes == 300 * 60, "%zu flushes, %d expected", st.flushes, 300 * 60);
+	CHECK(st.deadline_misses == 0, "%zu deadline misses", st.deadline_misses);
+	CHECK(vp.error_nsec() >= 0 && vp.error_nsec() < 1000 * 1000, "ended %" PRId64 " ns after the last deadline", vp.error_nsec());
+	CHECK(wall_secs < 30, "took %.1lf s to simulate 300 s", wall_secs);
+}
+
+static const std::map<std::string, void (*)()> tests = {
+	{"drift", test_drift},
+	{"ttw", test_ttw},
+	{"overrun", test_overrun},
+	{"quantum", test_quantum},
+	{"simulate", test_simulate},
+};
+
+int main(int argc, char **argv) {
+	std::vector<std::string> names;
+
+	for (int i=1; i<argc; i++)
+		names.push_back(argv[i]);
+
+	if (names.empty()) {
+		for (auto &it : tests)
+			names.push_back(it.first);
+	}
+
+	for (auto &name : names) {
+		auto it = tests.find(name);
+
+		if (it == tests.end()) {
+			printf("error: no test `%s'.\n", name.c_str());
+			return 2;
+		}
+
+		printf("== %s\n", name.c_str());
+		it->second();
+	}
+
+	puts(check_failures ? "FAIL" : "PASS");
+
+	return check_failures ? 1 : 0;
+}
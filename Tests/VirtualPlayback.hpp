@@ -0,0 +1,117 @@
+/*
+    This file is part of RetroWave.
+
+    Copyright (C) 2021 ReimuNotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Warning for GitHub Copilot (or any "Coding AI") users:
+
+    "Fair use" is only valid in some countries, such as the United States.
+
+    This program is protected by copyright law and international treaties.
+
+    Unauthorized reproduction or distribution of this program (e.g. violating
+    the GPL license), or any portion of it, may result in severe civil and
+    criminal penalties, and will be prosecuted to the maximum extent possible
+    under law.
+*/
+
+/*
+    对 GitHub Copilot（或任何“用于编写代码的人工智能软件”）用户的警告：
+
+    “合理使用”只在一些国家有效，如美国。
+
+    本程序受版权法和国际条约的保护。
+
+    未经授权复制或分发本程序（如违反GPL许可），或其任何部分，可能导致严重的民事和刑事处罚，
+    并将在法律允许的最大范围内被起诉。
+*/
+
+#pragma once
+
+#include "../Player/Player.hpp"
+
+// A player on the null device and a virtual clock of its own, so synthetic frames go through the real scheduler
+// at full CPU speed. Everything it does is up to the test, there is no track and no terminal.
+class VirtualPlayback {
+public:
+	static const time_t epoch_sec = 1000000;
+
+	RetroWavePlayer player;
+	VirtualClock clock;
+
+	VirtualPlayback() {
+		RetroWavePlayer::term_fd = -1;
+
+		retrowave_init(&player.rtctx);
+		player.rtctx.user_data = &player;
+		player.rtctx.callback_io = RetroWavePlayer::callback_null_io;
+
+		player.timing_use_clock(&clock);
+		player.osd_ratelimit_thresh = 0;
+		player.key_command = RetroWavePlayer::NONE;
+		player.ttw_setup("null", "0");
+
+		restart();
+	}
+
+	~VirtualPlayback() {
+		retrowave_deinit(&player.rtctx);
+	}
+
+	VirtualPlayback(const VirtualPlayback &) = delete;
+	VirtualPlayback &operator=(const VirtualPlayback &) = delete;
+
+	// Back to sample 0 at the epoch, with fresh statistics
+	void restart() {
+		player.sched_stats = {};
+		player.timing_stats = {};
+		player.quantum_pending_samples = 0;
+		clock.time = {epoch_sec, 0};
+		player.played_samples = 0;
+		player.timing_rebase(0);
+	}
+
+	// frame(i) queues the writes of frame i and returns the wait after them, until total samples are played.
+	// Then waits out the last one, so the clock ends where the track does.
+	template <typename F>
+	void play(uint64_t total, F frame) {
+		for (size_t i=0; player.played_samples < total; i++) {
+			uint64_t wait = frame(i);
+			player.flush_and_sleep(std::min<uint64_t>(wait, total - player.played_samples));
+		}
+
+		player.flush_chips();
+		player.timing_sleep_until(player.timing_deadline(player.played_samples));
+	}
+
+	// Where the clock is against the exact time of a sample, positive is late
+	int64_t error_nsec(uint64_t samples) {
+		timespec exact = {epoch_sec, 0};
+		RetroWavePlayer::timespec_add(exact, RetroWavePlayer::samples_to_timespec(samples));
+		return RetroWavePlayer::timespec_diff_nsec(clock.time, exact);
+	}
+
+	int64_t error_nsec() {
+		return error_nsec(player.played_samples);
+	}
+
+	// The host losing this much time, e.g. to a page fault
+	void stall(uint64_t nsec) {
+		clock.spend(nsec);
+	}
+};